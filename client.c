@@ -1,17 +1,86 @@
-#include "mftputil.h"
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <glob.h>
 
-int get_response_code(int ctrlsock);
-void print_response(int res_code);
+#include "mftpclient.h"
+#include "mftphash.h"
+#include "mftpshape.h"
+
+#define PGET_STREAMS 4                 /* default streams of a segmented get */
+#define PGET_MAX_STREAMS 16
+#define PGET_MIN_SEGMENT (1024 * 1024) /* smaller files use fewer streams */
+#define PIPE_DEPTH 32                  /* commands in flight when pipelining */
+#define MGET_WORKERS 4                 /* default workers of mget/mput */
+#define MGET_MAX_WORKERS 16
+#define MGET_MAX_FILES 4096            /* files per mget/mput */
+
+/* commands sent without waiting for responses */
+typedef struct Pipeline
+{
+    int on;
+    Command inflight[PIPE_DEPTH]; /* oldest first from head */
+    int head;
+    int count;
+    uint32_t next_tag;
+} Pipeline;
+
+typedef struct PgetStream
+{
+    ClientSession *cs; /* session that started the get, read only */
+    int index;
+    const char *fname; /* file on server */
+    const char *cwd;   /* server directory of the session */
+    off_t offset;
+    size_t length;
+    ssize_t bytes;     /* bytes received, -1 if failed */
+} PgetStream;
+
+struct Batch;
+
+typedef struct BatchFile
+{
+    struct Batch *batch;
+    char *name;            /* same on both sides */
+    struct timespec mtime; /* given to the file once fetched, tv_nsec UTIME_OMIT to leave */
+} BatchFile;
+
+typedef struct Batch
+{
+    BatchFile *files;
+    int nfiles;
+    int upload;             /* put files, else get */
+    pthread_mutex_t lock;   /* guards the fields below */
+    int next;               /* next file to hand out */
+    int done;
+    int failed;
+    ssize_t bytes;
+    struct timespec start;
+} Batch;
 
-void ftp_client_login(int ctrlsock);
-int ftp_client_give_command(int ctrlsock, Command *cmd);
-int ftp_client_get_command(char *buffer, Command *cmd);
-int ftp_client_data_conn(int ctrlsock);
+void print_response(int res_code);
 
-void ftp_client_get_file(int ctrlsock, Command *cmd);
-void ftp_client_put_file(int ctrlsock, Command *cmd);
-void ftp_client_dir(int ctrlsock, Command *cmd);
-void ftp_client_chdir(int ctrlsock, Command *cmd);
+int repl_login(ClientSession *cs);
+int repl_get_command(char *buffer, Command *cmd);
+void repl_get(ClientSession *cs, Command *cmd);
+void repl_put(ClientSession *cs, Command *cmd);
+void repl_delta_put(ClientSession *cs, Command *cmd);
+void repl_pget(ClientSession *cs, Command *cmd);
+void repl_mget(ClientSession *cs, Command *cmd);
+void repl_mput(ClientSession *cs, Command *cmd);
+void repl_sync(ClientSession *cs, Command *cmd);
+void repl_dir(ClientSession *cs, Command *cmd);
+void repl_hash(ClientSession *cs, Command *cmd);
+void repl_verify(ClientSession *cs);
+void repl_rate(ClientSession *cs, Command *cmd);
+void repl_chdir(ClientSession *cs, Command *cmd);
+void repl_passive(ClientSession *cs);
+void repl_mode(ClientSession *cs, Command *cmd);
+void repl_profile(ClientSession *cs, Command *cmd);
+void repl_pipe(Pipeline *pl);
+int repl_pipe_can_send(ClientSession *cs, Command *cmd);
+void repl_pipe_send(ClientSession *cs, Pipeline *pl, Command *cmd);
+void repl_pipe_drain(ClientSession *cs, Pipeline *pl, int keep);
 
 int main(int argc, char const *argv[])
 {
@@ -23,61 +92,108 @@ int main(int argc, char const *argv[])
 
     const char *server_ip = argv[1];
     int port = atoi(argv[2]);
+
+    // unbuffered, so that poll() tells whether more input is waiting
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    // a server dropping a data connection must not kill the client
+    signal(SIGPIPE, SIG_IGN);
     
     // create socket for commands and connect to server
-    int ctrlsock;
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_aton(server_ip, (struct in_addr *) &server_addr.sin_addr.s_addr);
-
-    if ((ctrlsock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    ClientSession cs;
+    if (ftp_client_init(&cs, server_ip, port) < 0)
     {
-        close(ctrlsock);
-        error_exit("fail to create controlling socket");
+        fprintf(stderr, "%s: invalid server ip\n", server_ip);
+        exit(1);
     }
-
-    if (connect(ctrlsock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0)
-    {
-        close(ctrlsock);
+    if (ftp_client_connect(&cs) < 0)
         error_exit("fail to connect");
-    }
 
     printf("%s connected\n", server_ip);
-    print_response(get_response_code(ctrlsock));
+    print_response(CODE_SERVICE_READY);
 
     // try logining to server
-    ftp_client_login(ctrlsock);
-    print_response(get_response_code(ctrlsock));
+    print_response(repl_login(&cs));
 
     char input_buffer[MAX_BUF_SIZE];
     char output_buffer[MAX_BUF_SIZE];
     FILE *output_stream;
     Command cmd;
+    Pipeline pl;
     char *rm1ch_ptr;
+    memset(&pl, 0, sizeof(pl));
 
     while (1)
     {
+        // collect responses of pipelined commands before waiting for input
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (pl.count > 0 && poll(&pfd, 1, 0) == 0)
+            repl_pipe_drain(&cs, &pl, 0);
+
         // get command
-        if (ftp_client_get_command(input_buffer, &cmd) < 0)
+        if (repl_get_command(input_buffer, &cmd) < 0)
         {
             printf("Invalid command\n");
             continue;
         }
 
+        if (pl.on && repl_pipe_can_send(&cs, &cmd))
+        {
+            repl_pipe_send(&cs, &pl, &cmd);
+            continue;
+        }
+        repl_pipe_drain(&cs, &pl, 0);
+
         // 1. process locally run commands without functions
         // 2. send server commands with wrapped functions
         if (strcmp(cmd.command, "put") == 0)
-            ftp_client_put_file(ctrlsock, &cmd);
+            repl_put(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "dput") == 0)
+            repl_delta_put(&cs, &cmd);
 
         else if (strcmp(cmd.command, "get") == 0)
-            ftp_client_get_file(ctrlsock, &cmd);
+            repl_get(&cs, &cmd);
 
-        else if (strcmp(cmd.command, "ls") == 0 || strcmp(cmd.command, "pwd") == 0)
-            ftp_client_dir(ctrlsock, &cmd);
+        else if (strcmp(cmd.command, "pget") == 0)
+            repl_pget(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "mget") == 0)
+            repl_mget(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "mput") == 0)
+            repl_mput(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "sync") == 0)
+            repl_sync(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "ls") == 0 || strcmp(cmd.command, "pwd") == 0
+                 || strcmp(cmd.command, "mlsd") == 0 || strcmp(cmd.command, "stat") == 0)
+            repl_dir(&cs, &cmd);
 
         else if (strcmp(cmd.command, "cd") == 0)
-            ftp_client_chdir(ctrlsock, &cmd);
+            repl_chdir(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "pasv") == 0)
+            repl_passive(&cs);
+
+        else if (strcmp(cmd.command, "mode") == 0)
+            repl_mode(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "prof") == 0)
+            repl_profile(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "pipe") == 0)
+            repl_pipe(&pl);
+
+        else if (strcmp(cmd.command, "hash") == 0)
+            repl_hash(&cs, &cmd);
+
+        else if (strcmp(cmd.command, "vrfy") == 0)
+            repl_verify(&cs);
+
+        else if (strcmp(cmd.command, "rate") == 0)
+            repl_rate(&cs, &cmd);
 
         else if (strcmp(cmd.command, "!ls") == 0 || strcmp(cmd.command, "!pwd") == 0)
         {
@@ -106,15 +222,13 @@ int main(int argc, char const *argv[])
         }
         else if (strcmp(cmd.command, "quit") == 0)
         {
-            ftp_client_give_command(ctrlsock, &cmd);
-            int res_code = get_response_code(ctrlsock);
+            int res_code = ftp_client_quit(&cs);
             if (res_code != CODE_SERVICE_CLOSE_CTRL)
             {
                 printf("fail to get quitting response code\n");
-                continue;
+                break;
             }
 
-            close(ctrlsock);
             print_response(res_code);
             printf("quitted\n");
             break;
@@ -124,18 +238,6 @@ int main(int argc, char const *argv[])
     return 0;
 }
 
-/**
- * Receive response code from server
- * @param ctrlsock Socket for commands
- * @return host response code, -1 if failed
- */ 
-int get_response_code(int ctrlsock)
-{
-    int res_code = -1;
-    recv(ctrlsock, &res_code, sizeof(res_code), 0);
-    return res_code == -1 ? res_code : ntohl(res_code);
-}
-
 /**
  * Interpret response code
  * @param res_code host response code
@@ -168,6 +270,15 @@ void print_response(int res_code)
         case CODE_CMD_BAD_SEQ:
             printf("Command has bad sequence [%d]\n", CODE_CMD_BAD_SEQ);
             break;
+        case CODE_NO_SPACE:
+            printf("Not enough space on server [%d]\n", CODE_NO_SPACE);
+            break;
+        case CODE_SERVICE_NOT_AVAIL:
+            printf("Service not available, try later [%d]\n", CODE_SERVICE_NOT_AVAIL);
+            break;
+        case CODE_ENTER_PASV:
+            printf("Entering passive mode [%d]\n", CODE_ENTER_PASV);
+            break;
         case CODE_SERVICE_CLOSE_CTRL:
             printf("Close connection [%d]\n", CODE_SERVICE_CLOSE_CTRL);
             break;
@@ -179,14 +290,13 @@ void print_response(int res_code)
 
 /**
  * Gets username & password and sends for validation
- * @param ctrlsock Socket for commands
- */ 
-void ftp_client_login(int ctrlsock)
+ * @param cs Pointer to client session
+ * @return response code of login, -1 if failed
+ */
+int repl_login(ClientSession *cs)
 {
-    Command cmd;
     char usrname[MAX_BUF_SIZE];
     memset(usrname, 0, MAX_BUF_SIZE);
-    int res_code;
 
     printf("username: ");
     fflush(stdout);
@@ -196,43 +306,9 @@ void ftp_client_login(int ctrlsock)
         usrname[strcspn(usrname, "\n")] = '\0';
     }
 
-    strcpy(cmd.command, "user");
-    strcpy(cmd.arg, usrname);
-    ftp_client_give_command(ctrlsock, &cmd);
-
-    if (recv(ctrlsock, &res_code, sizeof(res_code), 0) < 0)
-        error_exit("fail to receive response");
-
-    if (ntohl(res_code) != CODE_NEED_PASS)
-    {
-        printf("internal service error");
-        exit(1);
-    }
-
     fflush(stdout);
     char *password = getpass("password: ");
-    strcpy(cmd.command, "pass");
-    strcpy(cmd.arg, password);
-    ftp_client_give_command(ctrlsock, &cmd);
-}
-
-/**
- * Sends commands to server
- * @param ctrlsock Socket for commands
- * @param cmd Pointer to struct command
- * @return success or not
- */ 
-int ftp_client_give_command(int ctrlsock, Command *cmd)
-{
-    char buffer[MAX_BUF_SIZE];
-    memset(buffer, 0, MAX_BUF_SIZE);
-    sprintf(buffer, "%s %s", cmd->command, cmd->arg);
-    if (send(ctrlsock, buffer, sizeof(buffer), 0) < 0)
-    {
-        perror("fail to command");
-        return -1;
-    }
-    return 0;
+    return ftp_client_auth(cs, usrname, password);
 }
 
 /**
@@ -241,11 +317,12 @@ int ftp_client_give_command(int ctrlsock, Command *cmd)
  * @param cmd Pointer to struct command to hold valid one
  * @return valid or not
  */
-int ftp_client_get_command(char *buffer, Command *cmd)
+int repl_get_command(char *buffer, Command *cmd)
 {
     memset(buffer, 0, MAX_BUF_SIZE);
     memset(cmd->command, 0, sizeof(cmd->command));
     memset(cmd->arg, 0, sizeof(cmd->arg));
+    cmd->tag = 0;
     
     printf("mftp> ");
     fflush(stdout);
@@ -261,17 +338,25 @@ int ftp_client_get_command(char *buffer, Command *cmd)
         buffer[strcspn(buffer, "\n")] = '\0';
 
     // TODO: not ideal user input
+    // argument is the rest of the line
     char *p = NULL;
     p = strtok(buffer, " ");
-    p = strtok(NULL, " ");
+    p = strtok(NULL, "");
     if (strcmp(buffer, "put") == 0 || strcmp(buffer, "get") == 0
-        || strcmp(buffer, "cd") == 0 || strcmp(buffer, "!cd") == 0)
+        || strcmp(buffer, "cd") == 0 || strcmp(buffer, "!cd") == 0
+        || strcmp(buffer, "mode") == 0 || strcmp(buffer, "pget") == 0
+        || strcmp(buffer, "mget") == 0 || strcmp(buffer, "mput") == 0
+        || strcmp(buffer, "prof") == 0 || strcmp(buffer, "dput") == 0
+        || strcmp(buffer, "hash") == 0 || strcmp(buffer, "rate") == 0
+        || strcmp(buffer, "sync") == 0)
     {
         // must have arg
         if (p == NULL) return -1;
     }
     else if (strcmp(buffer, "pwd") == 0 || strcmp(buffer, "!pwd") == 0
-        || strcmp(buffer, "quit") == 0)
+        || strcmp(buffer, "quit") == 0 || strcmp(buffer, "pasv") == 0
+        || strcmp(buffer, "pipe") == 0 || strcmp(buffer, "mlsd") == 0
+        || strcmp(buffer, "vrfy") == 0 || strcmp(buffer, "stat") == 0)
     {
         // must not have arg
         if (p != NULL) return -1;
@@ -290,140 +375,769 @@ int ftp_client_get_command(char *buffer, Command *cmd)
 }
 
 /**
- * Creates socket for data and accept connection
- * @param ctrlsock Socket for commands
- * @return socket for data, exit if failed
+ * Prints how a transfer went: what was done, throughput, how well
+ * the file compressed in mode z, and the response
+ * @param cs Pointer to client session
+ * @param fname String file name
+ * @param done String what was done, e.g. "retrieved"
+ * @param x Pointer to outcome
+ */
+static void print_xfer(ClientSession *cs, const char *fname, const char *done, ClientXfer *x)
+{
+    if (x->local_errno != 0)
+        fprintf(stderr, "%s: %s\n", fname, strerror(x->local_errno));
+    if (x->transferred)
+    {
+        printf("%s is %s\n", fname, done);
+        if (x->bytes > 0)
+            xfer_clock_report(stdout, x->bytes, &x->clock);
+        if (x->bytes > 0 && cs->zlevel)
+            printf("%zu bytes as %zu on the wire (ratio %.2f)%s\n",
+                   x->zstats.file_bytes, x->zstats.wire_bytes,
+                   x->zstats.wire_bytes > 0 ? (double) x->zstats.file_bytes / x->zstats.wire_bytes : 0,
+                   x->zstats.gave_up ? ", compression off after the first part: ratio too poor" : "");
+    }
+    if (x->res_code != 0)
+        print_response(x->res_code);
+}
+
+/**
+ * Prints whether server has the same CRC32C of a file under vrfy
+ * @param cs Pointer to client session
+ * @param fname String file name
+ * @param x Pointer to outcome
+ */
+static void print_crc(ClientSession *cs, const char *fname, ClientXfer *x)
+{
+    if (!cs->verify || x->bytes < 0)
+        return;
+    if (x->verified < 0)
+        printf("%s: fail to get checksum from server\n", fname);
+    else if (x->verified)
+        printf("%s: crc32c %08x verified\n", fname, x->crc);
+    else
+        printf("%s: crc32c %08x, server has %08x, MISMATCH\n", fname, x->crc, x->server_crc);
+}
+
+/**
+ * Downloads file from server
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
  */ 
-int ftp_client_data_conn(int ctrlsock)
+void repl_get(ClientSession *cs, Command *cmd)
 {
-    int lstnsock, datasock;
-    if ((lstnsock = create_socket(CLIENT_DATA_PORT)) < 0)
-        error_exit("fail to create socket");
+    ClientXfer x;
+    ftp_client_get(cs, cmd->arg, cmd->arg, &x);
+    print_xfer(cs, cmd->arg, "retrieved", &x);
+    print_crc(cs, cmd->arg, &x);
+}
 
-    // inform server to connect
-    if (send(ctrlsock, &(int) {1}, sizeof(int), 0) < 0)
-        error_exit("fail to ack server");
+/**
+ * Uploads file to server
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */ 
+void repl_put(ClientSession *cs, Command *cmd)
+{
+    ClientXfer x;
+    ftp_client_put(cs, cmd->arg, cmd->arg, &x);
+    if (x.res_code == CODE_CMD_BAD_SEQ)
+        printf("Operation not allowed: file with same name exists on server\n");
+    print_xfer(cs, cmd->arg, "uploaded", &x);
+    print_crc(cs, cmd->arg, &x);
+}
 
-    if ((datasock = accept(lstnsock, NULL, NULL)) < 0)
-        error_exit("fail to accept socket");
+/**
+ * Uploads a file by sending only what differs from the copy on server
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_delta_put(ClientSession *cs, Command *cmd)
+{
+    ClientXfer x;
+    ftp_client_delta_put(cs, cmd->arg, cmd->arg, &x);
+    if (x.whole)
+    {
+        printf("%s: no copy on server to update, putting it whole\n", cmd->arg);
+        print_xfer(cs, cmd->arg, "uploaded", &x);
+        print_crc(cs, cmd->arg, &x);
+        return;
+    }
+    if (x.local_errno != 0)
+        fprintf(stderr, "%s: no such file\n", cmd->arg);
+    if (x.transferred)
+    {
+        // done message
+        if (x.res_code == CODE_CLOSE_DATA_CONN)
+            printf("%s is updated\n", cmd->arg);
+        else
+            printf("%s is not updated, the copy on server is unchanged\n", cmd->arg);
+        if (x.bytes > 0)
+        {
+            xfer_clock_report(stdout, x.bytes, &x.clock);
+            printf("%zu bytes matched, %zu literal, %zu on the wire\n",
+                   x.dstats.matched_bytes, x.dstats.literal_bytes, x.dstats.wire_bytes);
+        }
+    }
+    if (x.res_code != 0)
+        print_response(x.res_code);
+}
 
-    close(lstnsock);
-    return datasock;
+/**
+ * Sends commands (ls, mlsd, pwd, stat) and prints output
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */ 
+void repl_dir(ClientSession *cs, Command *cmd)
+{
+    int rc = ftp_client_list(cs, cmd->command, cmd->arg, stdout);
+    if (rc > 0)
+        print_response(rc); // error res_code
 }
 
 /**
- * Downloads file from server
- * @param ctrlsock Socket for commands
+ * Commands server to cd
+ * @param cs Pointer to client session
  * @param cmd Pointer to struct command
  */ 
-void ftp_client_get_file(int ctrlsock, Command *cmd)
+void repl_chdir(ClientSession *cs, Command *cmd)
+{
+    // does not use data port
+    print_response(ftp_client_command(cs, cmd->command, cmd->arg));
+}
+
+/**
+ * Toggles passive mode: in passive mode the client connects
+ * to a data port the server opened, which works behind NAT
+ * and lets several transfers of one host run at the same time
+ * @param cs Pointer to client session
+ */
+void repl_passive(ClientSession *cs)
+{
+    int on = !cs->passive;
+    int res_code = ftp_client_passive(cs, on);
+    if (on && res_code < 0)
+        error_exit("fail to receive passive port");
+    print_response(res_code);
+
+    if (on && res_code == CODE_ENTER_PASV)
+        printf("Passive mode on, data port %d\n", cs->pasv_port);
+    else if (!on && res_code == CODE_VALID_CMD)
+        printf("Passive mode off\n");
+}
+
+/**
+ * Switches transfer mode: "mode b", "mode z [level]" or "mode s"
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_mode(ClientSession *cs, Command *cmd)
+{
+    print_response(ftp_client_mode(cs, cmd->arg));
+}
+
+/**
+ * Picks the transfer profile of the session, on both ends: "prof <name>"
+ * with default, lan, wan or auto, which measures the first megabytes
+ * of a transfer and grows chunks and socket buffers to match
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_profile(ClientSession *cs, Command *cmd)
 {
-    // send commands and get response
-    ftp_client_give_command(ctrlsock, cmd);
-    int res_code = get_response_code(ctrlsock);
-    if (res_code != CODE_OPEN_DATA_CONN)
+    XferProfile prof;
+    if (xfer_profile_get(cmd->arg, &prof) < 0)
     {
-        print_response(res_code); // unavailable file
+        printf("Unknown profile, choose default, lan, wan or auto\n");
         return;
     }
-    
-    // start downloading if permitted
-    int datasock = ftp_client_data_conn(ctrlsock);
-    char data[MAX_BUF_SIZE];
+    print_response(ftp_client_profile(cs, cmd->arg));
+}
 
-    FILE *fp = fopen(cmd->arg, "w"); // TODO: check
-    recv_save_file(data, MAX_BUF_SIZE, datasock, fp);
-    close(datasock);
-    fclose(fp);
+/**
+ * Toggles pipelining: commands that need no input from the client
+ * between their responses are sent without waiting, up to PIPE_DEPTH
+ * of them, and their responses are matched by tag later
+ * @param pl Pointer to pipeline
+ */
+void repl_pipe(Pipeline *pl)
+{
+    pl->on = !pl->on;
+    printf("Pipelining %s\n", pl->on ? "on" : "off");
+}
 
-    // done message
-    printf("%s is retrieved\n", cmd->arg);
-    print_response(get_response_code(ctrlsock));
+/**
+ * Whether a command may be sent while others are in flight; get needs
+ * passive mode since an active data connection is acked on the control
+ * connection, where it would mix with the queued commands
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ * @return non-zero if it can be pipelined
+ */
+int repl_pipe_can_send(ClientSession *cs, Command *cmd)
+{
+    return strcmp(cmd->command, "cd") == 0
+           || (strcmp(cmd->command, "get") == 0 && cs->passive);
 }
 
 /**
- * Uploads file to server
- * @param ctrlsock Socket for commands
+ * Sends a command tagged without waiting for its response
+ * @param cs Pointer to client session
+ * @param pl Pointer to pipeline
  * @param cmd Pointer to struct command
- */ 
-void ftp_client_put_file(int ctrlsock, Command *cmd)
-{ 
-    // check file exists locally
-    FILE *fp = fopen(cmd->arg, "r");
-    if (!fp)
+ */
+void repl_pipe_send(ClientSession *cs, Pipeline *pl, Command *cmd)
+{
+    if (pl->count == PIPE_DEPTH)
+        repl_pipe_drain(cs, pl, PIPE_DEPTH - 1);
+
+    // tags run 1..0xffff, 0 is untagged
+    pl->next_tag = pl->next_tag % RES_CODE_MASK + 1;
+    cmd->tag = pl->next_tag;
+    if (ftp_client_give_command(cs, cmd) < 0)
     {
-        fclose(fp);
-        fprintf(stderr, "%s: no such file\n", cmd->arg);
+        perror("fail to command");
         return;
     }
 
-    // send commands and get response
-    ftp_client_give_command(ctrlsock, cmd);
-    int res_code = get_response_code(ctrlsock);
-    if (res_code == CODE_CMD_BAD_SEQ)
+    int slot = (pl->head + pl->count) % PIPE_DEPTH;
+    pl->inflight[slot] = *cmd;
+    pl->count++;
+}
+
+/**
+ * Handles responses of pipelined commands in the order they were sent
+ * @param cs Pointer to client session
+ * @param pl Pointer to pipeline
+ * @param keep Number of commands to leave in flight
+ */
+void repl_pipe_drain(ClientSession *cs, Pipeline *pl, int keep)
+{
+    while (pl->count > keep)
+    {
+        Command *cmd = &pl->inflight[pl->head];
+        uint32_t tag;
+        int res_code = ftp_client_response(cs, &tag);
+        if (res_code < 0 || tag != cmd->tag)
+            error_exit("pipelined response out of order");
+
+        if (strcmp(cmd->command, "get") == 0)
+        {
+            ClientXfer x;
+            ftp_client_get_reply(cs, cmd->arg, res_code, &x);
+            print_xfer(cs, cmd->arg, "retrieved", &x);
+        }
+        else
+            print_response(res_code);
+
+        pl->head = (pl->head + 1) % PIPE_DEPTH;
+        pl->count--;
+    }
+}
+
+/**
+ * Prints the checksum of a file on server, and of the local file of
+ * the same name if there is one
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command, argument as for the query
+ */
+void repl_hash(ClientSession *cs, Command *cmd)
+{
+    char name[16];
+    int alg, pos = 0, range_pos = 0;
+    long long offset = 0, length = -1;
+    if (sscanf(cmd->arg, "%15s %n", name, &pos) != 1 || (alg = hash_alg(name)) < 0
+        || cmd->arg[pos] == '\0')
+    {
+        printf("Usage: hash <crc32c|xxh64> [<offset> <length>] <file>\n");
+        return;
+    }
+    const char *fname = cmd->arg + pos;
+    if (sscanf(fname, "%lld %lld %n", &offset, &length, &range_pos) == 2 && range_pos > 0)
+        fname += range_pos;
+    else
+        offset = 0, length = -1;
+
+    uint64_t digest;
+    int res_code = ftp_client_hash_query(cs, cmd->arg, &digest);
+    if (res_code != CODE_FILE_STATUS)
     {
-        printf("Operation not allowed: file with same name exists on server\n");
         print_response(res_code);
-        fclose(fp);
         return;
     }
+    printf("%s %0*llx server\n", name, alg == HASH_CRC32C ? 8 : 16, (unsigned long long) digest);
+
+    uint64_t local;
+    int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (hash_file(fd, alg, offset, length < 0 ? HASH_WHOLE : (size_t) length, &local) == 0)
+        printf("%s %0*llx local, %s\n", name, alg == HASH_CRC32C ? 8 : 16,
+               (unsigned long long) local, local == digest ? "same" : "DIFFERENT");
+    close(fd);
+}
+
+/**
+ * Toggles vrfy: get and put then checksum files on the way and
+ * compare with server after each transfer
+ * @param cs Pointer to client session
+ */
+void repl_verify(ClientSession *cs)
+{
+    int on = !cs->verify;
+    int res_code = ftp_client_verify(cs, on);
+    if (res_code == CODE_VALID_CMD)
+        printf("Verify %s\n", on ? "on" : "off");
+    print_response(res_code);
+}
+
+/**
+ * Sets how fast the server sends: "rate <bytes/s> [weight]" for this
+ * session, "rate user <bytes/s>" or "rate server <bytes/s>", the last
+ * two for the server worker process the session runs in
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_rate(ClientSession *cs, Command *cmd)
+{
+    int res_code = ftp_client_command(cs, cmd->command, cmd->arg);
+    if (res_code == CODE_VALID_CMD)
+        printf("Rate set\n");
+    else if (res_code == CODE_CMD_NOT_IMPL)
+    {
+        printf("Usage: rate <bytes/s> [weight 1-%d] | rate user|server <bytes/s>\n",
+               SHAPE_WEIGHT_MAX);
+        printf("user and server limits hold per server worker process (-P),"
+               " and cannot exceed the server's -u and -r\n");
+    }
+    print_response(res_code);
+}
+
+/**
+ * Splits a trailing count off an argument, as in "pget <file> [streams]"
+ * @param arg String argument, count is cut off
+ * @param count Default count
+ * @param max Largest count allowed
+ * @return count
+ */
+static int split_count(char *arg, int count, int max)
+{
+    char *last = strrchr(arg, ' ');
+    if (last != NULL && last[1] != '\0' && strspn(last + 1, "0123456789") == strlen(last + 1))
+    {
+        count = atoi(last + 1);
+        *last = '\0';
+    }
+    if (count < 1)
+        count = 1;
+    return count > max ? max : count;
+}
+
+/**
+ * Runs one stream of a segmented get on a session of its own
+ * @param _st Pointer to stream
+ */
+static void *pget_stream(void *_st)
+{
+    PgetStream *st = (PgetStream *) _st;
+    ClientSession ws;
+    ClientXfer x;
+    st->bytes = -1;
 
-    if (res_code != CODE_OPEN_DATA_CONN)
+    if (ftp_client_session_open(st->cs, &ws, st->cwd) < 0)
+        return NULL;
+    st->bytes = ftp_client_get_range(&ws, st->fname, st->fname, st->offset, st->length, &x);
+    ftp_client_quit(&ws);
+
+    if (x.local_errno != 0)
+        fprintf(stderr, "fail to open file: %s\n", strerror(x.local_errno));
+    if (st->bytes < 0)
+        return NULL;
+    flockfile(stdout);
+    printf("stream %d: offset %lld, ", st->index, (long long) st->offset);
+    xfer_clock_report(stdout, st->bytes, &x.clock);
+    funlockfile(stdout);
+    return NULL;
+}
+
+/**
+ * Downloads a file in segments over several sessions at once, each
+ * stream fetching a byte range and saving it at its offset;
+ * "pget <filename> [streams]"
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_pget(ClientSession *cs, Command *cmd)
+{
+    // a trailing number is the number of streams
+    int nstreams = split_count(cmd->arg, PGET_STREAMS, PGET_MAX_STREAMS);
+
+    off_t size;
+    int res_code = ftp_client_size(cs, cmd->arg, &size);
+    if (res_code != CODE_FILE_STATUS)
     {
         print_response(res_code);
-        fclose(fp);
         return;
     }
+    if (size / nstreams < PGET_MIN_SEGMENT)
+        nstreams = size / PGET_MIN_SEGMENT > 0 ? size / PGET_MIN_SEGMENT : 1;
 
-    // start uploading if permitted
-    char data[MAX_BUF_SIZE];
-    memset(data, 0, MAX_BUF_SIZE);
-    
-    int datasock = ftp_client_data_conn(ctrlsock);
-    read_send_file(data, MAX_BUF_SIZE, datasock, fp);
-    close(datasock);
-    fclose(fp);
+    // new sessions start at the server root, follow this one's directory
+    char cwd[MAX_BUF_SIZE];
+    if (ftp_client_server_cwd(cs, cwd, sizeof(cwd)) < 0)
+        return;
+
+    // size the file up front so streams can write anywhere in it
+    int fd = open(cmd->arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+    {
+        perror("fail to create file");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    close(fd);
+
+    PgetStream streams[PGET_MAX_STREAMS];
+    pthread_t threads[PGET_MAX_STREAMS];
+    off_t segment = size / nstreams;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nstreams; i++)
+    {
+        streams[i].cs = cs;
+        streams[i].index = i;
+        streams[i].fname = cmd->arg;
+        streams[i].cwd = cwd;
+        streams[i].offset = i * segment;
+        streams[i].length = i == nstreams - 1 ? size - i * segment : segment;
+        streams[i].bytes = -1;
+        if (pthread_create(&threads[i], NULL, pget_stream, &streams[i]) != 0)
+        {
+            perror("fail to start stream");
+            nstreams = i;
+            break;
+        }
+    }
 
-    // done message
-    printf("%s is uploaded\n", cmd->arg);
-    print_response(get_response_code(ctrlsock));
+    ssize_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < nstreams; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (streams[i].bytes < 0)
+            failed++;
+        else
+            total += streams[i].bytes;
+    }
+
+    if (failed || nstreams == 0)
+    {
+        printf("%s: %d of %d streams failed\n", cmd->arg, failed, nstreams);
+        return;
+    }
+    // CPU time is spent on the stream threads, so only wall clock here
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s is retrieved over %d streams\n", cmd->arg, nstreams);
+    printf("%zd bytes in %.3f s (%.1f MB/s)\n", total, wall_s,
+           wall_s > 0 ? total / 1e6 / wall_s : 0);
 }
 
+static void batch_done(ClientSession *ws, const ClientJob *job, const ClientXfer *x);
+
 /**
- * Sends commands (ls, pwd) and gets output
- * @param ctrlsock Socket for commands
+ * Queues the next file of a batch on a worker session, if any is left
+ * @param ws Pointer to worker session
+ * @param batch Pointer to batch
+ */
+static void batch_next(ClientSession *ws, Batch *batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    int i = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (i < batch->nfiles)
+        ftp_client_submit(ws, batch->upload ? CLIENT_PUT : CLIENT_GET,
+                          batch->files[i].name, batch->files[i].name, batch_done, &batch->files[i]);
+}
+
+/**
+ * Counts a file of a batch done, prints progress of the whole batch
+ * and hands the worker session its next file
+ * @param ws Pointer to worker session
+ * @param job Pointer to job done
+ * @param x Pointer to outcome
+ */
+static void batch_done(ClientSession *ws, const ClientJob *job, const ClientXfer *x)
+{
+    BatchFile *file = (BatchFile *) job->arg;
+    Batch *batch = file->batch;
+    if (x->bytes >= 0 && file->mtime.tv_nsec != UTIME_OMIT)
+    {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, file->mtime };
+        utimensat(AT_FDCWD, file->name, times, 0);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall_s = (now.tv_sec - batch->start.tv_sec)
+                    + (now.tv_nsec - batch->start.tv_nsec) / 1e9;
+    pthread_mutex_lock(&batch->lock);
+    batch->done++;
+    if (x->bytes < 0)
+        batch->failed++;
+    else
+        batch->bytes += x->bytes;
+    printf("[%d/%d] %s %s, %.1f MB at %.1f MB/s\n", batch->done, batch->nfiles,
+           job->remote, x->bytes < 0 ? "failed" : "done", batch->bytes / 1e6,
+           wall_s > 0 ? batch->bytes / 1e6 / wall_s : 0);
+    pthread_mutex_unlock(&batch->lock);
+
+    batch_next(ws, batch);
+}
+
+/**
+ * Transfers many files with a number of workers, each a session of
+ * its own that is handed the next file when done with one
+ * @param cs Pointer to client session
+ * @param files Files
+ * @param nfiles Number of files
+ * @param nworkers Number of workers
+ * @param upload Non-zero to put files, else get
+ */
+static void batch_run(ClientSession *cs, BatchFile *files, int nfiles, int nworkers, int upload)
+{
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.files = files;
+    batch.nfiles = nfiles;
+    batch.upload = upload;
+    for (int i = 0; i < nfiles; i++)
+        files[i].batch = &batch;
+
+    // new sessions start at the server root, follow this one's directory
+    char cwd[MAX_BUF_SIZE];
+    if (ftp_client_server_cwd(cs, cwd, sizeof(cwd)) < 0)
+        return;
+
+    if (nworkers > nfiles)
+        nworkers = nfiles;
+    ClientSession workers[MGET_MAX_WORKERS];
+    int nopen = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &batch.start);
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (ftp_client_session_open(cs, &workers[nopen], cwd) < 0)
+        {
+            fprintf(stderr, "fail to open worker session\n");
+            continue;
+        }
+        batch_next(&workers[nopen++], &batch);
+    }
+    for (int i = 0; i < nopen; i++)
+        ftp_client_quit(&workers[i]);
+    pthread_mutex_destroy(&batch.lock);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall_s = (end.tv_sec - batch.start.tv_sec) + (end.tv_nsec - batch.start.tv_nsec) / 1e9;
+    printf("%d files %s over %d workers, %d failed, %d not started\n",
+           batch.done - batch.failed, upload ? "uploaded" : "retrieved",
+           nopen, batch.failed, nfiles - batch.done);
+    printf("%zd bytes in %.3f s (%.1f MB/s)\n", batch.bytes, wall_s,
+           wall_s > 0 ? batch.bytes / 1e6 / wall_s : 0);
+}
+
+/**
+ * Whether a path from server is fine to write locally: relative,
+ * without ".." and short enough to ask for
+ * @param path String path
+ * @return non-zero if so
+ */
+static int local_path_ok(const char *path)
+{
+    if (path[0] == '/' || strlen(path) >= CMD_ARG_MAX)
+        return 0;
+    for (const char *p = path; p != NULL; p = strchr(p, '/'), p = p ? p + 1 : NULL)
+    {
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Creates the directories a file is in, as "mkdir -p" would
+ * @param path String file path
+ * @return 0, -1 if failed
+ */
+static int make_local_dirs(const char *path)
+{
+    char dir[MAX_BUF_SIZE];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+/**
+ * Downloads every file matching a pattern on server;
+ * "mget <pattern> [workers]"
+ * @param cs Pointer to client session
  * @param cmd Pointer to struct command
- */ 
-void ftp_client_dir(int ctrlsock, Command *cmd)
+ */
+void repl_mget(ClientSession *cs, Command *cmd)
 {
-    // send commands and get response
-    ftp_client_give_command(ctrlsock, cmd);
-    int res_code = get_response_code(ctrlsock);
-    if (res_code != CODE_OPEN_DATA_CONN)
-        print_response(res_code); // error res_code
-    
-    // use data port to get stdout
-    char dirbuf[MAX_BUF_SIZE];
-    memset(dirbuf, 0, MAX_BUF_SIZE);
+    int nworkers = split_count(cmd->arg, MGET_WORKERS, MGET_MAX_WORKERS);
 
-    int datasock = ftp_client_data_conn(ctrlsock);
-    while (recv(datasock, dirbuf, MAX_BUF_SIZE, 0) > 0)
+    // server expands the pattern
+    char *list = NULL;
+    size_t list_size = 0;
+    FILE *out = open_memstream(&list, &list_size);
+    if (out == NULL)
+        return;
+    int rc = ftp_client_list(cs, "nlst", cmd->arg, out);
+    fclose(out);
+    if (rc > 0)
+        print_response(rc);
+
+    // "dir/*" lists "dir/name", saved under the same path here
+    BatchFile files[MGET_MAX_FILES];
+    int nfiles = 0;
+    for (char *name = strtok(list, "\n"); name != NULL && nfiles < MGET_MAX_FILES;
+         name = strtok(NULL, "\n"))
     {
-        printf("%s", dirbuf);
-        memset(dirbuf, 0, MAX_BUF_SIZE);
+        if (local_path_ok(name) && make_local_dirs(name) == 0)
+            files[nfiles++] = (BatchFile) { NULL, name, { 0, UTIME_OMIT } };
+        else
+            printf("%s: cannot save here, skipped\n", name);
     }
 
-    close(datasock);
+    if (rc == 0 && nfiles == 0)
+        printf("%s: no such files\n", cmd->arg);
+    else if (rc == 0)
+        batch_run(cs, files, nfiles, nworkers, 0);
+    free(list);
 }
 
 /**
- * Commands server to cd
- * @param ctrlsock Socket for commands
+ * Uploads every local file matching a pattern;
+ * "mput <pattern> [workers]"
+ * @param cs Pointer to client session
  * @param cmd Pointer to struct command
- */ 
-void ftp_client_chdir(int ctrlsock, Command *cmd)
+ */
+void repl_mput(ClientSession *cs, Command *cmd)
 {
-    // does not use data port
-    ftp_client_give_command(ctrlsock, cmd);
-    print_response(get_response_code(ctrlsock));
-}
\ No newline at end of file
+    int nworkers = split_count(cmd->arg, MGET_WORKERS, MGET_MAX_WORKERS);
+
+    // expand the pattern locally, regular files only
+    glob_t matches;
+    struct stat st;
+    BatchFile files[MGET_MAX_FILES];
+    int nfiles = 0;
+    if (glob(cmd->arg, 0, NULL, &matches) == 0)
+    {
+        for (size_t i = 0; i < matches.gl_pathc && nfiles < MGET_MAX_FILES; i++)
+        {
+            if (stat(matches.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode))
+                files[nfiles++] = (BatchFile) { NULL, matches.gl_pathv[i], { 0, UTIME_OMIT } };
+        }
+    }
+
+    if (nfiles == 0)
+        printf("%s: no such files\n", cmd->arg);
+    else
+        batch_run(cs, files, nfiles, nworkers, 1);
+    globfree(&matches);
+}
+
+/**
+ * Whether the local copy of a file is up to date: same size and mtime,
+ * or with checksums the same size and CRC32C, when it takes the mtime
+ * of server so the next sync need not read it
+ * @param ent Pointer to manifest entry
+ * @return non-zero if so
+ */
+static int sync_fresh(const ClientEntry *ent)
+{
+    struct stat st;
+    if (stat(ent->path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != ent->size)
+        return 0;
+    if (st.st_mtim.tv_sec == ent->mtime.tv_sec && st.st_mtim.tv_nsec == ent->mtime.tv_nsec)
+        return 1;
+    if (!ent->has_crc)
+        return 0;
+
+    uint64_t digest;
+    int fd = open(ent->path, O_RDONLY | O_CLOEXEC);
+    int same = fd >= 0 && hash_file(fd, HASH_CRC32C, 0, HASH_WHOLE, &digest) == 0
+               && (uint32_t) digest == ent->crc;
+    if (fd >= 0)
+        close(fd);
+    if (same)
+    {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, ent->mtime };
+        utimensat(AT_FDCWD, ent->path, times, 0);
+    }
+    return same;
+}
+
+/**
+ * Mirrors a server directory into the local one of the same path:
+ * compares the manifest of server with local files and fetches what
+ * is new or changed, over workers as mget does; files only on this
+ * side are left alone; "sync [-c] <directory> [workers]", -c to tell
+ * changes by CRC32C when mtimes differ
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ */
+void repl_sync(ClientSession *cs, Command *cmd)
+{
+    int nworkers = split_count(cmd->arg, MGET_WORKERS, MGET_MAX_WORKERS);
+    int crc = strncmp(cmd->arg, "-c ", 3) == 0;
+    const char *dir = crc ? cmd->arg + 3 : cmd->arg;
+    if (!local_path_ok(dir))
+    {
+        printf("%s: not a directory under the current one\n", dir);
+        return;
+    }
+
+    ClientEntry *ents;
+    size_t nents;
+    int rc = ftp_client_manifest(cs, dir, crc, &ents, &nents);
+    if (rc != 0)
+    {
+        if (rc > 0)
+            print_response(rc);
+        else
+            printf("%s: fail to get manifest\n", dir);
+        return;
+    }
+
+    BatchFile *files = (BatchFile *) malloc((nents ? nents : 1) * sizeof(BatchFile));
+    if (files == NULL)
+    {
+        ftp_client_manifest_free(ents, nents);
+        return;
+    }
+    int nfiles = 0, skipped = 0;
+    for (size_t i = 0; i < nents; i++)
+    {
+        if (!local_path_ok(ents[i].path) || make_local_dirs(ents[i].path) < 0)
+            skipped++;
+        else if (!sync_fresh(&ents[i]))
+            files[nfiles++] = (BatchFile) { NULL, ents[i].path, ents[i].mtime };
+    }
+
+    printf("%s: %zu files on server, %d new or changed, %d skipped\n", dir, nents, nfiles, skipped);
+    if (nfiles > 0)
+        batch_run(cs, files, nfiles, nworkers, 0);
+    free(files);
+    ftp_client_manifest_free(ents, nents);
+}
@@ -0,0 +1,910 @@
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/wait.h>
+
+#include "mftputil.h"
+#include "mftpcmd.h"
+#include "mftpprof.h"
+#include "mftpz.h"
+
+#define BENCH_SESSIONS 8                     /* default concurrent sessions */
+#define BENCH_MAX_SESSIONS 256
+#define BENCH_SECONDS 10                     /* default run time */
+#define BENCH_SMALL_SIZE (4 * 1024)          /* default size of small files */
+#define BENCH_LARGE_SIZE (8 * 1024 * 1024)   /* default size of large files */
+#define BENCH_MIX "sget=40,lget=4,sput=20,lput=1,ls=20,cd=15"
+#define BENCH_START_TIMEOUT 5000             /* ms to wait for the server to listen */
+
+/* command types of the workload */
+enum
+{
+    OP_SGET,
+    OP_LGET,
+    OP_SPUT,
+    OP_LPUT,
+    OP_LS,
+    OP_CD,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = { "sget", "lget", "sput", "lput", "ls", "cd" };
+
+typedef struct OpStats
+{
+    double *lat;       /* latencies in microseconds, one per command done */
+    size_t count;
+    size_t cap;
+    unsigned long errors;
+    uint64_t bytes;    /* file and listing bytes moved */
+    uint64_t wire;     /* bytes of those on the data connection, less in mode z */
+} OpStats;
+
+typedef struct BenchConfig
+{
+    const char *mode;       /* server mode: thread, pool or event */
+    const char *server;     /* absolute path of server binary */
+    char *server_args;      /* extra server options, split at spaces */
+    const char *label;      /* free text kept in the results, e.g. a commit */
+    int nsessions;
+    int seconds;
+    long rounds;            /* commands per session, 0 to run for seconds */
+    int block_mode;
+    int zlevel;             /* deflate level of mode z, 0 if off */
+    int text;               /* files are compressible text, else random bytes */
+    size_t small_size;
+    size_t large_size;
+    int weights[OP_COUNT];
+    int total_weight;
+    char dir[64];           /* server root, removed when done */
+    char small_path[MAX_BUF_SIZE]; /* local copies of the files put */
+    char large_path[MAX_BUF_SIZE];
+    struct sockaddr_in server_addr;
+} BenchConfig;
+
+typedef struct BenchSession
+{
+    BenchConfig *conf;
+    int index;
+    int ctrlsock;
+    int framed;
+    int pasv_port;
+    int datasock;      /* kept open in block mode, -1 if none */
+    int in_subdir;     /* cd toggles between the root and "d" */
+    long puts;         /* names put files uniquely */
+    XferProfile prof;
+    FILE *devnull;
+    OpStats ops[OP_COUNT];
+    int failed;        /* could not log in or lost the control connection */
+} BenchSession;
+
+static int bench_stop; /* set once the run time is over */
+
+/**
+ * Microseconds on the monotonic clock
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Parse a workload mix such as "sget=40,ls=20"; types left out get weight 0
+ * @param conf Pointer to config to fill weights of
+ * @param mix String mix
+ * @return 0, -1 if malformed
+ */
+static int parse_mix(BenchConfig *conf, const char *mix)
+{
+    char buf[MAX_BUF_SIZE];
+    strncpy(buf, mix, MAX_BUF_SIZE - 1);
+    buf[MAX_BUF_SIZE - 1] = '\0';
+    memset(conf->weights, 0, sizeof(conf->weights));
+    conf->total_weight = 0;
+
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcmp(op_names[op], tok) != 0)
+            op++;
+        int weight = atoi(eq + 1);
+        if (op == OP_COUNT || weight < 0)
+            return -1;
+        conf->weights[op] = weight;
+        conf->total_weight += weight;
+    }
+    return conf->total_weight > 0 ? 0 : -1;
+}
+
+/**
+ * Fill a buffer with CSV rows of a pseudo-random sensor log,
+ * which deflate shrinks about as much as real CSV
+ * @param buf Buffer
+ * @param size Buffer size
+ * @param x Pointer to random state
+ */
+static void fill_text(char *buf, size_t size, uint64_t *x)
+{
+    static const char *names[] = { "north", "south", "east", "west", "roof", "cellar" };
+    size_t len = 0;
+    char row[96];
+    while (len < size)
+    {
+        *x ^= *x << 13;
+        *x ^= *x >> 7;
+        *x ^= *x << 17;
+        int n = snprintf(row, sizeof(row), "%llu,%s-%u,%u.%02u,%s\n",
+                         (unsigned long long) (*x >> 40), names[*x % 6], (unsigned) (*x >> 8) % 16,
+                         (unsigned) (*x >> 16) % 40, (unsigned) (*x >> 24) % 100,
+                         (*x >> 32) % 8 ? "ok" : "check");
+        size_t take = len + n <= size ? (size_t) n : size - len;
+        memcpy(buf + len, row, take);
+        len += take;
+    }
+}
+
+/**
+ * Write a file of pseudo-random bytes, so mode z would not shrink it,
+ * or of text rows that it does
+ * @param path String path
+ * @param size Size in bytes
+ * @param text Non-zero for compressible text
+ * @return 0, -1 if failed
+ */
+static int make_file(const char *path, size_t size, int text)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    uint64_t x = 0x9E3779B97F4A7C15ULL ^ size;
+    char buf[XFER_BUF_SIZE];
+    while (size > 0)
+    {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        for (size_t i = 0; !text && i + 8 <= sizeof(buf); i += 8)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(buf + i, &x, 8);
+        }
+        if (text)
+            fill_text(buf, n, &x);
+        if (fwrite(buf, 1, n, fp) != n)
+        {
+            fclose(fp);
+            return -1;
+        }
+        size -= n;
+    }
+    return fclose(fp);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/**
+ * Create the server root with small.dat and large.dat in it and in "d",
+ * and the local files that puts send
+ * @param conf Pointer to config
+ * @return 0, -1 if failed
+ */
+static int bench_setup_dir(BenchConfig *conf)
+{
+    strcpy(conf->dir, "/tmp/mftpbench.XXXXXX");
+    if (mkdtemp(conf->dir) == NULL)
+        return -1;
+
+    char path[MAX_BUF_SIZE];
+    const char *subdirs[] = { "srv", "srv/d" };
+    for (int i = 0; i < 2; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", conf->dir, subdirs[i]);
+        if (mkdir(path, 0755) < 0)
+            return -1;
+        snprintf(path, sizeof(path), "%s/%s/small.dat", conf->dir, subdirs[i]);
+        if (make_file(path, conf->small_size, conf->text) < 0)
+            return -1;
+        snprintf(path, sizeof(path), "%s/%s/large.dat", conf->dir, subdirs[i]);
+        if (make_file(path, conf->large_size, conf->text) < 0)
+            return -1;
+    }
+
+    snprintf(conf->small_path, sizeof(conf->small_path), "%s/small.dat", conf->dir);
+    snprintf(conf->large_path, sizeof(conf->large_path), "%s/large.dat", conf->dir);
+    if (make_file(conf->small_path, conf->small_size, conf->text) < 0
+        || make_file(conf->large_path, conf->large_size, conf->text) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Take a free loopback port, for the server to listen on
+ * @return port, -1 if failed
+ */
+static int free_port(void)
+{
+    int sock = listen_socket(0, 1);
+    if (sock < 0)
+        return -1;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int port = getsockname(sock, (struct sockaddr *) &addr, &len) < 0 ? -1 : ntohs(addr.sin_port);
+    close(sock);
+    return port;
+}
+
+/**
+ * Start the server in the bench root, its output discarded
+ * @param conf Pointer to config
+ * @param port Port to listen on
+ * @return pid, -1 if failed
+ */
+static pid_t bench_start_server(BenchConfig *conf, int port)
+{
+    char *argv[64];
+    char port_str[16], root[MAX_BUF_SIZE];
+    int argc = 0;
+    argv[argc++] = (char *) conf->server;
+    argv[argc++] = "-m";
+    argv[argc++] = (char *) conf->mode;
+    argv[argc++] = "-b";
+    argv[argc++] = "128";
+    char *save = NULL;
+    for (char *tok = strtok_r(conf->server_args, " ", &save); tok && argc < 60;
+         tok = strtok_r(NULL, " ", &save))
+        argv[argc++] = tok;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    argv[argc++] = port_str;
+    argv[argc] = NULL;
+    snprintf(root, sizeof(root), "%s/srv", conf->dir);
+
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (chdir(root) < 0 || null < 0)
+        _exit(127);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(conf->server, argv);
+    _exit(127);
+}
+
+/**
+ * Connect a control socket and wait for service ready
+ * @param addr Pointer to server address
+ * @return socket, -1 if failed
+ */
+static int bench_connect(const struct sockaddr_in *addr)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    uint32_t res;
+    if (connect(sock, (const struct sockaddr *) addr, sizeof(*addr)) < 0
+        || recv(sock, &res, sizeof(res), MSG_WAITALL) != sizeof(res)
+        || (ntohl(res) & RES_CODE_MASK) != CODE_SERVICE_READY)
+    {
+        close(sock);
+        return -1;
+    }
+    xfer_ctrl_socket(sock);
+    return sock;
+}
+
+/**
+ * Wait until the server takes connections
+ * @param conf Pointer to config
+ * @param pid Server process
+ * @return 0, -1 if it exited or timed out
+ */
+static int bench_wait_server(BenchConfig *conf, pid_t pid)
+{
+    for (int waited = 0; waited < BENCH_START_TIMEOUT; waited += 20)
+    {
+        int sock = bench_connect(&conf->server_addr);
+        if (sock >= 0)
+        {
+            close(sock);
+            return 0;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(20 * 1000);
+    }
+    return -1;
+}
+
+/**
+ * Send a command without waiting for its response
+ * @param bs Pointer to bench session
+ * @param command String command
+ * @param arg String argument, may be empty
+ * @return 0, -1 if failed
+ */
+static int bench_send(BenchSession *bs, const char *command, const char *arg)
+{
+    Command cmd;
+    char buf[CMD_MSG_MAX];
+    memset(&cmd, 0, sizeof(cmd));
+    strcpy(cmd.command, command);
+    strncpy(cmd.arg, arg, MAX_BUF_SIZE - 1);
+
+    int len = cmd_encode(&cmd, bs->framed, buf);
+    return len < 0 || send_all(bs->ctrlsock, buf, len) < 0 ? -1 : 0;
+}
+
+/**
+ * Take the next response code
+ * @param bs Pointer to bench session
+ * @return host response code, -1 if failed
+ */
+static int bench_response(BenchSession *bs)
+{
+    uint32_t res;
+    if (recv(bs->ctrlsock, &res, sizeof(res), MSG_WAITALL) != sizeof(res))
+        return -1;
+    return ntohl(res) & RES_CODE_MASK;
+}
+
+/**
+ * Send a command and take its response code
+ * @param bs Pointer to bench session
+ * @param command String command
+ * @param arg String argument, may be empty
+ * @return host response code, -1 if failed
+ */
+static int bench_command(BenchSession *bs, const char *command, const char *arg)
+{
+    return bench_send(bs, command, arg) < 0 ? -1 : bench_response(bs);
+}
+
+/**
+ * Log a session in as the client does: hello for frames, user, pass,
+ * then passive mode and block or compressed mode if asked for
+ * @param bs Pointer to bench session
+ * @return 0, -1 if failed
+ */
+static int bench_login(BenchSession *bs)
+{
+    BenchConfig *conf = bs->conf;
+    if ((bs->ctrlsock = bench_connect(&conf->server_addr)) < 0)
+        return -1;
+    bs->framed = bench_command(bs, CMD_HELLO, "") == CODE_VALID_CMD;
+    if (bench_command(bs, "user", "user") != CODE_NEED_PASS
+        || bench_command(bs, "pass", "pass") != CODE_USR_LOGGED_IN
+        || bench_command(bs, "pasv", "") != CODE_ENTER_PASV)
+        return -1;
+
+    int port;
+    if (recv(bs->ctrlsock, &port, sizeof(port), MSG_WAITALL) != sizeof(port))
+        return -1;
+    bs->pasv_port = ntohl(port);
+    char mode[16];
+    snprintf(mode, sizeof(mode), "z %d", conf->zlevel);
+    if (conf->block_mode && bench_command(bs, "mode", conf->zlevel ? mode : "b") != CODE_VALID_CMD)
+        return -1;
+    return 0;
+}
+
+/**
+ * Get a data connection to the passive port, the kept one in block mode
+ * @param bs Pointer to bench session
+ * @return socket, -1 if failed
+ */
+static int bench_open_data(BenchSession *bs)
+{
+    if (bs->datasock >= 0)
+        return bs->datasock;
+
+    struct sockaddr_in addr = bs->conf->server_addr;
+    addr.sin_port = htons(bs->pasv_port);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    xfer_data_socket(&bs->prof, sock);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    if (bs->conf->block_mode)
+        bs->datasock = sock;
+    return sock;
+}
+
+static void bench_close_data(BenchSession *bs, int sock, int failed)
+{
+    if (bs->conf->block_mode && !failed)
+        return;
+    if (sock == bs->datasock)
+        bs->datasock = -1;
+    close(sock);
+}
+
+/**
+ * Run one transfer command to its end: get and ls land in /dev/null,
+ * put sends a local file; listings end with the data, files with a 226
+ * @param bs Pointer to bench session
+ * @param command String command
+ * @param arg String argument
+ * @param upload Path of local file to send, NULL to receive
+ * @param wire Pointer to add bytes on the data connection to
+ * @return bytes moved, -1 if failed
+ */
+static ssize_t bench_transfer(BenchSession *bs, const char *command, const char *arg,
+                              const char *upload, uint64_t *wire)
+{
+    int listing = strcmp(command, "ls") == 0;
+
+    // puts announce their size as the client does, ahead of the put
+    struct stat st;
+    char size[32];
+    int announced = upload != NULL && stat(upload, &st) == 0;
+    if (announced)
+    {
+        snprintf(size, sizeof(size), "%lld", (long long) st.st_size);
+        announced = bench_send(bs, "allo", size) == 0;
+    }
+    int res_code = bench_send(bs, command, arg) < 0
+                   || (announced && bench_response(bs) < 0) ? -1 : bench_response(bs);
+    if (res_code < 0)
+        bs->failed = 1;
+    if (res_code != CODE_OPEN_DATA_CONN)
+        return -1;
+
+    int datasock = bench_open_data(bs);
+    if (datasock < 0)
+    {
+        bs->failed = 1;
+        return -1;
+    }
+
+    // listings are never compressed
+    int zlevel = listing ? 0 : bs->conf->zlevel;
+    ZmodeStats zs = { 0, 0, 0 };
+    ssize_t bytes = -1;
+    if (upload != NULL)
+    {
+        FILE *fp = fopen(upload, "r");
+        if (fp != NULL && zlevel)
+            bytes = zmode_send_file(zlevel, bs->prof.chunk_size, datasock, fp, &zs);
+        else if (fp != NULL)
+            bytes = xfer_send_file(&bs->prof, datasock, fp, bs->conf->block_mode, NULL);
+        if (fp != NULL)
+            fclose(fp);
+    }
+    else if (zlevel)
+        bytes = zmode_recv_file(bs->prof.chunk_size, datasock, bs->devnull, &zs);
+    else
+        bytes = xfer_recv_file(&bs->prof, datasock, bs->devnull, bs->conf->block_mode, NULL);
+    bench_close_data(bs, datasock, bytes < 0);
+    if (bytes > 0)
+        *wire += zlevel ? zs.wire_bytes : (size_t) bytes;
+    if (listing)
+        return bytes;
+
+    if ((res_code = bench_response(bs)) < 0)
+    {
+        bs->failed = 1;
+        return -1;
+    }
+    return res_code == CODE_CLOSE_DATA_CONN ? bytes : -1;
+}
+
+/**
+ * Run one command of a type
+ * @param bs Pointer to bench session
+ * @param op Command type
+ * @return bytes moved, 0 for cd, -1 if failed
+ */
+static ssize_t bench_run_op(BenchSession *bs, int op)
+{
+    char name[64];
+    BenchConfig *conf = bs->conf;
+    switch (op)
+    {
+        case OP_SGET:
+            return bench_transfer(bs, "get", "small.dat", NULL, &bs->ops[op].wire);
+        case OP_LGET:
+            return bench_transfer(bs, "get", "large.dat", NULL, &bs->ops[op].wire);
+        case OP_SPUT:
+        case OP_LPUT:
+            // the server refuses to overwrite, so every put gets a new name
+            snprintf(name, sizeof(name), "put.%d.%ld", bs->index, bs->puts++);
+            return bench_transfer(bs, "put", name, op == OP_SPUT ? conf->small_path : conf->large_path,
+                                  &bs->ops[op].wire);
+        case OP_LS:
+            return bench_transfer(bs, "ls", "", NULL, &bs->ops[op].wire);
+        case OP_CD:
+        {
+            int res_code = bench_command(bs, "cd", bs->in_subdir ? ".." : "d");
+            if (res_code < 0)
+                bs->failed = 1;
+            if (res_code != CODE_VALID_CMD)
+                return -1;
+            bs->in_subdir = !bs->in_subdir;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Record the latency of a command done
+ * @param stats Pointer to stats of its type
+ * @param us Latency in microseconds
+ */
+static void op_record(OpStats *stats, double us)
+{
+    if (stats->count == stats->cap)
+    {
+        size_t cap = stats->cap ? stats->cap * 2 : 1024;
+        double *lat = (double *) realloc(stats->lat, cap * sizeof(double));
+        if (lat == NULL)
+            return;
+        stats->lat = lat;
+        stats->cap = cap;
+    }
+    stats->lat[stats->count++] = us;
+}
+
+/**
+ * Session thread: log in, then draw commands from the mix until the
+ * run ends or the connection is lost
+ */
+static void *bench_session(void *_bs)
+{
+    BenchSession *bs = (BenchSession *) _bs;
+    BenchConfig *conf = bs->conf;
+    unsigned seed = 0x5eed + bs->index;
+
+    if (bench_login(bs) < 0)
+    {
+        bs->failed = 1;
+        return NULL;
+    }
+
+    for (long n = 0; !bs->failed && !__atomic_load_n(&bench_stop, __ATOMIC_RELAXED) && (conf->rounds == 0 || n < conf->rounds); n++)
+    {
+        int pick = rand_r(&seed) % conf->total_weight, op = 0;
+        while (pick >= conf->weights[op])
+            pick -= conf->weights[op++];
+
+        double start = now_us();
+        ssize_t bytes = bench_run_op(bs, op);
+        double us = now_us() - start;
+        if (bytes < 0)
+            bs->ops[op].errors++;
+        else
+        {
+            op_record(&bs->ops[op], us);
+            bs->ops[op].bytes += bytes;
+        }
+    }
+
+    if (!bs->failed)
+        bench_command(bs, "quit", "");
+    if (bs->datasock >= 0)
+        close(bs->datasock);
+    close(bs->ctrlsock);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Nearest-rank percentile of sorted samples
+ * @param lat Sorted latencies
+ * @param n Number of latencies, at least 1
+ * @param p Fraction, e.g. 0.99
+ * @return latency
+ */
+static double percentile(const double *lat, size_t n, double p)
+{
+    size_t rank = (size_t) (p * n);
+    if (rank < p * n)
+        rank++;
+    return lat[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * Merge the stats of every session, sorted by latency
+ * @param sessions Sessions run
+ * @param n Number of sessions
+ * @param all Array of OP_COUNT stats to fill
+ */
+static void bench_merge(BenchSession *sessions, int n, OpStats *all)
+{
+    memset(all, 0, OP_COUNT * sizeof(OpStats));
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            OpStats *st = &sessions[i].ops[op];
+            for (size_t k = 0; k < st->count; k++)
+                op_record(&all[op], st->lat[k]);
+            all[op].errors += st->errors;
+            all[op].bytes += st->bytes;
+            all[op].wire += st->wire;
+        }
+        if (all[op].count > 0)
+            qsort(all[op].lat, all[op].count, sizeof(double), cmp_double);
+    }
+}
+
+/**
+ * CPU seconds, user and system, of a resource usage
+ */
+static double cpu_s(const struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+           + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Name the transfer mode of a run, e.g. "stream", "block" or "z 6"
+ */
+static const char *transfer_mode(const BenchConfig *conf, char *buf, size_t size)
+{
+    if (conf->zlevel)
+        snprintf(buf, size, "z %d", conf->zlevel);
+    else
+        snprintf(buf, size, "%s", conf->block_mode ? "block" : "stream");
+    return buf;
+}
+
+/**
+ * Write results as one JSON object; latencies in milliseconds
+ * @param out Stream to write to
+ * @param conf Pointer to config
+ * @param all Merged stats
+ * @param elapsed Wall time of the run in seconds
+ * @param cpu CPU seconds of the bench sessions and of the server
+ * @param failed Sessions that could not log in or lost their connection
+ */
+static void bench_json(FILE *out, BenchConfig *conf, OpStats *all, double elapsed,
+                       const double cpu[2], int failed)
+{
+    size_t commands = 0;
+    unsigned long errors = 0;
+    uint64_t bytes = 0, wire = 0;
+    char mode[16];
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        commands += all[op].count;
+        errors += all[op].errors;
+        bytes += all[op].bytes;
+        wire += all[op].wire;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", conf->label);
+    fprintf(out, "  \"mode\": \"%s\",\n", conf->mode);
+    fprintf(out, "  \"transfer_mode\": \"%s\",\n", transfer_mode(conf, mode, sizeof(mode)));
+    fprintf(out, "  \"data\": \"%s\",\n", conf->text ? "text" : "random");
+    fprintf(out, "  \"sessions\": %d,\n", conf->nsessions);
+    fprintf(out, "  \"failed_sessions\": %d,\n", failed);
+    fprintf(out, "  \"small_size\": %zu,\n", conf->small_size);
+    fprintf(out, "  \"large_size\": %zu,\n", conf->large_size);
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"commands\": %zu,\n", commands);
+    fprintf(out, "  \"errors\": %lu,\n", errors);
+    fprintf(out, "  \"commands_per_s\": %.1f,\n", commands / elapsed);
+    fprintf(out, "  \"bytes\": %lu,\n", (unsigned long) bytes);
+    fprintf(out, "  \"throughput_mb_s\": %.1f,\n", bytes / elapsed / 1e6);
+    fprintf(out, "  \"wire_bytes\": %lu,\n", (unsigned long) wire);
+    fprintf(out, "  \"client_cpu_s\": %.3f,\n", cpu[0]);
+    fprintf(out, "  \"server_cpu_s\": %.3f,\n", cpu[1]);
+    fprintf(out, "  \"mb_per_client_cpu_s\": %.1f,\n", cpu[0] > 0 ? bytes / cpu[0] / 1e6 : 0);
+    fprintf(out, "  \"mb_per_server_cpu_s\": %.1f,\n", cpu[1] > 0 ? bytes / cpu[1] / 1e6 : 0);
+    fprintf(out, "  \"ops\": {");
+    int first = 1;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats *st = &all[op];
+        if (conf->weights[op] == 0)
+            continue;
+        double sum = 0;
+        for (size_t k = 0; k < st->count; k++)
+            sum += st->lat[k];
+        fprintf(out, "%s\n    \"%s\": { \"weight\": %d, \"count\": %zu, \"errors\": %lu, "
+                "\"bytes\": %lu, \"wire_bytes\": %lu, \"per_s\": %.1f", first ? "" : ",", op_names[op],
+                conf->weights[op], st->count, st->errors, (unsigned long) st->bytes,
+                (unsigned long) st->wire, st->count / elapsed);
+        if (st->count > 0)
+            fprintf(out, ", \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+                    "\"p999_ms\": %.3f, \"max_ms\": %.3f",
+                    sum / st->count / 1e3, percentile(st->lat, st->count, 0.5) / 1e3,
+                    percentile(st->lat, st->count, 0.99) / 1e3,
+                    percentile(st->lat, st->count, 0.999) / 1e3, st->lat[st->count - 1] / 1e3);
+        fprintf(out, " }");
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+/**
+ * Print a summary table
+ * @param out Stream to print to
+ * @param conf Pointer to config
+ * @param all Merged stats
+ * @param elapsed Wall time of the run in seconds
+ * @param cpu CPU seconds of the bench sessions and of the server
+ */
+static void bench_table(FILE *out, BenchConfig *conf, OpStats *all, double elapsed, const double cpu[2])
+{
+    size_t commands = 0;
+    uint64_t bytes = 0, wire = 0;
+    char mode[16];
+    fprintf(out, "%-5s %8s %6s %10s %9s %9s %9s %9s\n",
+            "op", "count", "errors", "per s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats *st = &all[op];
+        commands += st->count;
+        bytes += st->bytes;
+        wire += st->wire;
+        if (conf->weights[op] == 0 || st->count == 0)
+            continue;
+        fprintf(out, "%-5s %8zu %6lu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+                op_names[op], st->count, st->errors, st->count / elapsed,
+                percentile(st->lat, st->count, 0.5) / 1e3, percentile(st->lat, st->count, 0.99) / 1e3,
+                percentile(st->lat, st->count, 0.999) / 1e3, st->lat[st->count - 1] / 1e3);
+    }
+    fprintf(out, "%s mode, %d sessions, %.1f s: %.1f commands/s, %.1f MB/s\n", conf->mode,
+            conf->nsessions, elapsed, commands / elapsed, bytes / elapsed / 1e6);
+    fprintf(out, "%s transfers of %s data: %.1f MB on the wire, %.1f MB per client CPU-s,"
+            " %.1f MB per server CPU-s\n", transfer_mode(conf, mode, sizeof(mode)),
+            conf->text ? "text" : "random", wire / 1e6, cpu[0] > 0 ? bytes / cpu[0] / 1e6 : 0,
+            cpu[1] > 0 ? bytes / cpu[1] / 1e6 : 0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-m thread|pool|event] [-n sessions] [-d seconds | -r rounds]"
+            " [-w mix] [-s small bytes] [-l large bytes] [-b | -z level] [-t] [-S server]"
+            " [-x \"server options\"]"
+            " [-L label] [-o json file]\n"
+            "  mix is type=weight,... over sget lget sput lput ls cd, default " BENCH_MIX "\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.mode = "thread";
+    conf.nsessions = BENCH_SESSIONS;
+    conf.seconds = BENCH_SECONDS;
+    conf.small_size = BENCH_SMALL_SIZE;
+    conf.large_size = BENCH_LARGE_SIZE;
+    conf.label = "";
+    char server_args[MAX_BUF_SIZE] = "";
+    const char *server = "./server", *json_path = NULL, *mix = BENCH_MIX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:d:r:w:s:l:bz:tS:x:L:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm': conf.mode = optarg; break;
+            case 'n': conf.nsessions = atoi(optarg); break;
+            case 'd': conf.seconds = atoi(optarg); break;
+            case 'r': conf.rounds = atol(optarg); break;
+            case 'w': mix = optarg; break;
+            case 's': conf.small_size = strtoul(optarg, NULL, 10); break;
+            case 'l': conf.large_size = strtoul(optarg, NULL, 10); break;
+            case 'b': conf.block_mode = 1; break;
+            case 'z': conf.zlevel = atoi(optarg); break;
+            case 't': conf.text = 1; break;
+            case 'S': server = optarg; break;
+            case 'x': strncpy(server_args, optarg, MAX_BUF_SIZE - 1); break;
+            case 'L': conf.label = optarg; break;
+            case 'o': json_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || conf.nsessions < 1 || conf.nsessions > BENCH_MAX_SESSIONS
+        || conf.seconds < 1 || conf.rounds < 0 || conf.zlevel < 0 || conf.zlevel > 9
+        || parse_mix(&conf, mix) < 0)
+        usage(argv[0]);
+    // mode z is block mode with compressed payloads
+    if (conf.zlevel)
+        conf.block_mode = 1;
+    conf.server_args = server_args;
+
+    char server_path[PATH_MAX];
+    if (realpath(server, server_path) == NULL)
+        error_exit("fail to find server");
+    conf.server = server_path;
+
+    // a server dropping a data connection must not kill the bench
+    signal(SIGPIPE, SIG_IGN);
+
+    if (bench_setup_dir(&conf) < 0)
+        error_exit("fail to create bench files");
+
+    int port = free_port();
+    conf.server_addr.sin_family = AF_INET;
+    conf.server_addr.sin_port = htons(port);
+    conf.server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pid_t pid = port < 0 ? -1 : bench_start_server(&conf, port);
+    if (pid < 0 || bench_wait_server(&conf, pid) < 0)
+    {
+        if (pid > 0)
+            kill(pid, SIGTERM);
+        nftw(conf.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        error_exit("fail to start server");
+    }
+
+    BenchSession *sessions = (BenchSession *) calloc(conf.nsessions, sizeof(BenchSession));
+    pthread_t *tids = (pthread_t *) calloc(conf.nsessions, sizeof(pthread_t));
+    if (sessions == NULL || tids == NULL)
+        error_exit("fail to allocate sessions");
+
+    struct rusage ru_start, ru_end, ru_server;
+    getrusage(RUSAGE_SELF, &ru_start);
+    double start = now_us();
+    for (int i = 0; i < conf.nsessions; i++)
+    {
+        BenchSession *bs = &sessions[i];
+        bs->conf = &conf;
+        bs->index = i;
+        bs->datasock = -1;
+        bs->devnull = fopen("/dev/null", "w");
+        xfer_profile_get("default", &bs->prof);
+        if (bs->devnull == NULL || pthread_create(&tids[i], NULL, bench_session, bs) != 0)
+            error_exit("fail to start session");
+    }
+
+    // with rounds the sessions end by themselves
+    if (conf.rounds == 0)
+    {
+        sleep(conf.seconds);
+        __atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+    }
+    int failed = 0;
+    for (int i = 0; i < conf.nsessions; i++)
+    {
+        pthread_join(tids[i], NULL);
+        fclose(sessions[i].devnull);
+        failed += sessions[i].failed;
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    kill(pid, SIGTERM);
+    double cpu[2] = { cpu_s(&ru_end) - cpu_s(&ru_start), 0 };
+    if (wait4(pid, NULL, 0, &ru_server) == pid)
+        cpu[1] = cpu_s(&ru_server);
+    nftw(conf.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    OpStats all[OP_COUNT];
+    bench_merge(sessions, conf.nsessions, all);
+    bench_table(stderr, &conf, all, elapsed, cpu);
+
+    FILE *out = json_path ? fopen(json_path, "w") : stdout;
+    if (out == NULL)
+        error_exit("fail to write results");
+    bench_json(out, &conf, all, elapsed, cpu, failed);
+    if (out != stdout)
+        fclose(out);
+    return failed > 0;
+}
@@ -0,0 +1,272 @@
+#include <pthread.h>
+
+#include "mftpcache.h"
+
+typedef struct FileCacheShard
+{
+    pthread_mutex_t lock;
+    CachedFile *buckets[FILE_CACHE_BUCKETS];
+    CachedFile *lru_head;  /* most recently used */
+    CachedFile *lru_tail;  /* next to evict */
+    uint64_t ghosts[FILE_CACHE_GHOSTS]; /* keys of recent misses, 0 if none */
+    int ghost_next;
+    size_t bytes;
+    FileCacheStats stats;
+} FileCacheShard;
+
+static FileCacheShard shards[FILE_CACHE_SHARDS];
+static size_t shard_capacity; /* 0 while disabled, also the largest file cached */
+
+/**
+ * Key of a file, from device and inode
+ * @param st Pointer to status of file
+ * @return key, never 0
+ */
+static uint64_t file_key(const struct stat *st)
+{
+    uint64_t key = ((uint64_t) st->st_dev << 32 ^ st->st_ino) * 0x9E3779B97F4A7C15ULL;
+    return (key ^ key >> 29) | 1;
+}
+
+static FileCacheShard *shard_of(uint64_t key)
+{
+    return &shards[(key >> 32) % FILE_CACHE_SHARDS];
+}
+
+static int same_version(const CachedFile *file, const struct stat *st)
+{
+    return (size_t) st->st_size == file->size
+           && st->st_mtim.tv_sec == file->mtime.tv_sec && st->st_mtim.tv_nsec == file->mtime.tv_nsec
+           && st->st_ctim.tv_sec == file->ctime.tv_sec && st->st_ctim.tv_nsec == file->ctime.tv_nsec;
+}
+
+void file_cache_init(size_t capacity)
+{
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    shard_capacity = capacity / FILE_CACHE_SHARDS;
+}
+
+void file_cache_put(CachedFile *file)
+{
+    if (file != NULL && __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(file);
+}
+
+/**
+ * Unlink a file from its shard and drop the shard's reference, lock held
+ * @param shard Pointer to shard
+ * @param file Pointer to cached file
+ */
+static void shard_remove(FileCacheShard *shard, CachedFile *file)
+{
+    CachedFile **pp = &shard->buckets[file->key % FILE_CACHE_BUCKETS];
+    while (*pp != file)
+        pp = &(*pp)->chain;
+    *pp = file->chain;
+
+    if (file->prev)
+        file->prev->next = file->next;
+    else
+        shard->lru_head = file->next;
+    if (file->next)
+        file->next->prev = file->prev;
+    else
+        shard->lru_tail = file->prev;
+
+    shard->bytes -= file->size;
+    shard->stats.entries--;
+    file_cache_put(file);
+}
+
+/**
+ * Move a file to the front of the LRU order, lock held
+ */
+static void shard_touch(FileCacheShard *shard, CachedFile *file)
+{
+    if (shard->lru_head == file)
+        return;
+    file->prev->next = file->next;
+    if (file->next)
+        file->next->prev = file->prev;
+    else
+        shard->lru_tail = file->prev;
+    file->prev = NULL;
+    file->next = shard->lru_head;
+    shard->lru_head->prev = file;
+    shard->lru_head = file;
+}
+
+/**
+ * Find the cached version of a file, lock held; a stale one is dropped
+ * @return file, NULL if none or stale
+ */
+static CachedFile *shard_find(FileCacheShard *shard, const struct stat *st, uint64_t key)
+{
+    for (CachedFile *file = shard->buckets[key % FILE_CACHE_BUCKETS]; file; file = file->chain)
+    {
+        if (file->dev != st->st_dev || file->ino != st->st_ino)
+            continue;
+        if (same_version(file, st))
+            return file;
+        shard_remove(shard, file);
+        shard->stats.invalidations++;
+        return NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Whether a file missed recently, remembering it if not, lock held
+ * @return non-zero if it was missed before
+ */
+static int shard_seen(FileCacheShard *shard, uint64_t key)
+{
+    for (int i = 0; i < FILE_CACHE_GHOSTS; i++)
+    {
+        if (shard->ghosts[i] == key)
+        {
+            shard->ghosts[i] = 0;
+            return 1;
+        }
+    }
+    shard->ghosts[shard->ghost_next] = key;
+    shard->ghost_next = (shard->ghost_next + 1) % FILE_CACHE_GHOSTS;
+    return 0;
+}
+
+/**
+ * Add a file at the front, evicting from the back to make room, lock held;
+ * the shard takes a reference
+ */
+static void shard_insert(FileCacheShard *shard, CachedFile *file)
+{
+    uint64_t key = file->key;
+    while (shard->lru_tail && shard->bytes + file->size > shard_capacity)
+    {
+        shard_remove(shard, shard->lru_tail);
+        shard->stats.evictions++;
+    }
+
+    file->chain = shard->buckets[key % FILE_CACHE_BUCKETS];
+    shard->buckets[key % FILE_CACHE_BUCKETS] = file;
+    file->prev = NULL;
+    file->next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->prev = file;
+    else
+        shard->lru_tail = file;
+    shard->lru_head = file;
+
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    shard->bytes += file->size;
+    shard->stats.entries++;
+    shard->stats.admitted++;
+}
+
+/**
+ * Read a whole regular file into memory, unless it changed meanwhile
+ * @param dirfd Directory the name resolves against
+ * @param fname String file name
+ * @param st Pointer to save the status it was read at
+ * @return file with one reference, NULL if failed
+ */
+static CachedFile *file_load(int dirfd, const char *fname, struct stat *st)
+{
+    int fd = openat(dirfd, fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    CachedFile *file = NULL;
+    struct stat after;
+    if (fstat(fd, st) == 0 && S_ISREG(st->st_mode) && (size_t) st->st_size <= shard_capacity
+        && (file = (CachedFile *) malloc(sizeof(CachedFile) + st->st_size)) != NULL)
+    {
+        size_t got = 0;
+        ssize_t n = 1;
+        while (got < (size_t) st->st_size
+               && (n = pread(fd, file->data + got, st->st_size - got, got)) > 0)
+            got += n;
+
+        file->key = file_key(st);
+        file->dev = st->st_dev;
+        file->ino = st->st_ino;
+        file->size = st->st_size;
+        file->mtime = st->st_mtim;
+        file->ctime = st->st_ctim;
+        file->refs = 1;
+
+        // a writer racing the read leaves a mix of versions
+        if (got != file->size || fstat(fd, &after) < 0 || !same_version(file, &after))
+        {
+            free(file);
+            file = NULL;
+        }
+    }
+    close(fd);
+    return file;
+}
+
+CachedFile *file_cache_get(int dirfd, const char *fname)
+{
+    struct stat st;
+    if (shard_capacity == 0 || fstatat(dirfd, fname, &st, 0) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    uint64_t key = file_key(&st);
+    FileCacheShard *shard = shard_of(key);
+    pthread_mutex_lock(&shard->lock);
+    CachedFile *file = shard_find(shard, &st, key);
+    if (file != NULL)
+    {
+        shard->stats.hits++;
+        shard_touch(shard, file);
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        return file;
+    }
+    shard->stats.misses++;
+
+    // only files asked for twice are hot enough to take room
+    int admit = (size_t) st.st_size <= shard_capacity && shard_seen(shard, key);
+    pthread_mutex_unlock(&shard->lock);
+    if (!admit || (file = file_load(dirfd, fname, &st)) == NULL)
+        return NULL;
+
+    // another thread may have loaded it meanwhile, keep the first one
+    shard = shard_of(file->key);
+    pthread_mutex_lock(&shard->lock);
+    if (shard_find(shard, &st, file->key) == NULL)
+        shard_insert(shard, file);
+    pthread_mutex_unlock(&shard->lock);
+    return file;
+}
+
+void file_cache_stats(FileCacheStats *stats)
+{
+    memset(stats, 0, sizeof(FileCacheStats));
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        FileCacheShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->admitted += shard->stats.admitted;
+        stats->evictions += shard->stats.evictions;
+        stats->invalidations += shard->stats.invalidations;
+        stats->entries += shard->stats.entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void file_cache_print_stats(FILE *out)
+{
+    FileCacheStats stats;
+    file_cache_stats(&stats);
+
+    fprintf(out, "cache: %zu files %zu bytes of %zu\n",
+            stats.entries, stats.bytes, shard_capacity * FILE_CACHE_SHARDS);
+    fprintf(out, "cache: hits %lu misses %lu admitted %lu evictions %lu invalidations %lu\n",
+            stats.hits, stats.misses, stats.admitted, stats.evictions, stats.invalidations);
+}
@@ -0,0 +1,72 @@
+#ifndef MFTPCACHE_H
+#define MFTPCACHE_H
+
+#include "mftputil.h"
+
+#define FILE_CACHE_SHARDS 8        /* locks the cache is split over */
+#define FILE_CACHE_BUCKETS 256     /* hash buckets per shard */
+#define FILE_CACHE_GHOSTS 64       /* recent misses remembered per shard */
+#define FILE_CACHE_DEFAULT_MB 128  /* cache size unless set with -c */
+
+/* contents of a regular file held in memory */
+typedef struct CachedFile
+{
+    uint64_t key;             /* from device and inode */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    int refs;                 /* cache and every transfer sending it hold one */
+    struct CachedFile *prev;  /* LRU order, most recent first */
+    struct CachedFile *next;
+    struct CachedFile *chain; /* next in hash bucket */
+    size_t size;
+    char data[];
+} CachedFile;
+
+typedef struct FileCacheStats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long admitted;     /* misses loaded into the cache */
+    unsigned long evictions;    /* dropped to make room */
+    unsigned long invalidations; /* dropped as the file changed */
+    size_t bytes;
+    size_t entries;
+} FileCacheStats;
+
+/**
+ * Size the cache of hot files; until called, or with 0, nothing is cached
+ * @param capacity Bytes of file contents to hold at most
+ */
+void file_cache_init(size_t capacity);
+
+/**
+ * Look up a file, with a stat but no open: a hit needs the device,
+ * inode, size, mtime and ctime the entry was loaded with; a file
+ * missed recently enough is loaded now, others are only remembered
+ * @param dirfd Directory the name resolves against
+ * @param fname String file name
+ * @return file with a reference, NULL if not cached
+ */
+CachedFile *file_cache_get(int dirfd, const char *fname);
+
+/**
+ * Drop a reference taken by file_cache_get()
+ * @param file Pointer to cached file, may be NULL
+ */
+void file_cache_put(CachedFile *file);
+
+/**
+ * Take a snapshot of cache counters, summed over shards
+ * @param stats Pointer to struct file cache stats to fill
+ */
+void file_cache_stats(FileCacheStats *stats);
+
+/**
+ * Print cache counters
+ * @param out Stream to print to
+ */
+void file_cache_print_stats(FILE *out);
+
+#endif
@@ -0,0 +1,837 @@
+#include <errno.h>
+
+#include "mftpclient.h"
+#include "mftphash.h"
+
+/**
+ * Set up a session for a server address
+ */
+static void session_setup(ClientSession *cs, const struct sockaddr_in *addr, const XferProfile *prof)
+{
+    memset(cs, 0, sizeof(ClientSession));
+    cs->ctrlsock = -1;
+    cs->datasock = -1;
+    cs->server_addr = *addr;
+    cs->prof = *prof;
+    pthread_mutex_init(&cs->lock, NULL);
+    pthread_cond_init(&cs->cond, NULL);
+}
+
+/**
+ * Close the connections of a session and tear it down, without quitting
+ */
+static void session_close(ClientSession *cs)
+{
+    if (cs->datasock >= 0)
+        close(cs->datasock);
+    if (cs->ctrlsock >= 0)
+        close(cs->ctrlsock);
+    cs->datasock = cs->ctrlsock = -1;
+    pthread_cond_destroy(&cs->cond);
+    pthread_mutex_destroy(&cs->lock);
+}
+
+/**
+ * Start the outcome of a transfer, failed until it is done
+ */
+static void xfer_init(ClientXfer *x)
+{
+    memset(x, 0, sizeof(ClientXfer));
+    x->bytes = -1;
+    x->verified = -1;
+}
+
+int ftp_client_init(ClientSession *cs, const char *host, int port)
+{
+    struct sockaddr_in addr;
+    XferProfile prof;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    xfer_profile_get("default", &prof);
+    session_setup(cs, &addr, &prof);
+    return inet_aton(host, &cs->server_addr.sin_addr) ? 0 : -1;
+}
+
+int ftp_client_connect(ClientSession *cs)
+{
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    strcpy(cmd.command, CMD_HELLO);
+
+    for (int framed = 1; framed >= 0; framed--)
+    {
+        int ctrlsock;
+        if ((ctrlsock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+
+        cs->ctrlsock = ctrlsock;
+        cs->framed = 0;
+        if (connect(ctrlsock, (struct sockaddr *) &cs->server_addr, sizeof(cs->server_addr)) < 0
+            || ftp_client_response(cs, NULL) != CODE_SERVICE_READY)
+        {
+            close(ctrlsock);
+            cs->ctrlsock = -1;
+            return -1;
+        }
+        xfer_ctrl_socket(ctrlsock);
+        if (!framed)
+            return 0;
+
+        // an older server takes the hello for a username and
+        // would fail the login, so leave it for a new connection
+        if (ftp_client_give_command(cs, &cmd) == 0
+            && ftp_client_response(cs, NULL) == CODE_VALID_CMD)
+        {
+            cs->framed = 1;
+            return 0;
+        }
+        close(ctrlsock);
+        cs->ctrlsock = -1;
+    }
+    return -1;
+}
+
+int ftp_client_auth(ClientSession *cs, const char *usrname, const char *password)
+{
+    snprintf(cs->usrname, sizeof(cs->usrname), "%s", usrname);
+    snprintf(cs->password, sizeof(cs->password), "%s", password);
+
+    int res_code = ftp_client_command(cs, "user", usrname);
+    if (res_code != CODE_NEED_PASS)
+        return res_code;
+    return ftp_client_command(cs, "pass", password);
+}
+
+int ftp_client_open(ClientSession *cs, const char *host, int port,
+                    const char *usrname, const char *password)
+{
+    if (ftp_client_init(cs, host, port) < 0 || ftp_client_connect(cs) < 0)
+    {
+        session_close(cs);
+        return -1;
+    }
+
+    int res_code = ftp_client_auth(cs, usrname, password);
+    if (res_code != CODE_USR_LOGGED_IN)
+    {
+        session_close(cs);
+        return res_code;
+    }
+    if (ftp_client_passive(cs, 1) != CODE_ENTER_PASV)
+    {
+        ftp_client_quit(cs);
+        return -1;
+    }
+    return res_code;
+}
+
+int ftp_client_session_open(ClientSession *cs, ClientSession *ws, const char *cwd)
+{
+    session_setup(ws, &cs->server_addr, &cs->prof);
+    if (ftp_client_connect(ws) < 0)
+    {
+        session_close(ws);
+        return -1;
+    }
+    if (ftp_client_auth(ws, cs->usrname, cs->password) != CODE_USR_LOGGED_IN)
+    {
+        session_close(ws);
+        return -1;
+    }
+
+    // passive, so sessions do not fight over the client data port;
+    // the server side starts at the default profile
+    if (ftp_client_passive(ws, 1) != CODE_ENTER_PASV
+        || (strcmp(ws->prof.name, "default") != 0
+            && ftp_client_command(ws, "prof", ws->prof.name) != CODE_VALID_CMD)
+        || (cwd[0] != '\0' && ftp_client_command(ws, "cd", cwd) != CODE_VALID_CMD))
+    {
+        ftp_client_quit(ws);
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_client_quit(ClientSession *cs)
+{
+    ftp_client_wait(cs);
+    int res_code = ftp_client_command(cs, "quit", NULL);
+    session_close(cs);
+    return res_code;
+}
+
+int ftp_client_give_command(ClientSession *cs, Command *cmd)
+{
+    char buffer[CMD_MSG_MAX];
+    int len = cmd_encode(cmd, cs->framed, buffer);
+    if (len < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return send_all(cs->ctrlsock, buffer, len);
+}
+
+int ftp_client_response(ClientSession *cs, uint32_t *tag)
+{
+    uint32_t res;
+    if (recv(cs->ctrlsock, &res, sizeof(res), MSG_WAITALL) != sizeof(res))
+        return -1;
+
+    res = ntohl(res);
+    if (tag != NULL)
+        *tag = res >> RES_TAG_SHIFT;
+    return res & RES_CODE_MASK;
+}
+
+int ftp_client_command(ClientSession *cs, const char *command, const char *arg)
+{
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    strncpy(cmd.command, command, sizeof(cmd.command) - 1);
+    if (arg != NULL)
+        strncpy(cmd.arg, arg, MAX_BUF_SIZE - 1);
+    if (ftp_client_give_command(cs, &cmd) < 0)
+        return -1;
+    return ftp_client_response(cs, NULL);
+}
+
+int ftp_client_data_conn(ClientSession *cs)
+{
+    int lstnsock, datasock;
+
+    if (cs->passive)
+    {
+        struct sockaddr_in data_addr = cs->server_addr;
+        data_addr.sin_port = htons(cs->pasv_port);
+        if ((datasock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        xfer_data_socket(&cs->prof, datasock);
+        if (connect(datasock, (struct sockaddr *) &data_addr, sizeof(data_addr)) < 0)
+        {
+            close(datasock);
+            return -1;
+        }
+        return datasock;
+    }
+
+    if ((lstnsock = listen_socket(CLIENT_DATA_PORT, MAX_PENDING)) < 0)
+        return -1;
+    xfer_data_socket(&cs->prof, lstnsock);
+
+    // inform server to connect
+    datasock = -1;
+    if (send(cs->ctrlsock, &(int) {1}, sizeof(int), 0) == sizeof(int))
+        datasock = accept(lstnsock, NULL, NULL);
+    close(lstnsock);
+    return datasock;
+}
+
+/**
+ * Get a data connection: the session's open one in block mode, else a new one
+ * @param cs Pointer to client session
+ * @return socket for data, -1 if failed
+ */
+static int open_data(ClientSession *cs)
+{
+    if (cs->block_mode && cs->datasock >= 0)
+        return cs->datasock;
+
+    int datasock = ftp_client_data_conn(cs);
+    if (cs->block_mode)
+        cs->datasock = datasock;
+    return datasock;
+}
+
+/**
+ * End use of a data connection: stream mode closes it,
+ * block mode keeps it unless the transfer broke framing
+ * @param cs Pointer to client session
+ * @param datasock Socket for data
+ * @param failed Whether the transfer failed
+ */
+static void close_data(ClientSession *cs, int datasock, int failed)
+{
+    if (cs->block_mode && !failed)
+        return;
+    if (datasock == cs->datasock)
+        cs->datasock = -1;
+    close(datasock);
+}
+
+/**
+ * Under vrfy, compare the CRC32C of a file just transferred with the
+ * one server keeps of its copy; in mode z the local file is read again
+ * @param cs Pointer to client session
+ * @param local String local file
+ * @param remote String file on server
+ * @param x Pointer to outcome, with the CRC32C taken on the way
+ */
+static void check_crc(ClientSession *cs, const char *local, const char *remote, ClientXfer *x)
+{
+    if (!cs->verify)
+        return;
+
+    uint64_t digest;
+    if (cs->zlevel)
+    {
+        int fd = open(local, O_RDONLY | O_CLOEXEC);
+        int res = fd < 0 ? -1 : hash_file(fd, HASH_CRC32C, 0, HASH_WHOLE, &digest);
+        if (fd >= 0)
+            close(fd);
+        if (res < 0)
+            return;
+        x->crc = (uint32_t) digest;
+    }
+
+    char arg[MAX_BUF_SIZE];
+    snprintf(arg, sizeof(arg), "crc32c %s", remote);
+    if (ftp_client_hash_query(cs, arg, &digest) != CODE_FILE_STATUS)
+        return;
+    x->server_crc = (uint32_t) digest;
+    x->verified = x->server_crc == x->crc;
+}
+
+ssize_t ftp_client_get(ClientSession *cs, const char *remote, const char *local, ClientXfer *x)
+{
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    strcpy(cmd.command, "get");
+    strncpy(cmd.arg, remote, MAX_BUF_SIZE - 1);
+
+    int res_code = -1;
+    if (ftp_client_give_command(cs, &cmd) == 0)
+        res_code = ftp_client_response(cs, NULL);
+    if (ftp_client_get_reply(cs, local, res_code, x) >= 0)
+        check_crc(cs, local, remote, x);
+    return x->bytes;
+}
+
+ssize_t ftp_client_get_reply(ClientSession *cs, const char *local, int res_code, ClientXfer *x)
+{
+    xfer_init(x);
+    x->res_code = res_code;
+    if (res_code != CODE_OPEN_DATA_CONN)
+        return -1;
+
+    // start downloading if permitted
+    int datasock = open_data(cs);
+    if (datasock < 0)
+    {
+        x->res_code = -1;
+        return -1;
+    }
+
+    FILE *fp = fopen(local, "w");
+    if (fp == NULL)
+    {
+        // still drain the data so the session stays in step
+        x->local_errno = errno;
+        fp = fopen("/dev/null", "w");
+    }
+    x->transferred = 1;
+    xfer_clock_start(&x->clock);
+    ssize_t bytes;
+    if (cs->zlevel)
+        bytes = zmode_recv_file(cs->prof.chunk_size, datasock, fp, &x->zstats);
+    else
+        bytes = xfer_recv_file(&cs->prof, datasock, fp, cs->block_mode, cs->verify ? &x->crc : NULL);
+    close_data(cs, datasock, bytes < 0);
+    fclose(fp);
+
+    x->res_code = ftp_client_response(cs, NULL);
+    if (x->local_errno == 0 && x->res_code == CODE_CLOSE_DATA_CONN)
+        x->bytes = bytes;
+    return x->bytes;
+}
+
+ssize_t ftp_client_get_range(ClientSession *cs, const char *remote, const char *local,
+                             off_t offset, size_t length, ClientXfer *x)
+{
+    xfer_init(x);
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    strcpy(cmd.command, "rget");
+    if (snprintf(cmd.arg, MAX_BUF_SIZE - 6, "%lld %zu %s",
+                 (long long) offset, length, remote) >= MAX_BUF_SIZE - 6)
+    {
+        x->local_errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // writes through its own descriptor at its own offset,
+    // so ranges of one file can be fetched at the same time
+    FILE *fp = fopen(local, "r+");
+    if (fp == NULL || fseeko(fp, offset, SEEK_SET) < 0)
+    {
+        x->local_errno = errno;
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+
+    x->res_code = -1;
+    if (ftp_client_give_command(cs, &cmd) == 0)
+        x->res_code = ftp_client_response(cs, NULL);
+    int datasock = -1;
+    if (x->res_code != CODE_OPEN_DATA_CONN || (datasock = ftp_client_data_conn(cs)) < 0)
+    {
+        if (x->res_code == CODE_OPEN_DATA_CONN)
+            x->res_code = -1;
+        fclose(fp);
+        return -1;
+    }
+
+    x->transferred = 1;
+    xfer_clock_start(&x->clock);
+    ssize_t bytes = xfer_recv_file(&cs->prof, datasock, fp, 0, NULL);
+    close(datasock);
+    fclose(fp);
+
+    x->res_code = ftp_client_response(cs, NULL);
+    if (x->res_code == CODE_CLOSE_DATA_CONN && bytes == (ssize_t) length)
+        x->bytes = bytes;
+    return x->bytes;
+}
+
+ssize_t ftp_client_put(ClientSession *cs, const char *local, const char *remote, ClientXfer *x)
+{
+    xfer_init(x);
+    FILE *fp = fopen(local, "r");
+    if (!fp)
+    {
+        x->local_errno = errno;
+        return -1;
+    }
+
+    // announce the size so the server allocates the file in one piece;
+    // sent right ahead of put, its answer is read without a round trip
+    Command cmd;
+    struct stat st;
+    int announced = 0;
+    memset(&cmd, 0, sizeof(cmd));
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        strcpy(cmd.command, "allo");
+        snprintf(cmd.arg, sizeof(cmd.arg), "%lld", (long long) st.st_size);
+        announced = ftp_client_give_command(cs, &cmd) == 0;
+    }
+
+    strcpy(cmd.command, "put");
+    strncpy(cmd.arg, remote, MAX_BUF_SIZE - 1);
+    x->res_code = -1;
+    if (ftp_client_give_command(cs, &cmd) == 0)
+    {
+        if (announced)
+            ftp_client_response(cs, NULL);
+        x->res_code = ftp_client_response(cs, NULL);
+    }
+    int datasock = -1;
+    if (x->res_code != CODE_OPEN_DATA_CONN || (datasock = open_data(cs)) < 0)
+    {
+        if (x->res_code == CODE_OPEN_DATA_CONN)
+            x->res_code = -1;
+        fclose(fp);
+        return -1;
+    }
+
+    // start uploading if permitted
+    x->transferred = 1;
+    xfer_clock_start(&x->clock);
+    ssize_t bytes;
+    if (cs->zlevel)
+        bytes = zmode_send_file(cs->zlevel, cs->prof.chunk_size, datasock, fp, &x->zstats);
+    else
+        bytes = xfer_send_file(&cs->prof, datasock, fp, cs->block_mode, cs->verify ? &x->crc : NULL);
+    close_data(cs, datasock, bytes < 0);
+    fclose(fp);
+
+    x->res_code = ftp_client_response(cs, NULL);
+    if (x->res_code == CODE_CLOSE_DATA_CONN && bytes >= 0)
+    {
+        x->bytes = bytes;
+        check_crc(cs, local, remote, x);
+    }
+    return x->bytes;
+}
+
+ssize_t ftp_client_delta_put(ClientSession *cs, const char *local, const char *remote, ClientXfer *x)
+{
+    xfer_init(x);
+
+    // the local file is mapped, so it has to be a regular one
+    struct stat st;
+    FILE *fp = fopen(local, "r");
+    if (!fp || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        x->local_errno = fp ? EINVAL : errno;
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+
+    x->res_code = ftp_client_command(cs, "dput", remote);
+    if (x->res_code == CODE_FILE_UNAVAIL)
+    {
+        fclose(fp);
+        ftp_client_put(cs, local, remote, x);
+        x->whole = 1;
+        return x->bytes;
+    }
+    int datasock = -1;
+    if (x->res_code != CODE_OPEN_DATA_CONN || (datasock = open_data(cs)) < 0)
+    {
+        if (x->res_code == CODE_OPEN_DATA_CONN)
+            x->res_code = -1;
+        fclose(fp);
+        return -1;
+    }
+
+    // start uploading if permitted
+    x->transferred = 1;
+    xfer_clock_start(&x->clock);
+    ssize_t bytes = delta_send_file(datasock, fp, &x->dstats);
+    close_data(cs, datasock, bytes < 0);
+    fclose(fp);
+
+    x->res_code = ftp_client_response(cs, NULL);
+    if (x->res_code == CODE_CLOSE_DATA_CONN)
+        x->bytes = bytes;
+    return x->bytes;
+}
+
+int ftp_client_list(ClientSession *cs, const char *command, const char *arg, FILE *out)
+{
+    int res_code = ftp_client_command(cs, command, arg);
+    if (res_code != CODE_OPEN_DATA_CONN)
+        return res_code;
+
+    // use data port to get stdout
+    char dirbuf[MAX_BUF_SIZE];
+    memset(dirbuf, 0, MAX_BUF_SIZE);
+
+    int datasock = open_data(cs);
+    if (datasock < 0)
+        return -1;
+    if (!cs->block_mode)
+    {
+        while (recv(datasock, dirbuf, MAX_BUF_SIZE - 1, 0) > 0)
+        {
+            fputs(dirbuf, out);
+            memset(dirbuf, 0, MAX_BUF_SIZE);
+        }
+        close(datasock);
+        return 0;
+    }
+
+    // block mode: take every block up to end of file
+    ssize_t len, bytes_rcvd;
+    int desc = 0;
+    while (!(desc & BLOCK_EOF))
+    {
+        if ((len = recv_block_header(datasock, &desc)) < 0)
+        {
+            close_data(cs, datasock, 1);
+            return -1;
+        }
+        while (len > 0)
+        {
+            size_t chunk = len < MAX_BUF_SIZE - 1 ? len : MAX_BUF_SIZE - 1;
+            if ((bytes_rcvd = recv(datasock, dirbuf, chunk, MSG_WAITALL)) <= 0)
+            {
+                close_data(cs, datasock, 1);
+                return -1;
+            }
+            fputs(dirbuf, out);
+            memset(dirbuf, 0, MAX_BUF_SIZE);
+            len -= bytes_rcvd;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse a manifest line "<size> <mtime ns> <crc|-> <path>"
+ * @param line String line, without new line
+ * @param ent Pointer to save entry, path pointing into line
+ * @return 0, -1 if malformed
+ */
+static int parse_entry(char *line, ClientEntry *ent)
+{
+    unsigned long long size, mtime;
+    char crc[16];
+    int pos = 0;
+    if (sscanf(line, "%llu %llu %15s %n", &size, &mtime, crc, &pos) != 3 || pos == 0
+        || line[pos] == '\0')
+        return -1;
+    ent->path = line + pos;
+    ent->size = size;
+    ent->mtime.tv_sec = mtime / 1000000000;
+    ent->mtime.tv_nsec = mtime % 1000000000;
+    ent->has_crc = strcmp(crc, "-") != 0;
+    ent->crc = ent->has_crc ? strtoul(crc, NULL, 16) : 0;
+    return 0;
+}
+
+int ftp_client_manifest(ClientSession *cs, const char *dir, int crc,
+                        ClientEntry **entries, size_t *count)
+{
+    char arg[MAX_BUF_SIZE];
+    snprintf(arg, sizeof(arg), "%s%s", crc ? "-c " : "", dir);
+
+    char *text = NULL;
+    size_t text_size = 0;
+    FILE *out = open_memstream(&text, &text_size);
+    if (out == NULL)
+        return -1;
+    int rc = ftp_client_list(cs, "mani", arg, out);
+    fclose(out);
+
+    ClientEntry *ents = NULL;
+    size_t n = 0, cap = 0;
+    char *line = rc == 0 ? strtok(text, "\n") : NULL;
+    for (; line != NULL; line = strtok(NULL, "\n"))
+    {
+        ClientEntry ent;
+        if (parse_entry(line, &ent) < 0)
+            continue;
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            ClientEntry *grown = (ClientEntry *) realloc(ents, cap * sizeof(ClientEntry));
+            if (grown == NULL)
+            {
+                rc = -1;
+                break;
+            }
+            ents = grown;
+        }
+        if ((ent.path = strdup(ent.path)) == NULL)
+        {
+            rc = -1;
+            break;
+        }
+        ents[n++] = ent;
+    }
+    free(text);
+
+    if (rc != 0)
+    {
+        ftp_client_manifest_free(ents, n);
+        return rc;
+    }
+    *entries = ents;
+    *count = n;
+    return 0;
+}
+
+void ftp_client_manifest_free(ClientEntry *entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+int ftp_client_server_cwd(ClientSession *cs, char *cwd, size_t size)
+{
+    memset(cwd, 0, size);
+    FILE *out = fmemopen(cwd, size, "w");
+    if (out == NULL)
+        return -1;
+    int rc = ftp_client_list(cs, "pwd", NULL, out);
+    fclose(out);
+    cwd[strcspn(cwd, "\n")] = '\0';
+    return rc == 0 ? 0 : -1;
+}
+
+int ftp_client_passive(ClientSession *cs, int on)
+{
+    // leaving passive mode is "port", back to the client's data port
+    int res_code = ftp_client_command(cs, on ? "pasv" : "port", NULL);
+    if (on && res_code == CODE_ENTER_PASV)
+    {
+        // the data port follows the 227
+        int port;
+        if (recv(cs->ctrlsock, &port, sizeof(port), MSG_WAITALL) != sizeof(port))
+            return -1;
+        cs->pasv_port = ntohl(port);
+        cs->passive = 1;
+    }
+    else if (!on && res_code == CODE_VALID_CMD)
+        cs->passive = 0;
+    return res_code;
+}
+
+int ftp_client_mode(ClientSession *cs, const char *mode)
+{
+    int res_code = ftp_client_command(cs, "mode", mode);
+    if (res_code != CODE_VALID_CMD)
+        return res_code;
+
+    cs->block_mode = strcmp(mode, "s") != 0;
+    cs->zlevel = zmode_level(mode);
+    if (!cs->block_mode && cs->datasock >= 0)
+    {
+        close(cs->datasock);
+        cs->datasock = -1;
+    }
+    return res_code;
+}
+
+int ftp_client_profile(ClientSession *cs, const char *name)
+{
+    XferProfile prof;
+    if (xfer_profile_get(name, &prof) < 0)
+        return CODE_CMD_NOT_IMPL;
+
+    int res_code = ftp_client_command(cs, "prof", name);
+    if (res_code != CODE_VALID_CMD)
+        return res_code;
+
+    cs->prof = prof;
+    if (cs->datasock >= 0)
+        xfer_data_socket(&cs->prof, cs->datasock);
+    return res_code;
+}
+
+int ftp_client_verify(ClientSession *cs, int on)
+{
+    int res_code = ftp_client_command(cs, "vrfy", on ? "on" : "off");
+    if (res_code == CODE_VALID_CMD)
+        cs->verify = on;
+    return res_code;
+}
+
+int ftp_client_size(ClientSession *cs, const char *fname, off_t *size)
+{
+    int res_code = ftp_client_command(cs, "size", fname);
+    if (res_code != CODE_FILE_STATUS)
+        return res_code;
+
+    uint64_t _size;
+    if (recv(cs->ctrlsock, &_size, sizeof(_size), MSG_WAITALL) != sizeof(_size))
+        return -1;
+    *size = be64toh(_size);
+    return res_code;
+}
+
+int ftp_client_hash_query(ClientSession *cs, const char *arg, uint64_t *digest)
+{
+    int res_code = ftp_client_command(cs, "hash", arg);
+    if (res_code != CODE_FILE_STATUS)
+        return res_code;
+
+    uint64_t _digest;
+    if (recv(cs->ctrlsock, &_digest, sizeof(_digest), MSG_WAITALL) != sizeof(_digest))
+        return -1;
+    *digest = be64toh(_digest);
+    return res_code;
+}
+
+/**
+ * Run queued transfers of a session in order until told to stop
+ * @param _cs Pointer to client session
+ */
+static void *session_worker(void *_cs)
+{
+    ClientSession *cs = (ClientSession *) _cs;
+    pthread_mutex_lock(&cs->lock);
+    while (1)
+    {
+        while (cs->jobs == NULL && !cs->stopping)
+            pthread_cond_wait(&cs->cond, &cs->lock);
+        if (cs->jobs == NULL)
+            break;
+        ClientJob *job = cs->jobs;
+        if ((cs->jobs = job->next) == NULL)
+            cs->jobs_tail = NULL;
+        pthread_mutex_unlock(&cs->lock);
+
+        ClientXfer x;
+        if (job->op == CLIENT_GET)
+            ftp_client_get(cs, job->remote, job->local, &x);
+        else if (job->op == CLIENT_PUT)
+            ftp_client_put(cs, job->local, job->remote, &x);
+        else
+            ftp_client_delta_put(cs, job->local, job->remote, &x);
+        if (job->done != NULL)
+            job->done(cs, job, &x);
+        free(job);
+
+        // counted down after done, which may have queued the next one
+        pthread_mutex_lock(&cs->lock);
+        if (--cs->pending == 0)
+            pthread_cond_broadcast(&cs->cond);
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return NULL;
+}
+
+int ftp_client_submit(ClientSession *cs, int op, const char *remote, const char *local,
+                      ClientDone done, void *arg)
+{
+    if (op != CLIENT_GET && op != CLIENT_PUT && op != CLIENT_DPUT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ClientJob *job = (ClientJob *) calloc(1, sizeof(ClientJob));
+    if (job == NULL)
+        return -1;
+    job->op = op;
+    strncpy(job->remote, remote, MAX_BUF_SIZE - 1);
+    strncpy(job->local, local, MAX_BUF_SIZE - 1);
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&cs->lock);
+    if (!cs->worker_running)
+    {
+        int err = pthread_create(&cs->worker, NULL, session_worker, cs);
+        if (err != 0)
+        {
+            pthread_mutex_unlock(&cs->lock);
+            free(job);
+            errno = err;
+            return -1;
+        }
+        cs->worker_running = 1;
+    }
+    if (cs->jobs_tail != NULL)
+        cs->jobs_tail->next = job;
+    else
+        cs->jobs = job;
+    cs->jobs_tail = job;
+    cs->pending++;
+    pthread_cond_broadcast(&cs->cond);
+    pthread_mutex_unlock(&cs->lock);
+    return 0;
+}
+
+int ftp_client_pending(ClientSession *cs)
+{
+    pthread_mutex_lock(&cs->lock);
+    int pending = cs->pending;
+    pthread_mutex_unlock(&cs->lock);
+    return pending;
+}
+
+void ftp_client_wait(ClientSession *cs)
+{
+    pthread_mutex_lock(&cs->lock);
+    if (!cs->worker_running)
+    {
+        pthread_mutex_unlock(&cs->lock);
+        return;
+    }
+    while (cs->pending > 0)
+        pthread_cond_wait(&cs->cond, &cs->lock);
+    cs->stopping = 1;
+    pthread_cond_broadcast(&cs->cond);
+    pthread_mutex_unlock(&cs->lock);
+
+    pthread_join(cs->worker, NULL);
+    cs->worker_running = 0;
+    cs->stopping = 0;
+}
@@ -0,0 +1,367 @@
+#ifndef MFTPCLIENT_H
+#define MFTPCLIENT_H
+
+#include <pthread.h>
+
+#include "mftputil.h"
+#include "mftpcmd.h"
+#include "mftpdelta.h"
+#include "mftpprof.h"
+#include "mftpz.h"
+
+/*
+ * libmftp, the client side of the protocol for programs to embed.
+ * Nothing here prints or exits: calls return the response code of the
+ * server, or -1 when the connection failed and the session should be
+ * quit. A session is used by one thread at a time and many sessions may
+ * run side by side; transfers queued with ftp_client_submit() run in
+ * order on the session's own thread, reusing its connections.
+ */
+
+#define CLIENT_GET 0  /* jobs of ftp_client_submit() */
+#define CLIENT_PUT 1
+#define CLIENT_DPUT 2
+
+/* outcome of a transfer */
+typedef struct ClientXfer
+{
+    int res_code;        /* last response of server, 0 if not asked, -1 if the connection failed */
+    ssize_t bytes;       /* bytes of the file moved, -1 if failed */
+    int local_errno;     /* why the local file could not be opened, else 0 */
+    int transferred;     /* data moved, else refused before a data connection */
+    int whole;           /* dput found no copy on server, so put the file whole */
+    int verified;        /* under vrfy: 1 if server has the same CRC32C, 0 if not, -1 if unknown */
+    uint32_t crc;        /* CRC32C of the file, under vrfy */
+    uint32_t server_crc; /* CRC32C server keeps of its copy, under vrfy */
+    XferClock clock;     /* time of the data transfer */
+    ZmodeStats zstats;   /* what mode z did */
+    DeltaStats dstats;   /* what dput matched */
+} ClientXfer;
+
+/* a regular file in a manifest */
+typedef struct ClientEntry
+{
+    char *path;            /* as server sees it from the session's directory */
+    off_t size;
+    struct timespec mtime;
+    int has_crc;
+    uint32_t crc;          /* CRC32C, if has_crc */
+} ClientEntry;
+
+struct ClientSession;
+struct ClientJob;
+
+/**
+ * Called on the session's thread when a queued transfer is done
+ * @param cs Pointer to client session, free to queue more transfers
+ * @param job Pointer to job, freed on return
+ * @param x Pointer to outcome
+ */
+typedef void (*ClientDone)(struct ClientSession *cs, const struct ClientJob *job, const ClientXfer *x);
+
+typedef struct ClientJob
+{
+    struct ClientJob *next;
+    int op;                    /* CLIENT_GET, CLIENT_PUT or CLIENT_DPUT */
+    char remote[MAX_BUF_SIZE]; /* file on server */
+    char local[MAX_BUF_SIZE];  /* local file */
+    ClientDone done;           /* NULL if none */
+    void *arg;                 /* for done */
+} ClientJob;
+
+typedef struct ClientSession
+{
+    int ctrlsock;
+    int framed;     /* commands go as frames, else as text messages */
+    int passive;    /* connect to server for data instead of listening */
+    int pasv_port;  /* server data port in passive mode */
+    int block_mode; /* transfers are framed in blocks on one data connection */
+    int zlevel;     /* deflate level of files in mode z, 0 if uncompressed */
+    int verify;     /* get and put check the CRC32C of files with server */
+    int datasock;   /* data connection kept open in block mode, -1 if none */
+    XferProfile prof; /* chunk and socket tuning of data connections */
+    struct sockaddr_in server_addr;
+    char usrname[MAX_BUF_SIZE]; /* kept to log in extra sessions */
+    char password[MAX_BUF_SIZE];
+    pthread_mutex_t lock;  /* guards the jobs below */
+    pthread_cond_t cond;   /* signals a job queued, or none pending */
+    ClientJob *jobs;       /* queued, oldest first */
+    ClientJob *jobs_tail;
+    int pending;           /* jobs queued or running */
+    int stopping;          /* the worker exits once the queue is empty */
+    int worker_running;
+    pthread_t worker;
+} ClientSession;
+
+/**
+ * Set up a session, not connected yet, in active mode with the
+ * default profile
+ * @param cs Pointer to client session
+ * @param host String server IPv4 address
+ * @param port Server port
+ * @return 0, -1 if the address is malformed
+ */
+int ftp_client_init(ClientSession *cs, const char *host, int port);
+
+/**
+ * Connect a control socket to server, wait for service ready and ask
+ * for framed commands, starting over in text if the server has no frames
+ * @param cs Pointer to client session, set up by ftp_client_init()
+ * @return 0, -1 if failed
+ */
+int ftp_client_connect(ClientSession *cs);
+
+/**
+ * Send username & password for validation, keeping them in the session
+ * @param cs Pointer to connected client session
+ * @param usrname String username
+ * @param password String password
+ * @return response code of login, -1 if failed
+ */
+int ftp_client_auth(ClientSession *cs, const char *usrname, const char *password);
+
+/**
+ * Set up, connect and log in a session in passive mode, so that any
+ * number of sessions of one process can transfer at the same time
+ * @param cs Pointer to client session
+ * @param host String server IPv4 address
+ * @param port Server port
+ * @param usrname String username
+ * @param password String password
+ * @return CODE_USR_LOGGED_IN, else the response code or -1, and the session is closed
+ */
+int ftp_client_open(ClientSession *cs, const char *host, int port,
+                    const char *usrname, const char *password);
+
+/**
+ * Open another session to the same server: log in with the same
+ * credentials, enter passive mode and follow cwd and profile
+ * @param cs Pointer to client session to copy
+ * @param ws Pointer to client session to open
+ * @param cwd String server directory, empty to stay at the root
+ * @return 0, -1 if failed
+ */
+int ftp_client_session_open(ClientSession *cs, ClientSession *ws, const char *cwd);
+
+/**
+ * Wait for queued transfers, then quit the session and close it
+ * @param cs Pointer to client session
+ * @return response code of quit, -1 if failed
+ */
+int ftp_client_quit(ClientSession *cs);
+
+/**
+ * Send a command, framed if the server agreed to; a tagged command
+ * may be sent while others wait for their responses
+ * @param cs Pointer to client session
+ * @param cmd Pointer to struct command
+ * @return 0, -1 if failed
+ */
+int ftp_client_give_command(ClientSession *cs, Command *cmd);
+
+/**
+ * Receive a response code and the tag of the command it answers
+ * @param cs Pointer to client session
+ * @param tag Pointer to save tag, may be NULL
+ * @return host response code, -1 if failed
+ */
+int ftp_client_response(ClientSession *cs, uint32_t *tag);
+
+/**
+ * Send a command that takes no data connection and get its response
+ * @param cs Pointer to client session
+ * @param command String command, e.g. "cd" or "rate"
+ * @param arg String argument, may be NULL
+ * @return response code, -1 if failed
+ */
+int ftp_client_command(ClientSession *cs, const char *command, const char *arg);
+
+/**
+ * Open a data connection: connect to the server's data port in passive
+ * mode, else listen on CLIENT_DATA_PORT and ack server to connect
+ * @param cs Pointer to client session
+ * @return socket for data, -1 if failed
+ */
+int ftp_client_data_conn(ClientSession *cs);
+
+/**
+ * Download a file
+ * @param cs Pointer to client session
+ * @param remote String file on server
+ * @param local String file to write
+ * @param x Pointer to save outcome
+ * @return bytes received, -1 if failed
+ */
+ssize_t ftp_client_get(ClientSession *cs, const char *remote, const char *local, ClientXfer *x);
+
+/**
+ * Download a file once get was sent, as a pipelined one; vrfy does not
+ * check it, since the responses that come next belong to other commands
+ * @param cs Pointer to client session
+ * @param local String file to write
+ * @param res_code First response to get
+ * @param x Pointer to save outcome
+ * @return bytes received, -1 if failed
+ */
+ssize_t ftp_client_get_reply(ClientSession *cs, const char *local, int res_code, ClientXfer *x);
+
+/**
+ * Download a byte range of a file into the same range of a local file
+ * that exists, on a connection of its own
+ * @param cs Pointer to client session
+ * @param remote String file on server
+ * @param local String file to write into
+ * @param offset Offset of the range
+ * @param length Bytes of the range
+ * @param x Pointer to save outcome
+ * @return bytes received, -1 if failed or short
+ */
+ssize_t ftp_client_get_range(ClientSession *cs, const char *remote, const char *local,
+                             off_t offset, size_t length, ClientXfer *x);
+
+/**
+ * Upload a file, announcing its size first
+ * @param cs Pointer to client session
+ * @param local String file to read
+ * @param remote String file on server, must not exist
+ * @param x Pointer to save outcome
+ * @return bytes sent, -1 if failed
+ */
+ssize_t ftp_client_put(ClientSession *cs, const char *local, const char *remote, ClientXfer *x);
+
+/**
+ * Upload a file by sending only what differs from the copy on server,
+ * see mftpdelta.h; a file the server does not have is put whole
+ * @param cs Pointer to client session
+ * @param local String regular file to read
+ * @param remote String file on server
+ * @param x Pointer to save outcome
+ * @return bytes of file sent, -1 if failed
+ */
+ssize_t ftp_client_delta_put(ClientSession *cs, const char *local, const char *remote, ClientXfer *x);
+
+/**
+ * Send a command answered over the data connection (ls, mlsd, nlst,
+ * pwd, stat) and write what comes to a stream
+ * @param cs Pointer to client session
+ * @param command String command
+ * @param arg String argument, may be NULL
+ * @param out Stream to write output to
+ * @return 0, the response code if server refused, -1 if failed
+ */
+int ftp_client_list(ClientSession *cs, const char *command, const char *arg, FILE *out);
+
+/**
+ * Get the manifest of every regular file under a server directory;
+ * server keeps it per directory, so asking again is cheap while the
+ * tree does not change
+ * @param cs Pointer to client session
+ * @param dir String server directory
+ * @param crc Non-zero to have server checksum files too
+ * @param entries Pointer to save entries, free with ftp_client_manifest_free()
+ * @param count Pointer to save number of entries
+ * @return 0, the response code if server refused, -1 if failed
+ */
+int ftp_client_manifest(ClientSession *cs, const char *dir, int crc,
+                        ClientEntry **entries, size_t *count);
+
+/**
+ * Free the entries of a manifest
+ * @param entries Entries
+ * @param count Number of entries
+ */
+void ftp_client_manifest_free(ClientEntry *entries, size_t count);
+
+/**
+ * Get the server directory of a session
+ * @param cs Pointer to client session
+ * @param cwd Buffer to save directory
+ * @param size Buffer size
+ * @return 0, -1 if failed
+ */
+int ftp_client_server_cwd(ClientSession *cs, char *cwd, size_t size);
+
+/**
+ * Enter or leave passive mode
+ * @param cs Pointer to client session
+ * @param on Non-zero to enter
+ * @return response code, -1 if failed
+ */
+int ftp_client_passive(ClientSession *cs, int on);
+
+/**
+ * Switch transfer mode: "b" frames transfers in blocks over one data
+ * connection kept for the session, "z [level]" also deflates files
+ * in those blocks, "s" opens one connection per transfer
+ * @param cs Pointer to client session
+ * @param mode String mode
+ * @return response code, -1 if failed
+ */
+int ftp_client_mode(ClientSession *cs, const char *mode);
+
+/**
+ * Pick the transfer profile of the session on both ends, see mftpprof.h
+ * @param cs Pointer to client session
+ * @param name String profile name
+ * @return response code, CODE_CMD_NOT_IMPL for an unknown profile, -1 if failed
+ */
+int ftp_client_profile(ClientSession *cs, const char *name);
+
+/**
+ * Turn vrfy on or off: get and put then checksum files on the way and
+ * compare with server after each transfer
+ * @param cs Pointer to client session
+ * @param on Non-zero to turn on
+ * @return response code, -1 if failed
+ */
+int ftp_client_verify(ClientSession *cs, int on);
+
+/**
+ * Ask server for the size of a file
+ * @param cs Pointer to client session
+ * @param fname String file name
+ * @param size Pointer to save size
+ * @return response code, -1 if failed
+ */
+int ftp_client_size(ClientSession *cs, const char *fname, off_t *size);
+
+/**
+ * Ask server for the checksum of a file
+ * @param cs Pointer to client session
+ * @param arg String "<crc32c|xxh64> [<offset> <length>] <filename>"
+ * @param digest Pointer to save digest
+ * @return response code, -1 if failed
+ */
+int ftp_client_hash_query(ClientSession *cs, const char *arg, uint64_t *digest);
+
+/**
+ * Queue a transfer to run on the session's thread, started on first use;
+ * until ftp_client_wait() returns, the session belongs to that thread
+ * and only ftp_client_submit() and ftp_client_pending() may be called,
+ * from any thread or from done
+ * @param cs Pointer to client session
+ * @param op CLIENT_GET, CLIENT_PUT or CLIENT_DPUT
+ * @param remote String file on server
+ * @param local String local file
+ * @param done Called when done, may be NULL
+ * @param arg Passed to done in the job
+ * @return 0, -1 if failed
+ */
+int ftp_client_submit(ClientSession *cs, int op, const char *remote, const char *local,
+                      ClientDone done, void *arg);
+
+/**
+ * Number of queued transfers not done yet, to poll instead of waiting
+ * @param cs Pointer to client session
+ * @return number of jobs
+ */
+int ftp_client_pending(ClientSession *cs);
+
+/**
+ * Wait until every queued transfer is done and stop the session's
+ * thread, giving the session back to the caller; not from done
+ * @param cs Pointer to client session
+ */
+void ftp_client_wait(ClientSession *cs);
+
+#endif
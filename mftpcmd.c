@@ -0,0 +1,108 @@
+#include "mftpcmd.h"
+
+/* opcode of a command is its index, 0 is unused */
+static const char *const opcodes[] = {
+    "", "user", "pass", "quit", "get", "put", "rget", "size", "nlst",
+    "ls", "pwd", "mlsd", "cd", "pasv", "port", "mode", "prof", "dput",
+    "hash", "vrfy", "stat", "rate", "allo", "mani",
+};
+#define NUM_OPCODES (sizeof(opcodes) / sizeof(opcodes[0]))
+_Static_assert(NUM_OPCODES <= CMD_MAX_OPCODES, "opcode table outgrew CMD_MAX_OPCODES");
+
+int cmd_opcode(const char *name)
+{
+    for (size_t op = 1; op < NUM_OPCODES; op++)
+    {
+        if (strcmp(name, opcodes[op]) == 0)
+            return op;
+    }
+    return -1;
+}
+
+const char *cmd_name(int op)
+{
+    return op > 0 && (size_t) op < NUM_OPCODES ? opcodes[op] : NULL;
+}
+
+int cmd_encode(const Command *cmd, int framed, char *buf)
+{
+    if (!framed)
+    {
+        memset(buf, 0, MAX_BUF_SIZE);
+        snprintf(buf, MAX_BUF_SIZE - CMD_TAG_SIZE, "%s %s", cmd->command, cmd->arg);
+        uint32_t tag = htonl(cmd->tag);
+        memcpy(buf + MAX_BUF_SIZE - CMD_TAG_SIZE, &tag, CMD_TAG_SIZE);
+        return MAX_BUF_SIZE;
+    }
+
+    int op = cmd_opcode(cmd->command);
+    if (op < 0)
+        return -1;
+
+    uint16_t arglen = strnlen(cmd->arg, CMD_ARG_MAX);
+    uint16_t _arglen = htons(arglen);
+    uint16_t tag = htons(cmd->tag);
+    memcpy(buf, &_arglen, sizeof(_arglen));
+    buf[2] = op;
+    memcpy(buf + 3, &tag, sizeof(tag));
+    memcpy(buf + CMD_FRAME_HEADER, cmd->arg, arglen);
+    return CMD_FRAME_HEADER + arglen;
+}
+
+void cmd_parser_init(CmdParser *p)
+{
+    p->start = 0;
+    p->len = 0;
+    p->framed = 0;
+}
+
+ssize_t cmd_parser_recv(CmdParser *p, int sock)
+{
+    // move the partial command left to the front, at most one message
+    if (p->start > 0)
+    {
+        memmove(p->buf, p->buf + p->start, p->len - p->start);
+        p->len -= p->start;
+        p->start = 0;
+    }
+
+    ssize_t bytes_rcvd = recv(sock, p->buf + p->len, sizeof(p->buf) - p->len, 0);
+    if (bytes_rcvd > 0)
+        p->len += bytes_rcvd;
+    return bytes_rcvd;
+}
+
+int cmd_parser_next(CmdParser *p, Command *cmd)
+{
+    const char *msg = p->buf + p->start;
+    size_t avail = p->len - p->start;
+
+    if (!p->framed)
+    {
+        if (avail < MAX_BUF_SIZE)
+            return 0;
+        strtocmd(msg, cmd);
+        p->start += MAX_BUF_SIZE;
+        return 1;
+    }
+
+    if (avail < CMD_FRAME_HEADER)
+        return 0;
+
+    uint16_t arglen, tag;
+    unsigned char op = msg[2];
+    memcpy(&arglen, msg, sizeof(arglen));
+    memcpy(&tag, msg + 3, sizeof(tag));
+    arglen = ntohs(arglen);
+    if (arglen > CMD_ARG_MAX || op == 0 || op >= NUM_OPCODES)
+        return -1;
+    if (avail < CMD_FRAME_HEADER + (size_t) arglen)
+        return 0;
+
+    memset(cmd, 0, sizeof(Command));
+    strcpy(cmd->command, opcodes[op]);
+    memcpy(cmd->arg, msg + CMD_FRAME_HEADER, arglen);
+    cmd->tag = ntohs(tag);
+    p->start += CMD_FRAME_HEADER + arglen;
+    return 1;
+}
@@ -0,0 +1,77 @@
+#ifndef MFTPCMD_H
+#define MFTPCMD_H
+
+#include "mftputil.h"
+
+/*
+ * Commands travel in one of two formats, chosen per connection:
+ *  - text: the legacy MAX_BUF_SIZE-byte message, "cmd arg" padded with
+ *    zeros and closed by a 32-bit tag, see strtocmd()
+ *  - framed: a 16-bit argument length, an 8-bit opcode, a 16-bit tag,
+ *    then the argument without terminator, all in network byte order
+ * Connections start in text; a client sending CMD_HELLO before logging
+ * in and getting CODE_VALID_CMD back switches both ends to frames.
+ */
+#define CMD_HELLO "bin"        /* text command asking for framed commands */
+#define CMD_FRAME_HEADER 5     /* length, opcode, tag */
+#define CMD_ARG_MAX (MAX_BUF_SIZE - 1)
+#define CMD_MSG_MAX (CMD_FRAME_HEADER + CMD_ARG_MAX) /* largest message in either format */
+#define CMD_PARSER_SIZE 4096   /* commands read ahead per connection */
+#define CMD_MAX_OPCODES 32     /* opcodes are below this */
+
+typedef struct CmdParser
+{
+    char buf[CMD_PARSER_SIZE];
+    size_t start; /* first byte not parsed yet */
+    size_t len;   /* bytes in buf */
+    int framed;   /* frames, else text messages */
+} CmdParser;
+
+/**
+ * Look up the opcode of a command
+ * @param name String command
+ * @return opcode, -1 if it has none
+ */
+int cmd_opcode(const char *name);
+
+/**
+ * Look up the command of an opcode
+ * @param op Opcode
+ * @return String command, NULL if none
+ */
+const char *cmd_name(int op);
+
+/**
+ * Encode a command for the wire
+ * @param cmd Pointer to struct command
+ * @param framed Whether to frame it, else text
+ * @param buf Buffer of CMD_MSG_MAX bytes
+ * @return message length, -1 if the command cannot be framed
+ */
+int cmd_encode(const Command *cmd, int framed, char *buf);
+
+/**
+ * Start parsing a connection, in text format
+ * @param p Pointer to parser
+ */
+void cmd_parser_init(CmdParser *p);
+
+/**
+ * Read whatever the socket has into the parser, several commands
+ * or part of one, without allocating
+ * @param p Pointer to parser
+ * @param sock Socket for commands
+ * @return bytes read, 0 if peer closed, -1 if failed as recv()
+ */
+ssize_t cmd_parser_recv(CmdParser *p, int sock);
+
+/**
+ * Take the next complete command out of the parser
+ * @param p Pointer to parser
+ * @param cmd Pointer to struct command to fill
+ * @return 1 if a command was taken, 0 if more bytes are needed,
+ *         -1 if the stream is malformed
+ */
+int cmd_parser_next(CmdParser *p, Command *cmd);
+
+#endif
@@ -0,0 +1,536 @@
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "mftpdelta.h"
+#include "mftphash.h"
+
+#define CHAR_OFFSET 31 /* added to every byte, so runs of zeros still sum */
+
+/* signature of the old copy as the sender keeps it */
+typedef struct Signature
+{
+    uint32_t block_len;
+    size_t count;     /* full blocks of the old copy */
+    uint32_t *weak;
+    uint64_t *strong;
+    int32_t *next;    /* next block with the same bucket, -1 ends */
+    int32_t *heads;   /* first block of each bucket, -1 if none */
+    int shift;        /* 32 - log2 of bucket count */
+} Signature;
+
+/**
+ * Pick the block length for a file: about the square root of its size,
+ * so the signature and the matching granularity grow together
+ * @param size File size
+ * @return block length
+ */
+static uint32_t delta_block_len(uint64_t size)
+{
+    uint32_t len = DELTA_MIN_BLOCK;
+    while (len < DELTA_MAX_BLOCK && (uint64_t) len * len < size)
+        len *= 2;
+    return len;
+}
+
+/**
+ * Weak checksum of a block, rsync's: a is the sum of the bytes, b the sum
+ * of the running sums, so both roll one byte at a time
+ */
+static void weak_sum(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b)
+{
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        s1 += p[i] + CHAR_OFFSET;
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+}
+
+static inline uint32_t weak_value(uint32_t a, uint32_t b)
+{
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * Receive exactly len bytes
+ * @return 0, -1 if failed
+ */
+static int recv_exact(int datasock, void *buf, size_t len)
+{
+    return recv(datasock, buf, len, MSG_WAITALL) == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * Send the signature of the old copy, see mftpdelta.h
+ * @param size Chunk size, bytes read at a time
+ * @param datasock Socket for data
+ * @param fd Old copy
+ * @param block_len Pointer to save the block length
+ * @param stats Pointer to stats
+ * @return 0, -1 if failed and channel is unusable
+ */
+static int send_signature(int size, int datasock, int fd, uint32_t *block_len, DeltaStats *stats)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    uint32_t len = delta_block_len(st.st_size);
+    uint64_t count = st.st_size / len;
+    unsigned char header[12];
+    uint32_t _len = htonl(len);
+    uint64_t _size = htobe64(st.st_size);
+    memcpy(header, &_len, sizeof(_len));
+    memcpy(header + 4, &_size, sizeof(_size));
+    if (send_block(datasock, 0, (char *) header, sizeof(header)) < 0)
+        return -1;
+    stats->wire_bytes += BLOCK_HEADER_SIZE + sizeof(header);
+    *block_len = len;
+
+    // read several blocks at a time, one entry block per read
+    size_t per_read = size > (int) len ? size / len : 1;
+    unsigned char *data = (unsigned char *) malloc(per_read * len);
+    unsigned char *entries = (unsigned char *) malloc(per_read * DELTA_SIG_ENTRY);
+    int ret = data && entries ? 0 : -1;
+    if (ret < 0)
+        perror("fail to allocate transfer buffer");
+
+    for (uint64_t i = 0; ret == 0 && i < count; i += per_read)
+    {
+        size_t n = count - i < per_read ? count - i : per_read;
+        if (pread(fd, data, n * len, i * len) != (ssize_t) (n * len))
+        {
+            // the header promised count blocks
+            perror("fail to read file");
+            ret = -1;
+            break;
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            uint32_t a, b;
+            weak_sum(data + j * len, len, &a, &b);
+            uint32_t weak = htonl(weak_value(a, b));
+            uint64_t strong = htobe64(xxh64(data + j * len, len));
+            memcpy(entries + j * DELTA_SIG_ENTRY, &weak, sizeof(weak));
+            memcpy(entries + j * DELTA_SIG_ENTRY + 4, &strong, sizeof(strong));
+        }
+        if (send_block(datasock, 0, (char *) entries, n * DELTA_SIG_ENTRY) < 0)
+            ret = -1;
+        stats->wire_bytes += BLOCK_HEADER_SIZE + n * DELTA_SIG_ENTRY;
+    }
+    if (ret == 0 && send_block(datasock, BLOCK_EOF, NULL, 0) < 0)
+        ret = -1;
+    stats->wire_bytes += BLOCK_HEADER_SIZE;
+
+    free(data);
+    free(entries);
+    return ret;
+}
+
+static void free_signature(Signature *sig)
+{
+    free(sig->weak);
+    free(sig->strong);
+    free(sig->next);
+    free(sig->heads);
+}
+
+static inline uint32_t bucket_of(const Signature *sig, uint32_t weak)
+{
+    return (weak * 2654435761u) >> sig->shift;
+}
+
+/**
+ * Receive a signature and index it by weak checksum
+ * @return 0, -1 if failed and channel is unusable
+ */
+static int recv_signature(int datasock, Signature *sig, DeltaStats *stats)
+{
+    memset(sig, 0, sizeof(Signature));
+    unsigned char header[12];
+    int desc;
+    if (recv_block_header(datasock, &desc) != sizeof(header)
+        || recv_exact(datasock, header, sizeof(header)) < 0)
+        return -1;
+    stats->wire_bytes += BLOCK_HEADER_SIZE + sizeof(header);
+
+    uint32_t len;
+    uint64_t size;
+    memcpy(&len, header, sizeof(len));
+    memcpy(&size, header + 4, sizeof(size));
+    sig->block_len = ntohl(len);
+    size = be64toh(size);
+    if (sig->block_len < DELTA_MIN_BLOCK || sig->block_len > DELTA_MAX_BLOCK)
+        return -1;
+    sig->count = size / sig->block_len;
+
+    int bits = 4;
+    while (bits < 31 && ((size_t) 1 << bits) < sig->count * 2)
+        bits++;
+    sig->shift = 32 - bits;
+    sig->weak = (uint32_t *) malloc(sig->count * sizeof(uint32_t) + 1);
+    sig->strong = (uint64_t *) malloc(sig->count * sizeof(uint64_t) + 1);
+    sig->next = (int32_t *) malloc(sig->count * sizeof(int32_t) + 1);
+    sig->heads = (int32_t *) malloc(((size_t) 1 << bits) * sizeof(int32_t));
+    if (!sig->weak || !sig->strong || !sig->next || !sig->heads)
+    {
+        perror("fail to allocate signature");
+        return -1;
+    }
+    memset(sig->heads, 0xff, ((size_t) 1 << bits) * sizeof(int32_t));
+
+    unsigned char entry[DELTA_SIG_ENTRY];
+    size_t got = 0;
+    ssize_t bytes;
+    desc = 0;
+    while (!(desc & BLOCK_EOF))
+    {
+        if ((bytes = recv_block_header(datasock, &desc)) < 0 || bytes % DELTA_SIG_ENTRY != 0
+            || got + bytes / DELTA_SIG_ENTRY > sig->count)
+            return -1;
+        stats->wire_bytes += BLOCK_HEADER_SIZE + bytes;
+        for (; bytes > 0; bytes -= DELTA_SIG_ENTRY, got++)
+        {
+            if (recv_exact(datasock, entry, sizeof(entry)) < 0)
+                return -1;
+            memcpy(&sig->weak[got], entry, sizeof(uint32_t));
+            memcpy(&sig->strong[got], entry + 4, sizeof(uint64_t));
+            sig->weak[got] = ntohl(sig->weak[got]);
+            sig->strong[got] = be64toh(sig->strong[got]);
+        }
+    }
+    if (got != sig->count)
+        return -1;
+
+    // chain backwards, so each bucket lists its blocks in file order
+    for (size_t i = sig->count; i-- > 0;)
+    {
+        uint32_t bucket = bucket_of(sig, sig->weak[i]);
+        sig->next[i] = sig->heads[bucket];
+        sig->heads[bucket] = i;
+    }
+    return 0;
+}
+
+/**
+ * Find an old block equal to the one at p
+ * @param sig Pointer to signature
+ * @param weak Weak checksum of the block at p
+ * @param p Block of the new file
+ * @param expect Block following the last match, tried first
+ * @return index of the old block, -1 if none
+ */
+static int32_t find_block(const Signature *sig, uint32_t weak, const unsigned char *p, int32_t expect)
+{
+    uint64_t strong = 0;
+    int have_strong = 0;
+    if (expect >= 0 && (size_t) expect < sig->count && sig->weak[expect] == weak)
+    {
+        strong = xxh64(p, sig->block_len);
+        have_strong = 1;
+        if (sig->strong[expect] == strong)
+            return expect;
+    }
+
+    for (int32_t i = sig->heads[bucket_of(sig, weak)]; i >= 0; i = sig->next[i])
+    {
+        if (sig->weak[i] != weak)
+            continue;
+        if (!have_strong)
+        {
+            strong = xxh64(p, sig->block_len);
+            have_strong = 1;
+        }
+        if (sig->strong[i] == strong)
+            return i;
+    }
+    return -1;
+}
+
+/* blocks decided but not sent yet; a run of old blocks is sent when it ends */
+typedef struct DeltaOut
+{
+    int datasock;
+    const unsigned char *map;
+    size_t lit;          /* literal data starts here */
+    uint32_t copy_first;
+    uint32_t copy_count; /* old blocks in the run, 0 if none */
+    uint32_t block_len;
+    DeltaStats *stats;
+} DeltaOut;
+
+static int flush_copy(DeltaOut *out)
+{
+    if (out->copy_count == 0)
+        return 0;
+    uint32_t payload[2] = { htonl(out->copy_first), htonl(out->copy_count) };
+    out->stats->matched_bytes += (size_t) out->copy_count * out->block_len;
+    out->stats->wire_bytes += BLOCK_HEADER_SIZE + sizeof(payload);
+    out->copy_count = 0;
+    return send_block(out->datasock, BLOCK_DELTA_COPY, (char *) payload, sizeof(payload));
+}
+
+/**
+ * Send the new file from the start of the literal data up to pos
+ * @return 0, -1 if failed
+ */
+static int flush_literal(DeltaOut *out, size_t pos)
+{
+    if (out->lit == pos)
+        return 0;
+    if (flush_copy(out) < 0)
+        return -1;
+    while (out->lit < pos)
+    {
+        size_t chunk = pos - out->lit < BLOCK_PAYLOAD_MAX ? pos - out->lit : BLOCK_PAYLOAD_MAX;
+        if (send_block(out->datasock, 0, (const char *) out->map + out->lit, chunk) < 0)
+            return -1;
+        out->stats->literal_bytes += chunk;
+        out->stats->wire_bytes += BLOCK_HEADER_SIZE + chunk;
+        out->lit += chunk;
+    }
+    return 0;
+}
+
+/**
+ * Slide over the new file a byte at a time, sending old blocks
+ * where they match and literal data in between
+ * @return 0, -1 if failed
+ */
+static int send_delta(DeltaOut *out, const Signature *sig, size_t n)
+{
+    const unsigned char *map = out->map;
+    uint32_t len = sig->block_len;
+    uint32_t a = 0, b = 0;
+    int32_t expect = -1;
+    size_t pos = 0;
+    if (sig->count > 0 && n >= len)
+        weak_sum(map, len, &a, &b);
+
+    while (sig->count > 0 && pos + len <= n)
+    {
+        int32_t match = find_block(sig, weak_value(a, b), map + pos, expect);
+        if (match < 0)
+        {
+            // roll the window one byte on
+            if (pos + len < n)
+            {
+                uint32_t old = map[pos] + CHAR_OFFSET;
+                a += map[pos + len] - map[pos];
+                b += a - len * old;
+            }
+            pos++;
+            continue;
+        }
+
+        if (flush_literal(out, pos) < 0)
+            return -1;
+        if (out->copy_count > 0 && (uint32_t) match != out->copy_first + out->copy_count
+            && flush_copy(out) < 0)
+            return -1;
+        if (out->copy_count == 0)
+            out->copy_first = match;
+        out->copy_count++;
+
+        expect = match + 1;
+        pos += len;
+        out->lit = pos;
+        if (pos + len <= n)
+            weak_sum(map + pos, len, &a, &b);
+    }
+    if (flush_literal(out, n) < 0 || flush_copy(out) < 0)
+        return -1;
+    return 0;
+}
+
+ssize_t delta_send_file(int datasock, FILE *fp, DeltaStats *stats)
+{
+    DeltaStats _stats;
+    if (stats == NULL)
+        stats = &_stats;
+    memset(stats, 0, sizeof(DeltaStats));
+
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "fail to send delta: not a regular file\n");
+        return -1;
+    }
+
+    Signature sig;
+    if (recv_signature(datasock, &sig, stats) < 0)
+    {
+        fprintf(stderr, "fail to receive signature\n");
+        free_signature(&sig);
+        return -1;
+    }
+
+    size_t n = st.st_size;
+    unsigned char *map = NULL;
+    if (n > 0 && (map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        perror("fail to map file");
+        free_signature(&sig);
+        return -1;
+    }
+    if (map)
+        madvise(map, n, MADV_SEQUENTIAL);
+
+    DeltaOut out = { datasock, map, 0, 0, 0, sig.block_len, stats };
+    ssize_t total = -1;
+    if (send_delta(&out, &sig, n) == 0)
+    {
+        // size and checksum of the whole file catch what block sums miss
+        uLong crc = crc32(0, NULL, 0);
+        for (size_t off = 0; off < n; off += BLOCK_PAYLOAD_MAX)
+            crc = crc32(crc, map + off, n - off < BLOCK_PAYLOAD_MAX ? n - off : BLOCK_PAYLOAD_MAX);
+
+        unsigned char trailer[12];
+        uint64_t _n = htobe64(n);
+        uint32_t _crc = htonl(crc);
+        memcpy(trailer, &_n, sizeof(_n));
+        memcpy(trailer + 8, &_crc, sizeof(_crc));
+        if (send_block(datasock, BLOCK_EOF, (char *) trailer, sizeof(trailer)) == 0)
+        {
+            stats->wire_bytes += BLOCK_HEADER_SIZE + sizeof(trailer);
+            stats->file_bytes = n;
+            total = n;
+        }
+    }
+
+    if (map)
+        munmap(map, n);
+    free_signature(&sig);
+    return total;
+}
+
+/**
+ * Copy blocks of the old copy into the new file
+ * @return 0, -1 if failed
+ */
+static int copy_blocks(int basis, int fd, unsigned char *buf, int size,
+                       off_t offset, size_t count, uLong *crc)
+{
+    while (count > 0)
+    {
+        size_t chunk = count < (size_t) size ? count : (size_t) size;
+        if (pread(basis, buf, chunk, offset) != (ssize_t) chunk || write_all(fd, (char *) buf, chunk) < 0)
+            return -1;
+        *crc = crc32(*crc, buf, chunk);
+        offset += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild the new file, see delta_recv_file()
+ * @return bytes written, -1 if failed and channel is unusable,
+ *         -2 if the result is wrong
+ */
+static ssize_t apply_delta(unsigned char *buf, int size, int datasock, int basis, int fd,
+                           uint32_t block_len, DeltaStats *stats)
+{
+    struct stat st;
+    if (fstat(basis, &st) < 0)
+        return -1;
+    uint64_t nblocks = st.st_size / block_len;
+
+    // a bad block or a full disk still drains the stream, to stay in step
+    uLong crc = crc32(0, NULL, 0);
+    int desc = 0, broken = 0;
+    ssize_t len;
+    while (1)
+    {
+        if ((len = recv_block_header(datasock, &desc)) < 0)
+        {
+            perror("fail to receive block");
+            return -1;
+        }
+        stats->wire_bytes += BLOCK_HEADER_SIZE + len;
+        if (desc & BLOCK_EOF)
+            break;
+
+        if (desc & BLOCK_DELTA_COPY)
+        {
+            uint32_t payload[2];
+            if (len != sizeof(payload) || recv_exact(datasock, payload, sizeof(payload)) < 0)
+                return -1;
+            uint64_t first = ntohl(payload[0]), count = ntohl(payload[1]);
+            if (first + count > nblocks)
+                broken = 1;
+            else if (!broken && copy_blocks(basis, fd, buf, size, first * block_len,
+                                            count * block_len, &crc) < 0)
+            {
+                perror("fail to copy block");
+                broken = 1;
+            }
+            stats->file_bytes += count * block_len;
+            stats->matched_bytes += count * block_len;
+            continue;
+        }
+
+        while (len > 0)
+        {
+            size_t chunk = len < size ? (size_t) len : (size_t) size;
+            if (recv_exact(datasock, buf, chunk) < 0)
+            {
+                perror("fail to receive block");
+                return -1;
+            }
+            if (!broken && write_all(fd, (char *) buf, chunk) < 0)
+            {
+                perror("fail to save file");
+                broken = 1;
+            }
+            crc = crc32(crc, buf, chunk);
+            stats->file_bytes += chunk;
+            stats->literal_bytes += chunk;
+            len -= chunk;
+        }
+    }
+
+    unsigned char trailer[12];
+    uint64_t n;
+    uint32_t _crc;
+    if (len != sizeof(trailer) || recv_exact(datasock, trailer, sizeof(trailer)) < 0)
+        return -1;
+    memcpy(&n, trailer, sizeof(n));
+    memcpy(&_crc, trailer + 8, sizeof(_crc));
+    if (broken || be64toh(n) != stats->file_bytes || ntohl(_crc) != crc)
+    {
+        fprintf(stderr, "fail to rebuild file: %s\n",
+                broken ? "bad block or write error" : "checksum mismatch");
+        return -2;
+    }
+    return stats->file_bytes;
+}
+
+ssize_t delta_recv_file(int size, int datasock, int basis, int fd, DeltaStats *stats)
+{
+    DeltaStats _stats;
+    if (stats == NULL)
+        stats = &_stats;
+    memset(stats, 0, sizeof(DeltaStats));
+
+    uint32_t block_len;
+    if (send_signature(size, datasock, basis, &block_len, stats) < 0)
+    {
+        fprintf(stderr, "fail to send signature\n");
+        return -1;
+    }
+
+    unsigned char *buf = (unsigned char *) malloc(size);
+    if (buf == NULL)
+    {
+        // the sender is already on its way
+        perror("fail to allocate transfer buffer");
+        return -1;
+    }
+    ssize_t total = apply_delta(buf, size, datasock, basis, fd, block_len, stats);
+    free(buf);
+    return total;
+}
@@ -0,0 +1,51 @@
+#ifndef MFTPDELTA_H
+#define MFTPDELTA_H
+
+#include "mftputil.h"
+
+/*
+ * Delta put, rsync style, over one data connection in blocks:
+ *  - the receiver, holding an old copy, sends a signature: a header
+ *    block (32-bit block length, 64-bit size of the old copy), blocks
+ *    of the weak and strong checksums of every full block of the old
+ *    copy, DELTA_SIG_ENTRY bytes each, then an empty BLOCK_EOF block
+ *  - the sender answers with the new file as plain blocks of literal
+ *    data and BLOCK_DELTA_COPY blocks naming runs of old blocks
+ *    (32-bit first index, 32-bit count), ending with a BLOCK_EOF block
+ *    holding the 64-bit size and the CRC-32 of the new file
+ */
+#define DELTA_MIN_BLOCK 2048         /* block length of small files */
+#define DELTA_MAX_BLOCK (128 * 1024) /* block length of huge files */
+#define DELTA_SIG_ENTRY 12           /* 32-bit rolling sum, 64-bit hash */
+
+typedef struct DeltaStats
+{
+    size_t file_bytes;    /* bytes of the new file */
+    size_t matched_bytes; /* bytes taken from the old copy */
+    size_t literal_bytes; /* bytes sent as they are */
+    size_t wire_bytes;    /* bytes on the data connection, both ways */
+} DeltaStats;
+
+/**
+ * Receive a signature and send a regular file against it
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param stats Pointer to save what was sent, may be NULL
+ * @return bytes of file sent, -1 if failed and channel is unusable
+ */
+ssize_t delta_send_file(int datasock, FILE *fp, DeltaStats *stats);
+
+/**
+ * Send the signature of the old copy, then rebuild the new file from it
+ * and the blocks of delta_send_file(), checking size and CRC-32
+ * @param size Chunk size, bytes received and copied at a time
+ * @param datasock Socket for data
+ * @param basis Old copy, regular file
+ * @param fd File to write the new one to
+ * @param stats Pointer to save what was received, may be NULL
+ * @return bytes written, -1 if failed and channel is unusable,
+ *         -2 if the stream was whole but the result is wrong
+ */
+ssize_t delta_recv_file(int size, int datasock, int basis, int fd, DeltaStats *stats);
+
+#endif
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+
+#include "mftpevent.h"
+
+typedef struct EventLoop
+{
+    int epfd;
+    int lstnsock;
+    WorkPool *pool;
+    pthread_t tid;
+    uint64_t resume_us; /* when to watch the listener again, 0 if watched */
+    int starved;        /* out of descriptors since the last accepted connection */
+} EventLoop;
+
+typedef struct Transfer
+{
+    EventLoop *loop;
+    Session *sess;
+    Command cmd;
+} Transfer;
+
+static void event_read(EventLoop *loop, Session *sess);
+
+/**
+ * Closes and frees a session
+ * @param loop Event loop owning the session
+ * @param sess Pointer to session
+ */
+static void event_close(EventLoop *loop, Session *sess)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->ctrlsock, NULL);
+    ftp_server_session_end(sess);
+    free(sess);
+    if (verbose)
+        printf("Client disconnected\n");
+}
+
+/**
+ * Re-arms a one-shot session so that its next command is polled
+ * @param loop Event loop owning the session
+ * @param sess Pointer to session
+ */
+static void event_rearm(EventLoop *loop, Session *sess)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = sess;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, sess->ctrlsock, &ev) < 0)
+    {
+        perror("fail to re-arm session");
+        event_close(loop, sess);
+    }
+}
+
+/**
+ * Accepts all pending connections and greets them
+ * @param loop Event loop to register sessions to
+ */
+static void event_accept(EventLoop *loop)
+{
+    int ctrlsock;
+    while ((ctrlsock = accept4(loop->lstnsock, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        loop->starved = 0;
+        Session *sess = (Session *) malloc(sizeof(Session));
+        if (sess == NULL)
+        {
+            close(ctrlsock);
+            continue;
+        }
+        ftp_server_session_init(sess, ctrlsock);
+        xfer_ctrl_socket(ctrlsock);
+
+        // inform client that service is ready
+        if (ftp_server_response(ctrlsock, CODE_SERVICE_READY) < 0)
+        {
+            ftp_server_session_end(sess);
+            free(sess);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = sess;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ctrlsock, &ev) < 0)
+        {
+            perror("fail to register session");
+            ftp_server_session_end(sess);
+            free(sess);
+        }
+    }
+
+    // the listener of a draining worker is shut down, stop watching it
+    if (errno == EINVAL)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->lstnsock, NULL);
+    else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+    {
+        // the listener stays readable, so stop watching it for a while
+        // rather than spin; sessions ending meanwhile free descriptors
+        if (!loop->starved)
+            perror("fail to accept connection");
+        loop->starved = 1;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->lstnsock, NULL);
+        loop->resume_us = metrics_now_us() + EVENT_ACCEPT_BACKOFF_MS * 1000;
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("fail to accept connection");
+}
+
+/**
+ * Watches the listener again once its pause is over
+ * @param loop Event loop
+ * @return ms to wait for events until then, -1 if not paused
+ */
+static int event_resume(EventLoop *loop)
+{
+    if (loop->resume_us == 0)
+        return -1;
+
+    uint64_t now = metrics_now_us();
+    if (now < loop->resume_us)
+        return (int) ((loop->resume_us - now + 999) / 1000);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->lstnsock, &ev) < 0)
+        perror("fail to watch listening socket");
+    loop->resume_us = 0;
+    return -1;
+}
+
+/**
+ * Runs a data transfer command with blocking sockets,
+ * then hands the session back to its event loop
+ * @param _xfer Pointer to struct transfer
+ */
+static void event_transfer(void *_xfer)
+{
+    Transfer *xfer = (Transfer *) _xfer;
+    Session *sess = xfer->sess;
+    Command *cmd = &xfer->cmd;
+
+    EventLoop *loop = xfer->loop;
+
+    set_nonblocking(sess->ctrlsock, 0);
+    ftp_server_command(sess, cmd);
+    set_nonblocking(sess->ctrlsock, 1);
+    free(xfer);
+
+    // commands queued behind the transfer are already read,
+    // epoll would not report them again
+    sess->state = SESS_CMD;
+    event_read(loop, sess);
+}
+
+/**
+ * Acts on one complete command
+ * @param loop Event loop owning the session
+ * @param sess Pointer to session
+ * @param cmd Pointer to struct command
+ * @return 0 to keep reading, 1 if handed off to a transfer, -1 to close
+ */
+static int event_dispatch(EventLoop *loop, Session *sess, Command *cmd)
+{
+    if (sess->state != SESS_CMD)
+        return ftp_server_login(sess, cmd);
+
+    // commands without data connection are quick enough for the loop
+    if (!ftp_server_is_transfer(cmd))
+        return ftp_server_command(sess, cmd);
+
+    // data transfers block, so they must not run on the loop
+    Transfer *xfer = (Transfer *) malloc(sizeof(Transfer));
+    if (xfer == NULL)
+        return -1;
+    xfer->loop = loop;
+    xfer->sess = sess;
+    xfer->cmd = *cmd;
+    sess->state = SESS_XFER;
+    __atomic_store_n(&sess->busy, 1, __ATOMIC_RELEASE);
+
+    if (ftp_pool_submit(loop->pool, event_transfer, xfer) < 0)
+    {
+        // all workers busy: refuse this transfer, keep the session
+        free(xfer);
+        __atomic_store_n(&sess->busy, 0, __ATOMIC_RELEASE);
+        sess->state = SESS_CMD;
+        sess->tag = cmd->tag;
+        return ftp_server_reply(sess, CODE_SERVICE_NOT_AVAIL);
+    }
+    return 1;
+}
+
+/**
+ * Reads as much as available from a session and
+ * dispatches every complete command
+ * @param loop Event loop owning the session
+ * @param sess Pointer to session
+ */
+static void event_read(EventLoop *loop, Session *sess)
+{
+    ssize_t bytes_rcvd;
+    Command cmd;
+    while (1)
+    {
+        int rc = cmd_parser_next(&sess->parser, &cmd);
+        if (rc > 0)
+        {
+            if ((rc = event_dispatch(loop, sess, &cmd)) == 0)
+                continue;
+            if (rc > 0)
+                return; // transfer thread carries on with the session
+        }
+        if (rc < 0)
+        {
+            event_close(loop, sess);
+            return;
+        }
+
+        // every complete command is done, read more
+        bytes_rcvd = cmd_parser_recv(&sess->parser, sess->ctrlsock);
+        if (bytes_rcvd > 0)
+            continue;
+
+        if (bytes_rcvd < 0 && errno == EINTR)
+            continue;
+
+        if (bytes_rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            event_rearm(loop, sess);
+            return;
+        }
+
+        if (bytes_rcvd < 0)
+            perror("fail to receive command");
+        event_close(loop, sess);
+        return;
+    }
+}
+
+/**
+ * Runs one event loop
+ * @param _loop Pointer to struct event loop
+ */
+static void *event_loop_run(void *_loop)
+{
+    EventLoop *loop = (EventLoop *) _loop;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        int nready = epoll_wait(loop->epfd, events, MAX_EVENTS, event_resume(loop));
+        if (nready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("fail to wait for events");
+            break;
+        }
+
+        for (int i = 0; i < nready; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                event_accept(loop);
+            else
+                event_read(loop, (Session *) events[i].data.ptr);
+        }
+    }
+
+    return NULL;
+}
+
+int ftp_event_serve(int lstnsock, int nloops, WorkPool *pool)
+{
+    if (set_nonblocking(lstnsock, 1) < 0)
+    {
+        perror("fail to set listening socket non-blocking");
+        return -1;
+    }
+
+    EventLoop *loops = (EventLoop *) calloc(nloops, sizeof(EventLoop));
+    if (loops == NULL)
+        return -1;
+
+    int started = 0;
+    for (int i = 0; i < nloops; i++)
+    {
+        loops[i].lstnsock = lstnsock;
+        loops[i].pool = pool;
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+        {
+            perror("fail to create epoll instance");
+            break;
+        }
+
+        // every loop accepts, but only one is woken per connection
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, lstnsock, &ev) < 0)
+        {
+            perror("fail to watch listening socket");
+            close(loops[i].epfd);
+            break;
+        }
+
+        if (pthread_create(&loops[i].tid, NULL, event_loop_run, &loops[i]) != 0)
+        {
+            perror("fail to start event loop");
+            close(loops[i].epfd);
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(loops[i].tid, NULL);
+        close(loops[i].epfd);
+    }
+
+    free(loops);
+    return started > 0 ? 0 : -1;
+}
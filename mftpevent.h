@@ -0,0 +1,20 @@
+#ifndef MFTPEVENT_H
+#define MFTPEVENT_H
+
+#include "server.h"
+#include "mftppool.h"
+
+#define MAX_EVENTS 64
+#define EVENT_ACCEPT_BACKOFF_MS 100 /* listener left unwatched after running out of descriptors */
+
+/**
+ * Serves clients with epoll event loops, each control
+ * connection being a non-blocking state machine
+ * @param lstnsock Listening socket
+ * @param nloops Number of event loop threads
+ * @param pool Worker pool running blocking data transfers
+ * @return -1 if event loops cannot be started
+ */
+int ftp_event_serve(int lstnsock, int nloops, WorkPool *pool);
+
+#endif
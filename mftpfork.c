@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "mftpfork.h"
+#include "mftpmetric.h"
+
+/* supervisor: state of each worker slot */
+static pid_t workers[FORK_MAX_WORKERS];     /* running worker, 0 if none */
+static time_t started[FORK_MAX_WORKERS];
+static time_t restart_at[FORK_MAX_WORKERS]; /* when to start a worker if none runs */
+static pid_t replaced[FORK_MAX_WORKERS];    /* worker to drain once its successor runs, 0 if none */
+
+/* supervisor: workers replaced or stopped that have not exited yet */
+static pid_t *leaving;
+static int nleaving;
+
+/* CPUs the server may run on, for pinning */
+static int cpus[CPU_SETSIZE];
+static int ncpus;
+
+/* worker: what the draining thread watches */
+static int drain_sock = -1;
+static WorkPool *drain_pool;
+static void (*drain_close_idle)(void);
+static int draining;
+
+/**
+ * List the CPUs the server may run on
+ */
+static void find_cpus(void)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+    {
+        perror("fail to get CPU affinity");
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+            cpus[ncpus++] = cpu;
+    }
+}
+
+/**
+ * Remember a worker until it exits
+ * @param pid Process id
+ */
+static void add_leaving(pid_t pid)
+{
+    pid_t *grown = (pid_t *) realloc(leaving, (nleaving + 1) * sizeof(pid_t));
+    if (grown == NULL)
+    {
+        // untracked, it is still drained but stopping does not wait for it
+        perror("fail to track worker");
+        return;
+    }
+    leaving = grown;
+    leaving[nleaving++] = pid;
+}
+
+/**
+ * Forget a worker that was replaced or stopped and has exited
+ * @param pid Process id
+ * @param nprocs Number of slots
+ */
+static void remove_leaving(pid_t pid, int nprocs)
+{
+    for (int i = 0; i < nleaving; i++)
+    {
+        if (leaving[i] == pid)
+        {
+            leaving[i] = leaving[--nleaving];
+            break;
+        }
+    }
+    for (int i = 0; i < nprocs; i++)
+    {
+        if (replaced[i] == pid)
+            replaced[i] = 0;
+    }
+}
+
+/**
+ * Signal every worker, running or leaving
+ * @param sig Signal
+ * @param nprocs Number of slots
+ */
+static void signal_all(int sig, int nprocs)
+{
+    for (int i = 0; i < nprocs; i++)
+    {
+        if (workers[i] != 0)
+            kill(workers[i], sig);
+    }
+    for (int i = 0; i < nleaving; i++)
+        kill(leaving[i], sig);
+}
+
+/**
+ * Reap exited workers and schedule restarts of those that were not replaced
+ * @param nprocs Number of slots
+ * @param stopping Non-zero if the server is stopping
+ */
+static void reap(int nprocs, int stopping)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        int i = 0;
+        while (i < nprocs && workers[i] != pid)
+            i++;
+        if (i == nprocs)
+        {
+            remove_leaving(pid, nprocs);
+            continue;
+        }
+
+        workers[i] = 0;
+        if (stopping)
+            continue;
+
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "worker %d (pid %d) killed by signal %d, restarting\n", i, pid, WTERMSIG(status));
+        else
+            fprintf(stderr, "worker %d (pid %d) exited with status %d, restarting\n", i, pid, WEXITSTATUS(status));
+
+        // a worker dying as it starts is not restarted in a tight loop
+        time_t now = time(NULL);
+        restart_at[i] = now - started[i] < FORK_RESTART_DELAY ? now + FORK_RESTART_DELAY : now;
+    }
+}
+
+/**
+ * Start the worker of a slot on a listener of its own
+ * @param i Slot
+ * @param port Port
+ * @param backlog Maximum length of pending connections
+ * @param pin Pin the worker to a CPU
+ * @param mask Signal mask the worker starts with
+ * @param lstnsock Pointer to the listening socket, set in the worker
+ * @return pid of worker, 0 in the worker, -1 if failed
+ */
+static pid_t spawn(int i, int port, int backlog, int pin, const sigset_t *mask, int *lstnsock)
+{
+    // the supervisor opens the listener, so it takes connections
+    // before the worker it replaces stops taking them
+    int sock = reuseport_socket(port, backlog);
+    if (sock < 0)
+        return -1;
+
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fail to fork worker");
+        close(sock);
+        return -1;
+    }
+    if (pid > 0)
+    {
+        close(sock);
+        workers[i] = pid;
+        started[i] = time(NULL);
+        return pid;
+    }
+
+    // the terminal stops the supervisor, which drains the workers;
+    // a supervisor killed outright drains them too
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 || getppid() != supervisor)
+        exit(0);
+
+    if (pin && ncpus > 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % ncpus], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("fail to pin worker");
+    }
+
+    free(leaving);
+    *lstnsock = sock;
+    return 0;
+}
+
+int fork_workers(int nprocs, int port, int backlog, int pin, int *slot)
+{
+    if (pin)
+        find_cpus();
+
+    sigset_t set, oldset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &set, &oldset);
+
+    int stopping = 0, lstnsock;
+    time_t now = time(NULL);
+    for (int i = 0; i < nprocs; i++)
+        restart_at[i] = now;
+
+    while (1)
+    {
+        now = time(NULL);
+        for (int i = 0; i < nprocs && !stopping; i++)
+        {
+            if (workers[i] != 0 || restart_at[i] > now)
+                continue;
+
+            pid_t pid = spawn(i, port, backlog, pin, &oldset, &lstnsock);
+            if (pid == 0)
+            {
+                *slot = i;
+                return lstnsock;
+            }
+            if (pid < 0)
+            {
+                // the first workers must start, later ones are retried
+                if (i == 0 && started[0] == 0)
+                    error_exit("fail to start workers");
+                restart_at[i] = now + FORK_RESTART_DELAY;
+                continue;
+            }
+            if (replaced[i] != 0)
+            {
+                kill(replaced[i], SIGTERM);
+                replaced[i] = 0;
+            }
+        }
+
+        int alive = nleaving;
+        for (int i = 0; i < nprocs; i++)
+            alive += workers[i] != 0;
+        if (stopping && alive == 0)
+            break;
+
+        struct timespec timeout = { FORK_RESTART_DELAY, 0 };
+        int sig = sigtimedwait(&set, NULL, &timeout);
+        if (sig == SIGCHLD)
+            reap(nprocs, stopping);
+        else if (sig == SIGHUP && !stopping)
+        {
+            // new workers start on the next pass, each old one
+            // drains once its successor listens
+            for (int i = 0; i < nprocs; i++)
+            {
+                if (workers[i] == 0)
+                    continue;
+                if (replaced[i] != 0)
+                    kill(replaced[i], SIGTERM);
+                add_leaving(workers[i]);
+                replaced[i] = workers[i];
+                workers[i] = 0;
+                restart_at[i] = now;
+            }
+        }
+        else if (sig == SIGINT || sig == SIGTERM)
+        {
+            // a second stop does not wait for transfers
+            signal_all(stopping ? SIGKILL : SIGTERM, nprocs);
+            stopping = 1;
+        }
+        else if (sig == SIGUSR1)
+        {
+            for (int i = 0; i < nprocs; i++)
+            {
+                if (workers[i] != 0)
+                    kill(workers[i], SIGUSR1);
+            }
+        }
+    }
+
+    exit(0);
+}
+
+/**
+ * Whether a draining worker has no session left, nor any queued for the pool
+ * @return non-zero if so
+ */
+static int drained(void)
+{
+    static Metrics m;
+    metrics_snapshot(&m);
+    if (m.sessions_opened != m.sessions_closed)
+        return 0;
+
+    PoolStats stats;
+    if (drain_pool == NULL)
+        return 1;
+    ftp_pool_stats(drain_pool, &stats);
+    return stats.submitted == stats.completed;
+}
+
+/**
+ * Waits for SIGTERM, stops the listener, closes idle sessions, then exits
+ * once the commands in flight are done
+ * @param _arg Unused
+ */
+static void *drain_on_signal(void *_arg)
+{
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    while (sigwait(&set, &sig) != 0)
+        ;
+
+    // accept() and epoll see an error from now on; connections still
+    // queued move to the other listeners if net.ipv4.tcp_migrate_req is set
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    shutdown(drain_sock, SHUT_RD);
+
+    // idle sessions go at once, the others as their commands end; a
+    // connection just accepted gets a poll to become a session
+    do
+    {
+        drain_close_idle();
+        struct timespec ts = { 0, FORK_DRAIN_POLL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+    } while (!drained());
+
+    exit(0);
+}
+
+void fork_drain_on_signal(int lstnsock, WorkPool *pool, void (*close_idle)(void))
+{
+    drain_sock = lstnsock;
+    drain_pool = pool;
+    drain_close_idle = close_idle;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, drain_on_signal, NULL) != 0)
+        perror("fail to start draining thread");
+    else
+        pthread_detach(tid);
+}
+
+int fork_draining(void)
+{
+    return __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+}
+
+void fork_drain_wait(void)
+{
+    while (__atomic_load_n(&draining, __ATOMIC_ACQUIRE))
+        pause();
+}
@@ -0,0 +1,50 @@
+#ifndef MFTPFORK_H
+#define MFTPFORK_H
+
+#include "mftputil.h"
+#include "mftppool.h"
+
+#define FORK_MAX_WORKERS 256
+#define FORK_RESTART_DELAY 1   /* s before restarting a worker that died within its first second */
+#define FORK_DRAIN_POLL_MS 100 /* how often a draining worker looks for sessions left */
+
+/**
+ * Split the server into worker processes, each listening on port with
+ * its own SO_REUSEPORT socket so that the kernel spreads connections
+ * over them. The calling process stays behind as supervisor and never
+ * returns: it restarts workers that die, on SIGHUP starts new workers
+ * and drains the old ones, on SIGTERM or SIGINT drains them all and
+ * exits, and passes SIGUSR1 on. Call it before starting any thread.
+ * @param nprocs Number of worker processes
+ * @param port Port
+ * @param backlog Maximum length of pending connections of each worker
+ * @param pin Pin worker i to the i-th CPU the server may run on
+ * @param slot Pointer to the number of the worker, 0 to nprocs-1
+ * @return listening socket, in the worker
+ */
+int fork_workers(int nprocs, int port, int backlog, int pin, int *slot);
+
+/**
+ * Drain the worker on SIGTERM: its listener stops taking connections,
+ * sessions waiting for a command are closed, those running one are
+ * closed once it is done, and then the process exits. SIGTERM must be
+ * blocked in every thread before this is called
+ * @param lstnsock Listening socket of the worker
+ * @param pool Worker pool running sessions or transfers, NULL if none
+ * @param close_idle Function closing the sessions not running a command
+ */
+void fork_drain_on_signal(int lstnsock, WorkPool *pool, void (*close_idle)(void));
+
+/**
+ * Whether the worker is draining, its listener shut down
+ * @return non-zero if so, 0 also when not a worker
+ */
+int fork_draining(void);
+
+/**
+ * Block for good if the worker is draining, as the process exits from
+ * the draining thread; return at once if not
+ */
+void fork_drain_wait(void);
+
+#endif
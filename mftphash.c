@@ -0,0 +1,362 @@
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "mftphash.h"
+
+#define CRC32C_POLY 0x82F63B78 /* reflected Castagnoli polynomial */
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+typedef struct HashCacheEntry
+{
+    int in_use;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    int alg;
+    off_t offset;
+    size_t length;
+    uint64_t digest;
+    unsigned long used; /* cache clock at last use */
+} HashCacheEntry;
+
+static uint32_t crc_table[8][256]; /* slicing-by-8 tables */
+static uint32_t (*crc32c_run)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static HashCacheEntry cache[HASH_CACHE_ENTRIES];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long cache_clock;
+
+/**
+ * CRC32C eight bytes at a time with table lookups
+ * @param crc Inverted CRC so far
+ * @return inverted CRC
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    for (; len > 0 && ((uintptr_t) p & 7); len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v = le64toh(v) ^ crc;
+        crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff]
+              ^ crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff]
+              ^ crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff]
+              ^ crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+    }
+    for (; len > 0; len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * CRC32C with the SSE4.2 crc32 instruction, eight bytes per instruction
+ * @param crc Inverted CRC so far
+ * @return inverted CRC
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    for (; len > 0 && ((uintptr_t) p & 7); len--)
+        c = _mm_crc32_u8(c, *p++);
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; len--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+static void crc32c_setup(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+    }
+
+    crc32c_run = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_run = crc32c_sse42;
+#endif
+}
+
+int hash_alg(const char *name)
+{
+    if (strcmp(name, "crc32c") == 0)
+        return HASH_CRC32C;
+    if (strcmp(name, "xxh64") == 0)
+        return HASH_XXH64;
+    return -1;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc32c_setup);
+    return ~crc32c_run(~crc, (const unsigned char *) buf, len);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * P2, 31) * P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh_round(0, v)) * P1 + P4;
+}
+
+/**
+ * Run the four XXH64 lanes over whole 32-byte stripes
+ * @return bytes consumed
+ */
+static size_t xxh_stripes(uint64_t *v, const unsigned char *p, size_t len)
+{
+    // independent lanes keep the multipliers busy in parallel
+    size_t done = 0;
+    for (; done + 32 <= len; done += 32)
+    {
+        v[0] = xxh_round(v[0], read64(p + done));
+        v[1] = xxh_round(v[1], read64(p + done + 8));
+        v[2] = xxh_round(v[2], read64(p + done + 16));
+        v[3] = xxh_round(v[3], read64(p + done + 24));
+    }
+    return done;
+}
+
+void hash_init(HashState *h, int alg)
+{
+    memset(h, 0, sizeof(HashState));
+    h->alg = alg;
+    h->v[0] = P1 + P2;
+    h->v[1] = P2;
+    h->v[2] = 0;
+    h->v[3] = -P1;
+}
+
+void hash_update(HashState *h, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    h->total += len;
+    if (h->alg == HASH_CRC32C)
+    {
+        h->crc = crc32c(h->crc, p, len);
+        return;
+    }
+
+    if (h->buffered > 0)
+    {
+        size_t fill = sizeof(h->buf) - h->buffered < len ? sizeof(h->buf) - h->buffered : len;
+        memcpy(h->buf + h->buffered, p, fill);
+        h->buffered += fill;
+        p += fill;
+        len -= fill;
+        if (h->buffered < sizeof(h->buf))
+            return;
+        xxh_stripes(h->v, h->buf, sizeof(h->buf));
+        h->buffered = 0;
+    }
+
+    size_t done = xxh_stripes(h->v, p, len);
+    memcpy(h->buf, p + done, len - done);
+    h->buffered = len - done;
+}
+
+uint64_t hash_digest(const HashState *h)
+{
+    if (h->alg == HASH_CRC32C)
+        return h->crc;
+
+    uint64_t acc;
+    if (h->total >= 32)
+    {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = xxh_merge(acc, h->v[i]);
+    }
+    else
+        acc = P5;
+    acc += h->total;
+
+    const unsigned char *p = h->buf, *end = h->buf + h->buffered;
+    for (; p + 8 <= end; p += 8)
+        acc = rotl64(acc ^ xxh_round(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        acc = rotl64(acc ^ (le32toh(v) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        acc = rotl64(acc ^ (*p * P5), 11) * P1;
+
+    acc ^= acc >> 33;
+    acc *= P2;
+    acc ^= acc >> 29;
+    acc *= P3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t xxh64(const void *buf, size_t len)
+{
+    HashState h;
+    hash_init(&h, HASH_XXH64);
+    hash_update(&h, buf, len);
+    return hash_digest(&h);
+}
+
+/**
+ * Find the cached digest of a file version and range, cache lock held
+ * @return entry, NULL if none
+ */
+static HashCacheEntry *cache_find(const struct stat *st, int alg, off_t offset, size_t length)
+{
+    for (int i = 0; i < HASH_CACHE_ENTRIES; i++)
+    {
+        HashCacheEntry *ent = &cache[i];
+        if (ent->in_use && ent->dev == st->st_dev && ent->ino == st->st_ino
+            && ent->size == st->st_size && ent->alg == alg
+            && ent->offset == offset && ent->length == length
+            && ent->mtime.tv_sec == st->st_mtim.tv_sec && ent->mtime.tv_nsec == st->st_mtim.tv_nsec
+            && ent->ctime.tv_sec == st->st_ctim.tv_sec && ent->ctime.tv_nsec == st->st_ctim.tv_nsec)
+            return ent;
+    }
+    return NULL;
+}
+
+static int cache_lookup(const struct stat *st, int alg, off_t offset, size_t length, uint64_t *digest)
+{
+    pthread_mutex_lock(&cache_lock);
+    HashCacheEntry *ent = cache_find(st, alg, offset, length);
+    if (ent != NULL)
+    {
+        ent->used = ++cache_clock;
+        *digest = ent->digest;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ent != NULL ? 0 : -1;
+}
+
+/**
+ * Cache a digest in a free or the least recently used entry
+ */
+static void cache_store(const struct stat *st, int alg, off_t offset, size_t length, uint64_t digest)
+{
+    pthread_mutex_lock(&cache_lock);
+    HashCacheEntry *ent = cache_find(st, alg, offset, length);
+    for (int i = 0; i < HASH_CACHE_ENTRIES && ent == NULL; i++)
+    {
+        if (!cache[i].in_use)
+            ent = &cache[i];
+    }
+    if (ent == NULL)
+    {
+        ent = &cache[0];
+        for (int i = 1; i < HASH_CACHE_ENTRIES; i++)
+        {
+            if (cache[i].used < ent->used)
+                ent = &cache[i];
+        }
+    }
+
+    ent->in_use = 1;
+    ent->dev = st->st_dev;
+    ent->ino = st->st_ino;
+    ent->size = st->st_size;
+    ent->mtime = st->st_mtim;
+    ent->ctime = st->st_ctim;
+    ent->alg = alg;
+    ent->offset = offset;
+    ent->length = length;
+    ent->digest = digest;
+    ent->used = ++cache_clock;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int hash_cache_lookup(const struct stat *st, int alg, uint64_t *digest)
+{
+    return cache_lookup(st, alg, 0, st->st_size, digest);
+}
+
+void hash_cache_store(const struct stat *st, int alg, uint64_t digest)
+{
+    cache_store(st, alg, 0, st->st_size, digest);
+}
+
+int hash_file(int fd, int alg, off_t offset, size_t length, uint64_t *digest)
+{
+    struct stat st, after;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || offset < 0 || offset > st.st_size)
+        return -1;
+    if (length > (size_t) (st.st_size - offset))
+        length = st.st_size - offset;
+    if (cache_lookup(&st, alg, offset, length, digest) == 0)
+        return 0;
+
+    unsigned char *buf = (unsigned char *) malloc(XFER_BUF_SIZE);
+    if (buf == NULL)
+        return -1;
+
+    HashState h;
+    hash_init(&h, alg);
+    size_t done = 0;
+    ssize_t n = 0;
+    while (done < length)
+    {
+        size_t chunk = length - done < XFER_BUF_SIZE ? length - done : XFER_BUF_SIZE;
+        if ((n = pread(fd, buf, chunk, offset + done)) <= 0)
+            break;
+        hash_update(&h, buf, n);
+        done += n;
+    }
+    free(buf);
+    if (done != length)
+        return -1;
+    *digest = hash_digest(&h);
+
+    // a file written meanwhile gives a digest of no version at all
+    if (fstat(fd, &after) == 0 && after.st_size == st.st_size
+        && after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec
+        && after.st_ctim.tv_sec == st.st_ctim.tv_sec && after.st_ctim.tv_nsec == st.st_ctim.tv_nsec)
+        cache_store(&st, alg, offset, length, *digest);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef MFTPHASH_H
+#define MFTPHASH_H
+
+#include "mftputil.h"
+
+/* checksum algorithm */
+#define HASH_CRC32C 1 /* Castagnoli CRC, SSE4.2 instruction where the CPU has it */
+#define HASH_XXH64 2  /* XXH64, seed 0 */
+
+#define HASH_CACHE_ENTRIES 256 /* digests kept, by file version and range */
+#define HASH_WHOLE ((size_t) -1) /* length of a range up to end of file */
+
+typedef struct HashState
+{
+    int alg;
+    uint32_t crc;
+    uint64_t v[4];         /* XXH64 lanes */
+    unsigned char buf[32]; /* XXH64 input short of a stripe */
+    size_t buffered;
+    uint64_t total;
+} HashState;
+
+/**
+ * Look up an algorithm by name
+ * @param name String name, "crc32c" or "xxh64"
+ * @return HASH_CRC32C or HASH_XXH64, -1 if unknown
+ */
+int hash_alg(const char *name);
+
+/**
+ * Continue a CRC32C, like zlib's crc32()
+ * @param crc CRC of the data so far, 0 to start
+ * @param buf Data
+ * @param len Length of data
+ * @return CRC of the data so far and buf
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * XXH64 of a buffer, seed 0
+ * @param buf Data
+ * @param len Length of data
+ * @return hash
+ */
+uint64_t xxh64(const void *buf, size_t len);
+
+/**
+ * Start hashing a stream
+ * @param h Pointer to state
+ * @param alg HASH_CRC32C or HASH_XXH64
+ */
+void hash_init(HashState *h, int alg);
+
+/**
+ * Hash the next part of a stream
+ * @param h Pointer to state
+ * @param buf Data
+ * @param len Length of data
+ */
+void hash_update(HashState *h, const void *buf, size_t len);
+
+/**
+ * Digest of the stream so far, CRCs in the low 32 bits
+ * @param h Pointer to state
+ * @return digest
+ */
+uint64_t hash_digest(const HashState *h);
+
+/**
+ * Checksum a range of a regular file, from the digest cache when the
+ * file has the same device, inode, size, mtime and ctime as when the
+ * digest was taken
+ * @param fd File
+ * @param alg HASH_CRC32C or HASH_XXH64
+ * @param offset Offset to start from
+ * @param length Bytes to hash, cut at end of file, HASH_WHOLE for all
+ * @param digest Pointer to save digest
+ * @return 0, -1 if failed
+ */
+int hash_file(int fd, int alg, off_t offset, size_t length, uint64_t *digest);
+
+/**
+ * Look up the digest of a whole file version in the cache
+ * @param st Pointer to status of file
+ * @param alg HASH_CRC32C or HASH_XXH64
+ * @param digest Pointer to save digest
+ * @return 0, -1 if not cached
+ */
+int hash_cache_lookup(const struct stat *st, int alg, uint64_t *digest);
+
+/**
+ * Keep the digest of a whole file version, taken while it was transferred
+ * @param st Pointer to status of file when the digest was taken
+ * @param alg HASH_CRC32C or HASH_XXH64
+ * @param digest Digest
+ */
+void hash_cache_store(const struct stat *st, int alg, uint64_t digest);
+
+#endif
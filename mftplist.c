@@ -0,0 +1,923 @@
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+
+#include "mftplist.h"
+#include "mftphash.h"
+#include "mftpuring.h"
+
+/* directory changes that make a listing stale */
+#define LIST_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY \
+                         | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct ListText
+{
+    int refs;    /* cache and every listing being sent hold one */
+    size_t len;
+    char data[];
+} ListText;
+
+typedef struct ListCacheEntry
+{
+    int in_use;
+    dev_t dev;
+    ino_t ino;
+    int format;
+    int wd;               /* inotify watch on the directory */
+    int pins;             /* manifests being walked through the entry, which keep it */
+    int next;             /* next entry in its key bucket, or in the free list */
+    int wd_next;          /* next entry in its watch bucket */
+    int lru_prev;         /* neighbours by last use, -1 at the ends; unpinned entries only */
+    int lru_next;
+    ListText *text;       /* NULL if stale */
+} ListCacheEntry;
+
+/* cache entries a manifest walk holds until it is done */
+typedef struct ListPins
+{
+    int *entries;
+    size_t n;
+    size_t cap;
+} ListPins;
+
+typedef struct ListLine
+{
+    uint32_t line; /* offset of line in buffer */
+    uint32_t name; /* offset of name in buffer */
+    uint32_t len;  /* names may hold new lines, so keep the length */
+} ListLine;
+
+typedef struct ListBuilder
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t max;        /* largest listing kept, larger ones stream */
+    ListLine *lines;   /* only while the listing may still be cached */
+    size_t nlines;
+    size_t cap_lines;
+    int streaming;     /* grew past max, text goes out in chunks */
+    ListEmit emit;
+    void *arg;
+} ListBuilder;
+
+static ListCacheEntry cache[LIST_CACHE_ENTRIES];
+static int key_buckets[LIST_CACHE_BUCKETS]; /* first entry of each bucket, -1 if none */
+static int wd_buckets[LIST_CACHE_BUCKETS];
+static int lru_head = -1, lru_tail = -1;    /* most and least recently used */
+static int free_head = -1;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_bytes; /* text held by the cache */
+static unsigned long invalidations; /* bumped on every batch of inotify events */
+static int inotify_fd = -1;
+
+/**
+ * Drop a reference to a listing text
+ * @param text Pointer to text
+ */
+static void text_unref(ListText *text)
+{
+    if (text != NULL && __atomic_sub_fetch(&text->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(text);
+}
+
+/**
+ * Drop the listing of a cache entry, cache lock held
+ * @param ent Pointer to entry
+ */
+static void cache_drop(ListCacheEntry *ent)
+{
+    if (ent->text == NULL)
+        return;
+    cache_bytes -= ent->text->len;
+    text_unref(ent->text);
+    ent->text = NULL;
+}
+
+/**
+ * Bucket of a directory listing
+ */
+static int key_bucket(dev_t dev, ino_t ino, int format)
+{
+    uint64_t h = ((uint64_t) ino * 4 + format) ^ ((uint64_t) dev << 40);
+    return (int) ((h * 0x9e3779b97f4a7c15ULL) >> 32) & (LIST_CACHE_BUCKETS - 1);
+}
+
+/**
+ * Unlink an entry from a bucket chain, cache lock held
+ * @param head Pointer to first entry of the bucket
+ * @param i Entry
+ * @param wd Non-zero for a watch bucket, else a key bucket
+ */
+static void bucket_remove(int *head, int i, int wd)
+{
+    for (int *p = head; *p >= 0; p = wd ? &cache[*p].wd_next : &cache[*p].next)
+    {
+        if (*p == i)
+        {
+            *p = wd ? cache[i].wd_next : cache[i].next;
+            return;
+        }
+    }
+}
+
+/**
+ * Take an entry out of the recency list, cache lock held
+ * @param i Entry, left alone if not in the list
+ */
+static void lru_remove(int i)
+{
+    ListCacheEntry *ent = &cache[i];
+    if (ent->lru_prev < 0 && lru_head != i)
+        return;
+    if (ent->lru_prev >= 0)
+        cache[ent->lru_prev].lru_next = ent->lru_next;
+    else
+        lru_head = ent->lru_next;
+    if (ent->lru_next >= 0)
+        cache[ent->lru_next].lru_prev = ent->lru_prev;
+    else
+        lru_tail = ent->lru_prev;
+    ent->lru_prev = ent->lru_next = -1;
+}
+
+/**
+ * Put an entry first in the recency list, cache lock held
+ * @param i Entry, not in the list
+ */
+static void lru_push(int i)
+{
+    cache[i].lru_prev = -1;
+    cache[i].lru_next = lru_head;
+    if (lru_head >= 0)
+        cache[lru_head].lru_prev = i;
+    else
+        lru_tail = i;
+    lru_head = i;
+}
+
+/**
+ * Whether any cache entry uses an inotify watch, cache lock held
+ * @param wd Watch descriptor
+ * @return non-zero if in use
+ */
+static int watch_in_use(int wd)
+{
+    for (int i = wd_buckets[wd & (LIST_CACHE_BUCKETS - 1)]; i >= 0; i = cache[i].wd_next)
+    {
+        if (cache[i].wd == wd)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Find the entry of a directory listing, cache lock held
+ * @return entry, -1 if none
+ */
+static int cache_find(dev_t dev, ino_t ino, int format)
+{
+    for (int i = key_buckets[key_bucket(dev, ino, format)]; i >= 0; i = cache[i].next)
+    {
+        if (cache[i].dev == dev && cache[i].ino == ino && cache[i].format == format)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Free an entry, and its watch unless another entry or the caller
+ * still needs it, cache lock held
+ * @param i Entry, not pinned
+ * @param keep_wd Watch to keep in any case
+ */
+static void cache_evict(int i, int keep_wd)
+{
+    ListCacheEntry *ent = &cache[i];
+    bucket_remove(&key_buckets[key_bucket(ent->dev, ent->ino, ent->format)], i, 0);
+    bucket_remove(&wd_buckets[ent->wd & (LIST_CACHE_BUCKETS - 1)], i, 1);
+    lru_remove(i);
+    cache_drop(ent);
+    ent->in_use = 0;
+    ent->next = free_head;
+    free_head = i;
+    if (ent->wd != keep_wd && !watch_in_use(ent->wd))
+        inotify_rm_watch(inotify_fd, ent->wd);
+}
+
+/**
+ * Mark an entry used, pinning it for a walk, cache lock held
+ * @param i Entry
+ * @param pins Pointer to pins of the walk, NULL if not walking
+ */
+static void cache_use(int i, ListPins *pins)
+{
+    if (pins != NULL && pins->n == pins->cap)
+    {
+        size_t cap = pins->cap ? pins->cap * 2 : 256;
+        int *grown = (int *) realloc(pins->entries, cap * sizeof(int));
+        if (grown != NULL)
+        {
+            pins->entries = grown;
+            pins->cap = cap;
+        }
+        else
+            pins = NULL;
+    }
+
+    // pinned entries are out of the recency list, so eviction never sees them
+    if (cache[i].pins == 0)
+        lru_remove(i);
+    if (pins != NULL)
+    {
+        pins->entries[pins->n++] = i;
+        cache[i].pins++;
+    }
+    if (cache[i].pins == 0)
+        lru_push(i);
+}
+
+/**
+ * Let the entries a walk used be evicted again
+ * @param pins Pointer to pins of the walk
+ */
+static void cache_unpin(ListPins *pins)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (size_t k = 0; k < pins->n; k++)
+    {
+        int i = pins->entries[k];
+        if (--cache[i].pins == 0)
+            lru_push(i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(pins->entries);
+}
+
+/**
+ * Reads inotify events and marks listings of changed directories stale
+ * @param arg Unused
+ */
+static void *list_watch_run(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    (void) arg;
+
+    while (1)
+    {
+        if ((len = read(inotify_fd, buf, sizeof(buf))) <= 0)
+        {
+            if (len < 0 && errno == EINTR)
+                continue;
+            perror("fail to read directory changes");
+            break;
+        }
+
+        // listings built while these events were pending are not cached
+        __atomic_add_fetch(&invalidations, 1, __ATOMIC_ACQ_REL);
+
+        pthread_mutex_lock(&cache_lock);
+        for (char *p = buf; p < buf + len; )
+        {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost, no listing can be trusted
+                for (int i = 0; i < LIST_CACHE_ENTRIES; i++)
+                    cache_drop(&cache[i]);
+            }
+            else if (ev->wd >= 0)
+            {
+                for (int i = wd_buckets[ev->wd & (LIST_CACHE_BUCKETS - 1)]; i >= 0; i = cache[i].wd_next)
+                {
+                    if (cache[i].wd == ev->wd)
+                        cache_drop(&cache[i]);
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    return NULL;
+}
+
+int list_cache_init(void)
+{
+    for (int i = 0; i < LIST_CACHE_BUCKETS; i++)
+        key_buckets[i] = wd_buckets[i] = -1;
+    for (int i = LIST_CACHE_ENTRIES - 1; i >= 0; i--)
+    {
+        cache[i].lru_prev = cache[i].lru_next = -1;
+        cache[i].next = free_head;
+        free_head = i;
+    }
+
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0)
+        return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, list_watch_run, NULL) != 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/**
+ * Take a reference to a fresh cached listing
+ * @param st Pointer to status of directory
+ * @param format Listing format
+ * @param pins Pointer to pins of the walk, NULL if not walking
+ * @return text, NULL if not cached
+ */
+static ListText *cache_lookup(struct stat *st, int format, ListPins *pins)
+{
+    // nothing is cached without inotify
+    if (inotify_fd < 0)
+        return NULL;
+
+    ListText *text = NULL;
+    pthread_mutex_lock(&cache_lock);
+    int i = cache_find(st->st_dev, st->st_ino, format);
+    if (i >= 0 && cache[i].text != NULL)
+    {
+        cache_use(i, pins);
+        text = cache[i].text;
+        __atomic_add_fetch(&text->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return text;
+}
+
+/**
+ * Cache a listing in the entry of its directory, else a free or the
+ * least recently used one, unless the directory may have changed since
+ * generation gen; entries pinned by walks are never evicted, so when
+ * only those are left the listing is not cached
+ * @param st Pointer to status of directory
+ * @param format Listing format
+ * @param wd Watch on the directory
+ * @param gen Invalidation count before the directory was read
+ * @param text Pointer to text, the cache takes a reference
+ * @param pins Pointer to pins of the walk, NULL if not walking
+ */
+static void cache_insert(struct stat *st, int format, int wd, unsigned long gen, ListText *text,
+                         ListPins *pins)
+{
+    pthread_mutex_lock(&cache_lock);
+    int i = -1;
+    if (__atomic_load_n(&invalidations, __ATOMIC_ACQUIRE) != gen)
+        goto uncached;
+
+    if ((i = cache_find(st->st_dev, st->st_ino, format)) >= 0)
+        cache_drop(&cache[i]);
+
+    // over budget or out of entries, the least recently used go first
+    while (lru_tail >= 0 && (cache_bytes + text->len > LIST_CACHE_BUDGET || (i < 0 && free_head < 0)))
+    {
+        int victim = lru_tail;
+        cache_evict(victim, wd);
+        if (victim == i)
+            i = -1;
+    }
+    if (cache_bytes + text->len > LIST_CACHE_BUDGET || (i < 0 && free_head < 0))
+        goto uncached;
+
+    ListCacheEntry *ent;
+    if (i < 0)
+    {
+        i = free_head;
+        ent = &cache[i];
+        free_head = ent->next;
+        ent->in_use = 1;
+        ent->dev = st->st_dev;
+        ent->ino = st->st_ino;
+        ent->format = format;
+        ent->pins = 0;
+        ent->lru_prev = ent->lru_next = -1;
+        int bucket = key_bucket(ent->dev, ent->ino, format);
+        ent->next = key_buckets[bucket];
+        key_buckets[bucket] = i;
+        ent->wd = -1;
+    }
+    ent = &cache[i];
+
+    // the directory may have been watched anew since it was cached
+    if (ent->wd != wd)
+    {
+        int old_wd = ent->wd;
+        if (old_wd >= 0)
+            bucket_remove(&wd_buckets[old_wd & (LIST_CACHE_BUCKETS - 1)], i, 1);
+        ent->wd = wd;
+        ent->wd_next = wd_buckets[wd & (LIST_CACHE_BUCKETS - 1)];
+        wd_buckets[wd & (LIST_CACHE_BUCKETS - 1)] = i;
+        if (old_wd >= 0 && !watch_in_use(old_wd))
+            inotify_rm_watch(inotify_fd, old_wd);
+    }
+
+    ent->text = text;
+    cache_bytes += text->len;
+    __atomic_add_fetch(&text->refs, 1, __ATOMIC_RELAXED);
+    cache_use(i, pins);
+    pthread_mutex_unlock(&cache_lock);
+    return;
+
+uncached:
+    if (!watch_in_use(wd))
+        inotify_rm_watch(inotify_fd, wd);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Append a line to a listing being built; past the builder's limit
+ * the listing is sent out in chunks instead of kept
+ * @param b Pointer to builder
+ * @param line Text of line
+ * @param len Length of line
+ * @param name_off Offset of the name in line
+ * @return 0, -1 if failed
+ */
+static int builder_add(ListBuilder *b, const char *line, size_t len, size_t name_off)
+{
+    if (!b->streaming && b->len + len > b->max)
+    {
+        // too large to cache: stop keeping lines, send what we have
+        b->streaming = 1;
+        free(b->lines);
+        b->lines = NULL;
+    }
+    if (b->streaming && b->len + len > LIST_CHUNK_SIZE)
+    {
+        if (b->emit(b->arg, b->buf, b->len) < 0)
+            return -1;
+        b->len = 0;
+    }
+    if (b->len + len > b->cap)
+    {
+        size_t cap = b->cap;
+        while (cap < b->len + len)
+            cap *= 2;
+        char *grown = (char *) realloc(b->buf, cap);
+        if (grown == NULL)
+            return -1;
+        b->buf = grown;
+        b->cap = cap;
+    }
+
+    if (!b->streaming)
+    {
+        if (b->nlines == b->cap_lines)
+        {
+            size_t cap = b->cap_lines ? b->cap_lines * 2 : 256;
+            ListLine *lines = (ListLine *) realloc(b->lines, cap * sizeof(ListLine));
+            if (lines == NULL)
+                return -1;
+            b->lines = lines;
+            b->cap_lines = cap;
+        }
+        b->lines[b->nlines].line = b->len;
+        b->lines[b->nlines].name = b->len + name_off;
+        b->lines[b->nlines].len = len;
+        b->nlines++;
+    }
+
+    memcpy(b->buf + b->len, line, len);
+    b->len += len;
+    return 0;
+}
+
+/**
+ * Format the manifest line of a regular file or directory
+ * @param dirfd Directory being listed
+ * @param name Entry name
+ * @param format LIST_TREE or LIST_TREE_CRC
+ * @param stx Pointer to status of entry
+ * @param line Buffer for line
+ * @param size Buffer size
+ * @param name_off Pointer to save offset of the name in line
+ * @return length of line, 0 to skip entry
+ */
+static size_t format_tree_entry(int dirfd, const char *name, int format, struct statx *stx,
+                                char *line, size_t size, size_t *name_off)
+{
+    // a manifest is read line by line, and files still being put are not synced
+    if (strchr(name, '\n') != NULL || !(S_ISREG(stx->stx_mode) || S_ISDIR(stx->stx_mode))
+        || strncmp(name, LIST_TEMP_PREFIX, sizeof(LIST_TEMP_PREFIX) - 1) == 0)
+        return 0;
+
+    char crc[16] = "-";
+    if (format == LIST_TREE_CRC && S_ISREG(stx->stx_mode))
+    {
+        // the version listed, whose digest a transfer or an earlier
+        // manifest may have taken already
+        struct stat st, now;
+        memset(&st, 0, sizeof(st));
+        st.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+        st.st_ino = stx->stx_ino;
+        st.st_mode = stx->stx_mode;
+        st.st_size = stx->stx_size;
+        st.st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+        st.st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+        st.st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+
+        uint64_t digest;
+        int known = hash_cache_lookup(&st, HASH_CRC32C, &digest) == 0;
+        if (!known)
+        {
+            // a file changed since it was listed gets no checksum
+            int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0 && hash_file(fd, HASH_CRC32C, 0, HASH_WHOLE, &digest) == 0
+                && fstat(fd, &now) == 0 && now.st_ino == st.st_ino && now.st_size == st.st_size
+                && now.st_mtim.tv_sec == st.st_mtim.tv_sec && now.st_mtim.tv_nsec == st.st_mtim.tv_nsec
+                && now.st_ctim.tv_sec == st.st_ctim.tv_sec && now.st_ctim.tv_nsec == st.st_ctim.tv_nsec)
+            {
+                hash_cache_store(&st, HASH_CRC32C, digest);
+                known = 1;
+            }
+            if (fd >= 0)
+                close(fd);
+        }
+        if (known)
+            snprintf(crc, sizeof(crc), "%08x", (uint32_t) digest);
+    }
+
+    int len = snprintf(line, size, "%c %llu %llu %s ", S_ISDIR(stx->stx_mode) ? 'd' : 'f',
+                       (unsigned long long) stx->stx_size,
+                       (unsigned long long) stx->stx_mtime.tv_sec * 1000000000 + stx->stx_mtime.tv_nsec,
+                       crc);
+    *name_off = len;
+    len += snprintf(line + len, size - len, "%s\n", name);
+    return (size_t) len < size ? (size_t) len : 0;
+}
+
+/**
+ * Format the line of one directory entry
+ * @param dirfd Directory being listed
+ * @param name Entry name
+ * @param format Listing format
+ * @param stx Pointer to status of entry, unused for LIST_NAMES
+ * @param line Buffer for line
+ * @param size Buffer size
+ * @param name_off Pointer to save offset of the name in line
+ * @return length of line, 0 to skip entry
+ */
+static size_t format_entry(int dirfd, const char *name, int format, struct statx *stx,
+                           char *line, size_t size, size_t *name_off)
+{
+    if (format == LIST_NAMES)
+    {
+        // like ls: hidden entries are left out
+        if (name[0] == '.')
+            return 0;
+        *name_off = 0;
+        return snprintf(line, size, "%s\n", name);
+    }
+
+    if (format == LIST_TREE || format == LIST_TREE_CRC)
+        return format_tree_entry(dirfd, name, format, stx, line, size, name_off);
+
+    const char *type = S_ISREG(stx->stx_mode) ? "file"
+                       : S_ISDIR(stx->stx_mode) ? "dir"
+                       : S_ISLNK(stx->stx_mode) ? "OS.unix=symlink" : "OS.unix=other";
+    time_t mtime = stx->stx_mtime.tv_sec;
+    struct tm tm;
+    char modify[32];
+    gmtime_r(&mtime, &tm);
+    strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+
+    int len = snprintf(line, size, "type=%s;size=%llu;modify=%s;UNIX.mode=0%o; ",
+                       type, (unsigned long long) stx->stx_size, modify, stx->stx_mode & 07777);
+    *name_off = len;
+    return len + snprintf(line + len, size - len, "%s\n", name);
+}
+
+/**
+ * Order lines by name, for qsort_r()
+ */
+static int compare_lines(const void *a, const void *b, void *buf)
+{
+    return strcmp((char *) buf + ((ListLine *) a)->name, (char *) buf + ((ListLine *) b)->name);
+}
+
+/**
+ * Read a directory and emit its listing
+ * @param dirfd Directory, read through a descriptor of our own
+ * @param format Listing format
+ * @param b Pointer to builder
+ * @return 0, -1 if failed
+ */
+static int build_listing(int dirfd, int format, ListBuilder *b)
+{
+    // own descriptor so the caller's offset is left alone
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *dents = (char *) malloc(LIST_CHUNK_SIZE);
+    if (fd < 0 || dents == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        free(dents);
+        return -1;
+    }
+
+    char line[MAX_BUF_SIZE];
+    size_t len, name_off;
+    ssize_t nread;
+    int rc = 0;
+    const char **names = NULL;
+    struct statx *stx = NULL;
+    int *res = NULL, cap = 0;
+    while (rc == 0 && (nread = getdents64(fd, dents, LIST_CHUNK_SIZE)) > 0)
+    {
+        int n = 0;
+        for (ssize_t off = 0; off < nread && rc == 0; )
+        {
+            struct dirent64 *d = (struct dirent64 *) (dents + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+            if (n == cap)
+            {
+                cap = cap ? cap * 2 : 256;
+                const char **grown = (const char **) realloc(names, cap * sizeof(char *));
+                names = grown ? grown : names;
+                struct statx *grown_stx = (struct statx *) realloc(stx, cap * sizeof(struct statx));
+                stx = grown_stx ? grown_stx : stx;
+                int *grown_res = (int *) realloc(res, cap * sizeof(int));
+                res = grown_res ? grown_res : res;
+                if (grown == NULL || grown_stx == NULL || grown_res == NULL)
+                    rc = -1;
+            }
+            if (rc == 0)
+                names[n++] = d->d_name;
+        }
+
+        // the whole batch is statted at once, only the fields we print,
+        // without syncing remote attributes
+        if (rc == 0 && format != LIST_NAMES)
+            uring_statx(fd, names, n, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT,
+                        STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME
+                        | (format == LIST_TREE_CRC ? STATX_INO | STATX_CTIME : 0), stx, res);
+
+        for (int i = 0; i < n && rc == 0; i++)
+        {
+            // an entry removed meanwhile is left out
+            if (format != LIST_NAMES && res[i] < 0)
+                continue;
+            if ((len = format_entry(fd, names[i], format, &stx[i], line, sizeof(line), &name_off)) > 0)
+                rc = builder_add(b, line, len, name_off);
+        }
+    }
+    if (nread < 0)
+        rc = -1;
+
+    free(names);
+    free(stx);
+    free(res);
+    free(dents);
+    close(fd);
+    return rc;
+}
+
+/**
+ * List a directory as list_dir() does, keeping what a walk used cached
+ * @param dirfd Open directory
+ * @param format Listing format
+ * @param emit Function to emit text
+ * @param arg Argument to emit
+ * @param pins Pointer to pins of the walk, NULL if not walking
+ * @return 0, -1 if failed
+ */
+static int list_dir_pinned(int dirfd, int format, ListEmit emit, void *arg, ListPins *pins)
+{
+    struct stat st;
+    if (fstat(dirfd, &st) < 0)
+        return -1;
+
+    ListText *text = cache_lookup(&st, format, pins);
+    if (text != NULL)
+    {
+        int rc = text->len > 0 ? emit(arg, text->data, text->len) : 0;
+        text_unref(text);
+        return rc;
+    }
+
+    // watch before reading, so no change can slip in unseen
+    int wd = -1;
+    unsigned long gen = __atomic_load_n(&invalidations, __ATOMIC_ACQUIRE);
+    if (inotify_fd >= 0)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+        wd = inotify_add_watch(inotify_fd, path, LIST_WATCH_MASK);
+    }
+
+    ListBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.emit = emit;
+    b.arg = arg;
+    b.cap = LIST_CHUNK_SIZE;
+    b.max = format == LIST_TREE || format == LIST_TREE_CRC ? LIST_TREE_MAX_BYTES : LIST_CACHE_MAX_BYTES;
+    b.buf = (char *) malloc(b.cap);
+    int rc = b.buf != NULL ? build_listing(dirfd, format, &b) : -1;
+
+    if (rc == 0 && b.streaming)
+        rc = b.len > 0 ? emit(arg, b.buf, b.len) : 0;
+    else if (rc == 0)
+    {
+        // small enough to keep: sort by name and cache
+        qsort_r(b.lines, b.nlines, sizeof(ListLine), compare_lines, b.buf);
+        if ((text = (ListText *) malloc(sizeof(ListText) + b.len)) == NULL)
+            rc = -1;
+        else
+        {
+            text->refs = 1;
+            text->len = 0;
+            for (size_t i = 0; i < b.nlines; i++)
+            {
+                memcpy(text->data + text->len, b.buf + b.lines[i].line, b.lines[i].len);
+                text->len += b.lines[i].len;
+            }
+            if (wd >= 0)
+                cache_insert(&st, format, wd, gen, text, pins);
+            rc = text->len > 0 ? emit(arg, text->data, text->len) : 0;
+            text_unref(text);
+            wd = -1;
+        }
+    }
+
+    // a watch nobody caches for is not needed
+    if (wd >= 0)
+    {
+        pthread_mutex_lock(&cache_lock);
+        if (!watch_in_use(wd))
+            inotify_rm_watch(inotify_fd, wd);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    free(b.lines);
+    free(b.buf);
+    return rc;
+}
+
+int list_dir(int dirfd, int format, ListEmit emit, void *arg)
+{
+    return list_dir_pinned(dirfd, format, emit, arg, NULL);
+}
+
+/* text gathered from list_dir(), or batched for emit */
+typedef struct TreeBuf
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+} TreeBuf;
+
+/**
+ * Append text to a buffer, for list_dir()
+ */
+static int tree_collect(void *_tb, const char *buf, size_t len)
+{
+    TreeBuf *tb = (TreeBuf *) _tb;
+    if (tb->len + len > tb->cap)
+    {
+        size_t cap = tb->cap ? tb->cap : LIST_CHUNK_SIZE;
+        while (cap < tb->len + len)
+            cap *= 2;
+        char *grown = (char *) realloc(tb->buf, cap);
+        if (grown == NULL)
+            return -1;
+        tb->buf = grown;
+        tb->cap = cap;
+    }
+    memcpy(tb->buf + tb->len, buf, len);
+    tb->len += len;
+    return 0;
+}
+
+/* state of one manifest being sent */
+typedef struct TreeWalk
+{
+    int format;
+    char path[PATH_MAX]; /* of the directory being walked, ending in '/' */
+    char out[LIST_CHUNK_SIZE];
+    size_t out_len;
+    ListPins pins;       /* directories listed so far, kept in the cache */
+    ListEmit emit;
+    void *arg;
+} TreeWalk;
+
+/**
+ * Add a manifest line, sending the batch when full
+ * @param w Pointer to walk
+ * @param fields Text of size, mtime and crc, with the space after
+ * @param fields_len Length of fields
+ * @param name Entry name ending in a new line
+ * @param name_len Length of name
+ * @return 0, -1 if failed
+ */
+static int tree_emit(TreeWalk *w, const char *fields, size_t fields_len,
+                     const char *name, size_t name_len)
+{
+    size_t path_len = strlen(w->path);
+    size_t len = fields_len + path_len + name_len;
+    if (len > sizeof(w->out))
+        return 0;
+    if (w->out_len + len > sizeof(w->out))
+    {
+        if (w->emit(w->arg, w->out, w->out_len) < 0)
+            return -1;
+        w->out_len = 0;
+    }
+    memcpy(w->out + w->out_len, fields, fields_len);
+    memcpy(w->out + w->out_len + fields_len, w->path, path_len);
+    memcpy(w->out + w->out_len + fields_len + path_len, name, name_len);
+    w->out_len += len;
+    return 0;
+}
+
+/**
+ * Send the manifest lines of a directory and of those below it
+ * @param w Pointer to walk, path set to the directory
+ * @param dirfd Directory
+ * @param depth Levels below the top
+ * @return 0, -1 if failed
+ */
+static int tree_walk(TreeWalk *w, int dirfd, int depth)
+{
+    TreeBuf tb;
+    memset(&tb, 0, sizeof(tb));
+    if (list_dir_pinned(dirfd, w->format, tree_collect, &tb, &w->pins) < 0)
+    {
+        free(tb.buf);
+        return -1;
+    }
+
+    int rc = 0;
+    size_t path_len = strlen(w->path);
+    for (char *line = tb.buf, *end; rc == 0 && line < tb.buf + tb.len; line = end + 1)
+    {
+        if ((end = memchr(line, '\n', tb.buf + tb.len - line)) == NULL)
+            break;
+        // "<f|d> <size> <mtime> <crc> <name>"
+        char *name = line;
+        for (int field = 0; field < 4 && name != NULL; field++)
+        {
+            char *space = (char *) memchr(name, ' ', end - name);
+            name = space ? space + 1 : NULL;
+        }
+        if (name == NULL)
+            continue;
+
+        if (line[0] == 'f')
+        {
+            rc = tree_emit(w, line + 2, name - line - 2, name, end + 1 - name);
+            continue;
+        }
+        size_t name_len = end - name;
+        if (depth + 1 >= LIST_TREE_MAX_DEPTH || path_len + name_len + 2 > sizeof(w->path))
+            continue;
+
+        // a directory gone meanwhile, or unreadable, is left out
+        memcpy(w->path + path_len, name, name_len);
+        strcpy(w->path + path_len + name_len, "/");
+        int fd = openat(dirfd, w->path + path_len, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            rc = tree_walk(w, fd, depth + 1);
+            close(fd);
+        }
+        w->path[path_len] = '\0';
+    }
+    free(tb.buf);
+    return rc;
+}
+
+int list_tree(int dirfd, const char *prefix, int crc, ListEmit emit, void *arg)
+{
+    TreeWalk *w = (TreeWalk *) malloc(sizeof(TreeWalk));
+    if (w == NULL)
+        return -1;
+    w->format = crc ? LIST_TREE_CRC : LIST_TREE;
+    snprintf(w->path, sizeof(w->path), "%s", prefix);
+    w->out_len = 0;
+    memset(&w->pins, 0, sizeof(w->pins));
+    w->emit = emit;
+    w->arg = arg;
+
+    // a walk never evicts what it listed itself, so a tree larger
+    // than the cache keeps its first directories cached, not none
+    int rc = tree_walk(w, dirfd, 0);
+    if (rc == 0 && w->out_len > 0)
+        rc = emit(arg, w->out, w->out_len);
+    cache_unpin(&w->pins);
+    free(w);
+    return rc;
+}
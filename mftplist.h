@@ -0,0 +1,65 @@
+#ifndef MFTPLIST_H
+#define MFTPLIST_H
+
+#include "mftputil.h"
+
+/* listing format */
+#define LIST_NAMES 0 /* visible names, one per line, like ls */
+#define LIST_MLSD 1  /* facts and name of every entry, like MLSD */
+#define LIST_TREE 2  /* "<f|d> <size> <mtime ns> - <name>" of files and directories */
+#define LIST_TREE_CRC 3 /* same, with the CRC32C of files in hex instead of "-" */
+
+#define LIST_CHUNK_SIZE (64 * 1024)         /* getdents64 batch and streaming chunk */
+#define LIST_CACHE_ENTRIES 16384            /* directories kept in the cache */
+#define LIST_CACHE_BUCKETS 32768            /* hash buckets by directory and by watch, power of two */
+#define LIST_CACHE_MAX_BYTES (1024 * 1024)  /* larger listings stream uncached */
+#define LIST_TREE_MAX_BYTES (16 * 1024 * 1024) /* same for a directory in a manifest */
+#define LIST_CACHE_BUDGET (64 * 1024 * 1024) /* text of all cached listings */
+#define LIST_TREE_MAX_DEPTH 64              /* deeper directories are left out of manifests */
+#define LIST_TEMP_PREFIX ".mftp-tmp."        /* files puts are built in, left out of manifests */
+
+/**
+ * Emit part of a listing
+ * @param arg Caller's argument
+ * @param buf Text
+ * @param len Length of text
+ * @return 0, -1 to stop listing
+ */
+typedef int (*ListEmit)(void *arg, const char *buf, size_t len);
+
+/**
+ * Set up the listing cache and the thread invalidating it
+ * through inotify; without it every listing reads the directory
+ * @return 0, -1 if inotify is unavailable
+ */
+int list_cache_init(void);
+
+/**
+ * List a directory in-process, from the cache if it has not
+ * changed since, else with getdents64 and one batch of statx calls
+ * per getdents64 (see uring_statx()); listings that fit
+ * the cache are sorted by name, larger ones stream in directory order
+ * @param dirfd Open directory
+ * @param format LIST_NAMES or LIST_MLSD
+ * @param emit Function to emit text
+ * @param arg Argument to emit
+ * @return 0, -1 if failed
+ */
+int list_dir(int dirfd, int format, ListEmit emit, void *arg);
+
+/**
+ * Send the manifest of a subtree: a line "<size> <mtime ns> <crc|-> <path>"
+ * per regular file, paths under prefix; symbolic links are not followed
+ * and names holding new lines are left out. Each directory comes from the
+ * listing cache and stays there while the walk runs, so walking a tree of
+ * up to LIST_CACHE_ENTRIES directories again only reads what changed since
+ * @param dirfd Open directory at the top of the subtree
+ * @param prefix String path of the top, "" or ending in '/'
+ * @param crc Non-zero to checksum files
+ * @param emit Function to emit text
+ * @param arg Argument to emit
+ * @return 0, -1 if failed
+ */
+int list_tree(int dirfd, const char *prefix, int crc, ListEmit emit, void *arg);
+
+#endif
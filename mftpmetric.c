@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <limits.h>
+
+#include "mftpmetric.h"
+
+/* counters of one thread, written by that thread only */
+typedef struct MetricsShard
+{
+    struct MetricsShard *next; /* every shard ever made, never freed */
+    int in_use;                /* owned by a live thread, guarded by registry lock */
+    Metrics m;
+} MetricsShard;
+
+static MetricsShard *shards;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsShard *my_shard;
+
+/**
+ * Give a thread's shard to the next thread that starts, counts kept
+ */
+static void shard_release(void *_shard)
+{
+    pthread_mutex_lock(&registry_lock);
+    ((MetricsShard *) _shard)->in_use = 0;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&shard_key, shard_release);
+}
+
+/**
+ * The calling thread's shard: one a finished thread left, else a new one
+ * @return shard, NULL if out of memory
+ */
+static MetricsShard *shard_get(void)
+{
+    if (my_shard != NULL)
+        return my_shard;
+
+    pthread_once(&key_once, key_create);
+    pthread_mutex_lock(&registry_lock);
+    MetricsShard *shard = shards;
+    while (shard != NULL && shard->in_use)
+        shard = shard->next;
+    if (shard == NULL && (shard = (MetricsShard *) calloc(1, sizeof(MetricsShard))) != NULL)
+    {
+        shard->next = shards;
+        shards = shard;
+    }
+    if (shard != NULL)
+        shard->in_use = 1;
+    pthread_mutex_unlock(&registry_lock);
+
+    if (shard != NULL)
+        pthread_setspecific(shard_key, shard);
+    my_shard = shard;
+    return shard;
+}
+
+// a single writer needs no atomic add, only a store readers cannot tear
+#define BUMP(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * Bucket of a value, see METRICS_SUB
+ */
+static int bucket_of(uint64_t v)
+{
+    if (v < METRICS_SUB)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= METRICS_MAX_EXP)
+        return METRICS_BUCKETS - 1;
+    return METRICS_SUB * (e - METRICS_SUB_BITS + 1) + ((v >> (e - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+}
+
+/**
+ * Highest value that falls in a bucket
+ */
+static uint64_t bucket_high(int b)
+{
+    if (b < METRICS_SUB)
+        return b;
+    int e = b / METRICS_SUB + METRICS_SUB_BITS - 1;
+    uint64_t low = (uint64_t) (METRICS_SUB + b % METRICS_SUB) << (e - METRICS_SUB_BITS);
+    return low + ((uint64_t) 1 << (e - METRICS_SUB_BITS)) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t v)
+{
+    BUMP(h->counts[bucket_of(v)], 1);
+    BUMP(h->total, 1);
+    BUMP(h->sum, v);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(Histogram *to, const Histogram *from)
+{
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+        to->counts[b] += LOAD(from->counts[b]);
+    to->total += LOAD(from->total);
+    to->sum += LOAD(from->sum);
+    uint64_t max = LOAD(from->max);
+    if (max > to->max)
+        to->max = max;
+}
+
+uint64_t metrics_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_command(int op, uint64_t us, int failed)
+{
+    MetricsShard *shard = shard_get();
+    if (shard == NULL)
+        return;
+    if (op < 0 || op >= CMD_MAX_OPCODES)
+        op = 0;
+    BUMP(shard->m.commands[op], 1);
+    if (failed)
+        BUMP(shard->m.errors[op], 1);
+    hist_record(&shard->m.latency[op], us);
+}
+
+void metrics_data_conn(uint64_t us, int failed)
+{
+    MetricsShard *shard = shard_get();
+    if (shard == NULL)
+        return;
+    if (failed)
+        BUMP(shard->m.data_conn_errors, 1);
+    else
+        hist_record(&shard->m.data_conn, us);
+}
+
+void metrics_bytes(uint64_t in, uint64_t out)
+{
+    MetricsShard *shard = shard_get();
+    if (shard == NULL)
+        return;
+    BUMP(shard->m.bytes_in, in);
+    BUMP(shard->m.bytes_out, out);
+}
+
+void metrics_session(int opened)
+{
+    MetricsShard *shard = shard_get();
+    if (shard == NULL)
+        return;
+    if (opened)
+        BUMP(shard->m.sessions_opened, 1);
+    else
+        BUMP(shard->m.sessions_closed, 1);
+}
+
+void metrics_snapshot(Metrics *m)
+{
+    memset(m, 0, sizeof(Metrics));
+    pthread_mutex_lock(&registry_lock);
+    MetricsShard *head = shards;
+    pthread_mutex_unlock(&registry_lock);
+
+    // shards are only ever pushed in front, the list from head stays valid
+    for (MetricsShard *shard = head; shard != NULL; shard = shard->next)
+    {
+        const Metrics *s = &shard->m;
+        for (int op = 0; op < CMD_MAX_OPCODES; op++)
+        {
+            m->commands[op] += LOAD(s->commands[op]);
+            m->errors[op] += LOAD(s->errors[op]);
+            hist_merge(&m->latency[op], &s->latency[op]);
+        }
+        hist_merge(&m->data_conn, &s->data_conn);
+        m->data_conn_errors += LOAD(s->data_conn_errors);
+        m->bytes_in += LOAD(s->bytes_in);
+        m->bytes_out += LOAD(s->bytes_out);
+        m->sessions_opened += LOAD(s->sessions_opened);
+        m->sessions_closed += LOAD(s->sessions_closed);
+    }
+}
+
+uint64_t metrics_quantile(const Histogram *h, double q)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (q * h->total);
+    if (rank < q * h->total)
+        rank++;
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if (seen >= rank && seen > 0)
+            return bucket_high(b) < h->max ? bucket_high(b) : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * Print the count and percentiles of a histogram, ending the line
+ */
+static void hist_print(FILE *out, const Histogram *h)
+{
+    fprintf(out, "count %lu mean %lu p50 %lu p99 %lu p999 %lu max %lu us\n",
+            (unsigned long) h->total, (unsigned long) (h->total ? h->sum / h->total : 0),
+            (unsigned long) metrics_quantile(h, 0.5), (unsigned long) metrics_quantile(h, 0.99),
+            (unsigned long) metrics_quantile(h, 0.999), (unsigned long) h->max);
+}
+
+void metrics_print(FILE *out)
+{
+    Metrics *m = (Metrics *) malloc(sizeof(Metrics));
+    if (m == NULL)
+        return;
+    metrics_snapshot(m);
+
+    // a session may end in another thread than it began in,
+    // so only the sums over all threads make sense
+    fprintf(out, "sessions: active %lu opened %lu\n",
+            (unsigned long) (m->sessions_opened - m->sessions_closed),
+            (unsigned long) m->sessions_opened);
+    fprintf(out, "bytes: in %lu out %lu\n", (unsigned long) m->bytes_in, (unsigned long) m->bytes_out);
+    fprintf(out, "data connections: errors %lu ", (unsigned long) m->data_conn_errors);
+    hist_print(out, &m->data_conn);
+    for (int op = 0; op < CMD_MAX_OPCODES; op++)
+    {
+        if (m->commands[op] == 0)
+            continue;
+        const char *name = cmd_name(op);
+        fprintf(out, "command %s: errors %lu ", name ? name : "other", (unsigned long) m->errors[op]);
+        hist_print(out, &m->latency[op]);
+    }
+    free(m);
+}
+
+int metrics_dump(const char *path)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+        return -1;
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+        return -1;
+    metrics_print(out);
+    if (fclose(out) != 0 || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef MFTPMETRIC_H
+#define MFTPMETRIC_H
+
+#include "mftputil.h"
+#include "mftpcmd.h"
+
+/*
+ * Latencies go in log-linear buckets, as HdrHistogram does: values
+ * below METRICS_SUB microseconds get a bucket each, every power of two
+ * above is split into METRICS_SUB equal buckets, so a bucket is within
+ * 1/METRICS_SUB of any value in it, up to 2^METRICS_MAX_EXP us (19 h)
+ */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 36
+#define METRICS_BUCKETS (METRICS_SUB * (METRICS_MAX_EXP - METRICS_SUB_BITS + 1))
+#define METRICS_DUMP_INTERVAL 10 /* seconds between dumps unless set with -I */
+
+typedef struct Histogram
+{
+    uint32_t counts[METRICS_BUCKETS];
+    uint64_t total;
+    uint64_t sum;  /* of values, for the mean */
+    uint64_t max;
+} Histogram;
+
+/* counters of the whole server, summed over threads */
+typedef struct Metrics
+{
+    uint64_t commands[CMD_MAX_OPCODES]; /* by opcode, 0 for commands without one */
+    uint64_t errors[CMD_MAX_OPCODES];   /* commands answered 4xx or 5xx */
+    Histogram latency[CMD_MAX_OPCODES]; /* us from command parsed to done */
+    Histogram data_conn;                /* us to open a data connection */
+    uint64_t data_conn_errors;
+    uint64_t bytes_in;                  /* file and listing bytes received */
+    uint64_t bytes_out;                 /* file and listing bytes sent */
+    uint64_t sessions_opened;
+    uint64_t sessions_closed;
+} Metrics;
+
+/**
+ * Microseconds on the monotonic clock, to time what is recorded
+ * @return microseconds
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * Record a command done, in the calling thread's counters
+ * @param op Opcode of the command, 0 if none
+ * @param us Latency in microseconds
+ * @param failed Whether it was answered with an error
+ */
+void metrics_command(int op, uint64_t us, int failed);
+
+/**
+ * Record a data connection opened, or failing to open
+ * @param us Time it took in microseconds
+ * @param failed Whether it failed
+ */
+void metrics_data_conn(uint64_t us, int failed);
+
+/**
+ * Count bytes of a transfer
+ * @param in Bytes received
+ * @param out Bytes sent
+ */
+void metrics_bytes(uint64_t in, uint64_t out);
+
+/**
+ * Count a session starting or ending
+ * @param opened Non-zero if starting
+ */
+void metrics_session(int opened);
+
+/**
+ * Take a snapshot, summed over threads; threads keep counting meanwhile
+ * @param m Pointer to struct metrics to fill
+ */
+void metrics_snapshot(Metrics *m);
+
+/**
+ * Value at a quantile of a histogram, the highest value of its bucket
+ * @param h Pointer to histogram
+ * @param q Quantile, e.g. 0.99
+ * @return value, 0 if empty
+ */
+uint64_t metrics_quantile(const Histogram *h, double q);
+
+/**
+ * Print a snapshot: sessions, bytes, data connections and latency
+ * percentiles in microseconds of every command type seen
+ * @param out Stream to print to
+ */
+void metrics_print(FILE *out);
+
+/**
+ * Replace a file with a fresh snapshot, readers never see half of one
+ * @param path String file path
+ * @return 0, -1 if failed
+ */
+int metrics_dump(const char *path);
+
+#endif
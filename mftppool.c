@@ -0,0 +1,141 @@
+#include "mftppool.h"
+
+/**
+ * Nanoseconds elapsed since a monotonic timestamp
+ * @param since Pointer to earlier timestamp
+ * @return elapsed nanoseconds
+ */
+static unsigned long long elapsed_ns(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL
+           + now.tv_nsec - since->tv_nsec;
+}
+
+/**
+ * Worker thread: runs queued jobs forever
+ * @param _pool Pointer to pool
+ */
+static void *pool_worker(void *_pool)
+{
+    WorkPool *pool = (WorkPool *) _pool;
+    PoolJob job;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0)
+            pthread_cond_wait(&pool->nonempty, &pool->lock);
+
+        job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->depth;
+        pool->count--;
+
+        unsigned long long wait_ns = elapsed_ns(&job.enqueued);
+        pool->stats.wait_ns_total += wait_ns;
+        if (wait_ns > pool->stats.wait_ns_max)
+            pool->stats.wait_ns_max = wait_ns;
+        pthread_mutex_unlock(&pool->lock);
+
+        job.run(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.completed++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+WorkPool *ftp_pool_create(int nworkers, int depth)
+{
+    WorkPool *pool = (WorkPool *) calloc(1, sizeof(WorkPool));
+    if (pool == NULL)
+        return NULL;
+
+    pool->queue = (PoolJob *) calloc(depth, sizeof(PoolJob));
+    pool->workers = (pthread_t *) calloc(nworkers, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->workers == NULL)
+    {
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pool->depth = depth;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->nonempty, NULL);
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0)
+        {
+            perror("fail to start worker");
+            break;
+        }
+        pthread_detach(pool->workers[i]);
+        pool->nworkers++;
+    }
+
+    // workers are never torn down, so a pool without any is unusable
+    if (pool->nworkers == 0)
+    {
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int ftp_pool_submit(WorkPool *pool, void (*run)(void *), void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->depth)
+    {
+        pool->stats.rejected++;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    PoolJob *job = &pool->queue[(pool->head + pool->count) % pool->depth];
+    job->run = run;
+    job->arg = arg;
+    clock_gettime(CLOCK_MONOTONIC, &job->enqueued);
+
+    pool->count++;
+    pool->stats.submitted++;
+    if (pool->count > pool->stats.queued_peak)
+        pool->stats.queued_peak = pool->count;
+
+    pthread_cond_signal(&pool->nonempty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void ftp_pool_stats(WorkPool *pool, PoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->queued = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ftp_pool_print_stats(WorkPool *pool, FILE *out)
+{
+    PoolStats stats;
+    ftp_pool_stats(pool, &stats);
+
+    unsigned long dequeued = stats.submitted - stats.queued;
+    double avg_wait_us = dequeued ? stats.wait_ns_total / 1000.0 / dequeued : 0;
+
+    fprintf(out, "pool: workers %d depth %d queued %d (peak %d)\n",
+            pool->nworkers, pool->depth, stats.queued, stats.queued_peak);
+    fprintf(out, "pool: submitted %lu rejected %lu completed %lu\n",
+            stats.submitted, stats.rejected, stats.completed);
+    fprintf(out, "pool: queue wait avg %.1f us max %.1f us\n",
+            avg_wait_us, stats.wait_ns_max / 1000.0);
+}
@@ -0,0 +1,71 @@
+#ifndef MFTPPOOL_H
+#define MFTPPOOL_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "mftputil.h"
+
+typedef struct PoolJob
+{
+    void (*run)(void *arg);
+    void *arg;
+    struct timespec enqueued;
+} PoolJob;
+
+typedef struct PoolStats
+{
+    unsigned long submitted;
+    unsigned long rejected;
+    unsigned long completed;
+    unsigned long long wait_ns_total;
+    unsigned long long wait_ns_max;
+    int queued;
+    int queued_peak;
+} PoolStats;
+
+typedef struct WorkPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    PoolJob *queue; /* ring buffer of depth jobs */
+    int depth;
+    int head;
+    int count;
+    pthread_t *workers;
+    int nworkers;
+    PoolStats stats;
+} WorkPool;
+
+/**
+ * Start a fixed-size pool of worker threads
+ * @param nworkers Number of worker threads
+ * @param depth Maximum number of queued jobs
+ * @return pool, NULL if failed
+ */
+WorkPool *ftp_pool_create(int nworkers, int depth);
+
+/**
+ * Queue a job for the next idle worker
+ * @param pool Pointer to pool
+ * @param run Function to run
+ * @param arg Argument passed to run
+ * @return 0, -1 if queue is full
+ */
+int ftp_pool_submit(WorkPool *pool, void (*run)(void *), void *arg);
+
+/**
+ * Take a snapshot of pool counters
+ * @param pool Pointer to pool
+ * @param stats Pointer to struct pool stats to fill
+ */
+void ftp_pool_stats(WorkPool *pool, PoolStats *stats);
+
+/**
+ * Print pool counters
+ * @param pool Pointer to pool
+ * @param out Stream to print to
+ */
+void ftp_pool_print_stats(WorkPool *pool, FILE *out);
+
+#endif
@@ -0,0 +1,59 @@
+#include "mftpport.h"
+
+int port_pool_init(PortPool *pool, int low, int high)
+{
+    memset(pool, 0, sizeof(PortPool));
+    if (low < 1 || high > 65535 || high < low)
+        return -1;
+
+    pool->low = low;
+    pool->nports = high - low + 1;
+    pool->nwords = (pool->nports + 63) / 64;
+    pool->bits = (uint64_t *) calloc(pool->nwords, sizeof(uint64_t));
+    return pool->bits == NULL ? -1 : 0;
+}
+
+/**
+ * Mask of bits in a word that map to ports of the range
+ * @param pool Pointer to pool
+ * @param word Word index
+ * @return mask
+ */
+static uint64_t valid_bits(PortPool *pool, int word)
+{
+    int nbits = pool->nports - word * 64;
+    return nbits >= 64 ? ~0ULL : (1ULL << nbits) - 1;
+}
+
+int port_pool_acquire(PortPool *pool)
+{
+    if (pool->nports == 0)
+        return -1;
+
+    // start each caller at a different word so they rarely collide
+    int start = __atomic_fetch_add(&pool->cursor, 1, __ATOMIC_RELAXED) % pool->nwords;
+    for (int i = 0; i < pool->nwords; i++)
+    {
+        int word = (start + i) % pool->nwords;
+        uint64_t used = __atomic_load_n(&pool->bits[word], __ATOMIC_RELAXED);
+        uint64_t avail;
+        while ((avail = ~used & valid_bits(pool, word)) != 0)
+        {
+            uint64_t bit = avail & -avail;
+            // on failure used is reloaded and the next free bit tried
+            if (__atomic_compare_exchange_n(&pool->bits[word], &used, used | bit, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return pool->low + word * 64 + __builtin_ctzll(bit);
+        }
+    }
+
+    return -1;
+}
+
+void port_pool_release(PortPool *pool, int port)
+{
+    int idx = port - pool->low;
+    if (pool->nports == 0 || idx < 0 || idx >= pool->nports)
+        return;
+    __atomic_fetch_and(&pool->bits[idx / 64], ~(1ULL << (idx % 64)), __ATOMIC_RELEASE);
+}
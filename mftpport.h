@@ -0,0 +1,40 @@
+#ifndef MFTPPORT_H
+#define MFTPPORT_H
+
+#include <stdint.h>
+
+#include "mftputil.h"
+
+typedef struct PortPool
+{
+    int low;          /* first port of range */
+    int nports;       /* 0 if no range is configured */
+    int nwords;
+    uint64_t *bits;   /* one bit per port, set while in use */
+    unsigned cursor;  /* spreads concurrent acquirers over words */
+} PortPool;
+
+/**
+ * Set up a pool of ports [low, high]
+ * @param pool Pointer to pool
+ * @param low First port
+ * @param high Last port
+ * @return 0, -1 if range is invalid
+ */
+int port_pool_init(PortPool *pool, int low, int high);
+
+/**
+ * Take a free port without locking
+ * @param pool Pointer to pool
+ * @return port, -1 if all ports are in use
+ */
+int port_pool_acquire(PortPool *pool);
+
+/**
+ * Give a port back to the pool
+ * @param pool Pointer to pool
+ * @param port Port previously acquired
+ */
+void port_pool_release(PortPool *pool, int port);
+
+#endif
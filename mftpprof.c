@@ -0,0 +1,273 @@
+#include <pthread.h>
+#include <linux/tcp.h>
+
+#include "mftpprof.h"
+
+static const XferProfile profiles[] = {
+    { "default", XFER_BUF_SIZE, 0, 0, 0 },
+    // large chunks, corked sends, buffers left to autotuning
+    { "lan", BLOCK_PAYLOAD_MAX, 0, 1, 0 },
+    // long fat pipes: buffers past the autotuning ceiling where allowed
+    { "wan", BLOCK_PAYLOAD_MAX, 16 * 1024 * 1024, 1, 0 },
+    // start like default, grow to what the first megabytes show
+    { "auto", XFER_BUF_SIZE, 0, 1, 1 },
+};
+
+/* socket buffer limits of the host, -1 if unknown */
+static int wmem_max = -1, rmem_max = -1;   /* largest size a socket may set */
+static int wmem_auto = -1, rmem_auto = -1; /* largest size autotuning reaches */
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Read one field of a sysctl
+ * @param path String path under /proc/sys
+ * @param field Index of the field, for sysctls holding several
+ * @return value, -1 if unreadable
+ */
+static int read_sysctl(const char *path, int field)
+{
+    long values[3] = { -1, -1, -1 };
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    fscanf(fp, "%ld %ld %ld", &values[0], &values[1], &values[2]);
+    fclose(fp);
+    return values[field];
+}
+
+static void read_limits(void)
+{
+    wmem_max = read_sysctl("/proc/sys/net/core/wmem_max", 0);
+    rmem_max = read_sysctl("/proc/sys/net/core/rmem_max", 0);
+    wmem_auto = read_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2);
+    rmem_auto = read_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2);
+}
+
+/**
+ * Grow a socket buffer, unless autotuning gets there by itself
+ * @param sock Socket
+ * @param opt SO_SNDBUF or SO_RCVBUF
+ * @param size Size asked, the kernel doubles it for bookkeeping
+ */
+static void sock_buffer(int sock, int opt, int size)
+{
+    pthread_once(&limits_once, read_limits);
+    int max = opt == SO_SNDBUF ? wmem_max : rmem_max;
+    int autotune = opt == SO_SNDBUF ? wmem_auto : rmem_auto;
+    if (max > 0 && size > max)
+        size = max;
+
+    int cur;
+    socklen_t len = sizeof(cur);
+    if (size <= 0 || (long) size * 2 <= autotune
+        || (getsockopt(sock, SOL_SOCKET, opt, &cur, &len) == 0 && cur >= size * 2))
+        return;
+    if (setsockopt(sock, SOL_SOCKET, opt, &size, sizeof(size)) < 0)
+        perror("fail to size socket buffer");
+}
+
+/**
+ * Seconds elapsed since a point in time
+ * @param start Pointer to start time, CLOCK_MONOTONIC
+ * @return seconds
+ */
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Measure the path of a data connection and grow the profile's
+ * chunk and socket buffers to its bandwidth-delay product
+ * @param prof Pointer to transfer profile
+ * @param sock Socket for data
+ * @param bytes Bytes moved since the measurement started
+ * @param secs Seconds since the measurement started
+ * @param sending Whether this side sent the bytes
+ */
+static void xfer_profile_learn(XferProfile *prof, int sock, size_t bytes, double secs, int sending)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return;
+
+    // a sender knows its RTT and delivery rate, a receiver
+    // only its own RTT estimate and how fast data arrived
+    double rtt = (sending ? info.tcpi_rtt : info.tcpi_rcv_rtt) / 1e6;
+    double rate = sending && info.tcpi_delivery_rate > 0 ? info.tcpi_delivery_rate
+                                                         : (secs > 0 ? bytes / secs : 0);
+    double bdp = rate * rtt;
+    if (bdp <= 0)
+        return;
+
+    // only ever grow: one slow transfer must not starve the next
+    if (bdp * 2 > prof->sock_buf)
+        prof->sock_buf = bdp * 2 < PROF_MAX_SOCK_BUF ? (int) (bdp * 2) : PROF_MAX_SOCK_BUF;
+    while (prof->chunk_size < bdp && prof->chunk_size < BLOCK_PAYLOAD_MAX)
+        prof->chunk_size *= 2;
+}
+
+int xfer_profile_get(const char *name, XferProfile *prof)
+{
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        if (strcmp(name, profiles[i].name) == 0)
+        {
+            *prof = profiles[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void xfer_ctrl_socket(int sock)
+{
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int)) < 0)
+        perror("fail to set TCP_NODELAY");
+}
+
+void xfer_data_socket(const XferProfile *prof, int sock)
+{
+    sock_buffer(sock, SO_SNDBUF, prof->sock_buf);
+    sock_buffer(sock, SO_RCVBUF, prof->sock_buf);
+
+    // block mode keeps the connection, so the short last block of one
+    // transfer must not sit out a delayed ACK before the next command
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int)) < 0)
+        perror("fail to set TCP_NODELAY");
+}
+
+void xfer_cork(const XferProfile *prof, int sock, int on)
+{
+    if (prof->cork)
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**
+ * Send a range of a regular file, as blocks without BLOCK_EOF in block mode
+ */
+static ssize_t send_part(char *data, int size, int datasock, FILE *fp,
+                         off_t offset, size_t count, int block_mode)
+{
+    if (block_mode)
+        return send_range_blocks(data, size, datasock, fp, offset, count);
+    return read_send_range(data, size, datasock, fp, offset, count);
+}
+
+ssize_t xfer_send_range(XferProfile *prof, int datasock, FILE *fp,
+                        off_t offset, size_t count, int block_mode)
+{
+    // measurements grow the chunk for later transfers, not this one
+    int size = prof->chunk_size;
+    char *data = (char *) malloc(size);
+    if (data == NULL)
+    {
+        perror("fail to allocate transfer buffer");
+        return -1;
+    }
+    xfer_cork(prof, datasock, 1);
+
+    ssize_t total = 0, bytes;
+    size_t probe = 0;
+    if (prof->adaptive && count > PROF_PROBE_BYTES)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        probe = PROF_PROBE_BYTES;
+        total = send_part(data, size, datasock, fp, offset, probe, block_mode);
+        if (total == (ssize_t) probe)
+        {
+            xfer_profile_learn(prof, datasock, probe, seconds_since(&start), 1);
+            sock_buffer(datasock, SO_SNDBUF, prof->sock_buf);
+        }
+    }
+
+    // a short probe means the file shrank, nothing more to send
+    if (total == (ssize_t) probe)
+    {
+        bytes = send_part(data, size, datasock, fp, offset + probe, count - probe, block_mode);
+        total = bytes < 0 ? -1 : total + bytes;
+    }
+    if (total >= 0 && block_mode && send_block(datasock, BLOCK_EOF, NULL, 0) < 0)
+        total = -1;
+
+    xfer_cork(prof, datasock, 0);
+    free(data);
+    return total;
+}
+
+ssize_t xfer_send_file(XferProfile *prof, int datasock, FILE *fp, int block_mode, uint32_t *crc)
+{
+    struct stat st;
+    if (crc == NULL && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        off_t offset = ftello(fp);
+        return xfer_send_range(prof, datasock, fp, offset, st.st_size - offset, block_mode);
+    }
+
+    // pipes and devices have no size to probe, checksums need the data in hand
+    char *data = (char *) malloc(prof->chunk_size);
+    if (data == NULL)
+    {
+        perror("fail to allocate transfer buffer");
+        return -1;
+    }
+    xfer_cork(prof, datasock, 1);
+    ssize_t total;
+    if (crc != NULL)
+        total = read_send_crc(data, prof->chunk_size, datasock, fp, block_mode, crc);
+    else if (block_mode)
+        total = read_send_blocks(data, prof->chunk_size, datasock, fp);
+    else
+        total = read_send_file(data, prof->chunk_size, datasock, fp);
+    xfer_cork(prof, datasock, 0);
+    free(data);
+    return total;
+}
+
+ssize_t xfer_send_buffer(const XferProfile *prof, int datasock, const char *data,
+                         size_t len, int block_mode)
+{
+    size_t max = prof->chunk_size < BLOCK_PAYLOAD_MAX ? prof->chunk_size : BLOCK_PAYLOAD_MAX;
+    int failed = 0;
+    xfer_cork(prof, datasock, 1);
+    for (size_t off = 0; off < len && !failed; off += max)
+    {
+        size_t chunk = len - off < max ? len - off : max;
+        failed = block_mode ? send_block(datasock, 0, data + off, chunk) < 0
+                            : send_all(datasock, data + off, chunk) < 0;
+    }
+    if (!failed && block_mode)
+        failed = send_block(datasock, BLOCK_EOF, NULL, 0) < 0;
+    xfer_cork(prof, datasock, 0);
+    return failed ? -1 : (ssize_t) len;
+}
+
+ssize_t xfer_recv_file(XferProfile *prof, int datasock, FILE *fp, int block_mode, uint32_t *crc)
+{
+    char *data = (char *) malloc(prof->chunk_size);
+    if (data == NULL)
+    {
+        perror("fail to allocate transfer buffer");
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ssize_t total;
+    if (crc != NULL)
+        total = recv_save_crc(data, prof->chunk_size, datasock, fp, block_mode, crc);
+    else if (block_mode)
+        total = recv_save_blocks(data, prof->chunk_size, datasock, fp);
+    else
+        total = recv_save_file(data, prof->chunk_size, datasock, fp);
+    if (prof->adaptive && total > 0)
+        xfer_profile_learn(prof, datasock, total, seconds_since(&start), 0);
+
+    free(data);
+    return total;
+}
@@ -0,0 +1,105 @@
+#ifndef MFTPPROF_H
+#define MFTPPROF_H
+
+#include "mftputil.h"
+
+#define PROF_PROBE_BYTES (4 * 1024 * 1024) /* sent before the auto profile measures the path */
+#define PROF_MAX_SOCK_BUF (64 * 1024 * 1024)
+
+typedef struct XferProfile
+{
+    const char *name;
+    int chunk_size; /* bytes per read, splice and block */
+    int sock_buf;   /* SO_SNDBUF/SO_RCVBUF of data sockets, 0 to leave to autotuning */
+    int cork;       /* cork data sockets while sending */
+    int adaptive;   /* grow chunk and buffers to the measured bandwidth-delay product */
+} XferProfile;
+
+/**
+ * Look up a transfer profile: default, lan, wan or auto
+ * @param name String profile name
+ * @param prof Pointer to save a copy of the profile, the session's own
+ * @return 0, -1 if no such profile
+ */
+int xfer_profile_get(const char *name, XferProfile *prof);
+
+/**
+ * Tune a control socket: responses are small and awaited, so
+ * they go out at once instead of waiting on Nagle's algorithm
+ * @param sock Socket for commands
+ */
+void xfer_ctrl_socket(int sock);
+
+/**
+ * Size the buffers of a data socket before it connects or listens,
+ * only where the size is beyond what autotuning reaches by itself,
+ * since setting one turns autotuning off, and send without Nagle's algorithm
+ * @param prof Pointer to transfer profile
+ * @param sock Socket for data
+ */
+void xfer_data_socket(const XferProfile *prof, int sock);
+
+/**
+ * Cork a data socket while sending, if the profile does, so that
+ * small writes and block headers leave in full segments
+ * @param prof Pointer to transfer profile
+ * @param sock Socket for data
+ * @param on Non-zero to cork, zero to flush and uncork
+ */
+void xfer_cork(const XferProfile *prof, int sock, int on);
+
+/**
+ * Send a file in the profile's chunks, as blocks ending with BLOCK_EOF
+ * in block mode; with an adaptive profile, regular files send their first
+ * PROF_PROBE_BYTES, then the path is measured and the send buffer grown
+ * @param prof Pointer to transfer profile, updated by measurements
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param block_mode Whether to send blocks
+ * @param crc Pointer to CRC32C to continue over the data, NULL to keep
+ *            the zero-copy paths
+ * @return bytes sent, -1 if failed
+ */
+ssize_t xfer_send_file(XferProfile *prof, int datasock, FILE *fp, int block_mode, uint32_t *crc);
+
+/**
+ * Send count bytes of a regular file from offset, like xfer_send_file()
+ * @param prof Pointer to transfer profile, updated by measurements
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @param block_mode Whether to send blocks
+ * @return bytes sent, -1 if failed
+ */
+ssize_t xfer_send_range(XferProfile *prof, int datasock, FILE *fp,
+                        off_t offset, size_t count, int block_mode);
+
+/**
+ * Send a file held in memory in the profile's chunks, as blocks
+ * ending with BLOCK_EOF in block mode
+ * @param prof Pointer to transfer profile
+ * @param datasock Socket for data
+ * @param data File contents
+ * @param len Length of contents
+ * @param block_mode Whether to send blocks
+ * @return bytes sent, -1 if failed
+ */
+ssize_t xfer_send_buffer(const XferProfile *prof, int datasock, const char *data,
+                         size_t len, int block_mode);
+
+/**
+ * Receive a file in the profile's chunks, as blocks up to BLOCK_EOF in
+ * block mode; an adaptive profile measures the path once done, so the
+ * next data connections start with buffers to match
+ * @param prof Pointer to transfer profile, updated by measurements
+ * @param datasock Socket for data
+ * @param fp Pointer to file to save
+ * @param block_mode Whether to receive blocks
+ * @param crc Pointer to CRC32C to continue over the data, NULL to keep
+ *            the zero-copy paths
+ * @return bytes received, -1 if failed
+ */
+ssize_t xfer_recv_file(XferProfile *prof, int datasock, FILE *fp, int block_mode, uint32_t *crc);
+
+#endif
@@ -0,0 +1,380 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "mftpshape.h"
+
+/* a weighted claim on a capacity, see fill() */
+typedef struct FillItem
+{
+    uint64_t weight;
+    uint64_t cap;   /* most it can use, 0 if unlimited */
+    uint64_t share; /* what it is given, 0 if unlimited */
+    int settled;
+} FillItem;
+
+static ShapeGroup *groups;
+static uint64_t server_limit;
+static uint64_t default_user_limit;
+static int configured; /* some limit was set once, transfers from then on are shaped */
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ShapeFlow *current;
+static __thread ShapeFlow *waiting; /* transfer begun before any limit, not shaped yet */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t burst_of(uint64_t rate)
+{
+    uint64_t burst = rate * SHAPE_BURST_MS / 1000;
+    return burst > SHAPE_MIN_BURST ? burst : SHAPE_MIN_BURST;
+}
+
+/**
+ * Split a capacity by weight, max-min fair: an item capped below its
+ * share keeps its cap, and what it leaves is split again among the others
+ * @param items Array of items
+ * @param n Number of items
+ * @param capacity Bytes/s to split, 0 if unlimited
+ */
+static void fill(FillItem *items, int n, uint64_t capacity)
+{
+    uint64_t left = capacity, weight = 0;
+    for (int i = 0; i < n; i++)
+    {
+        items[i].settled = 0;
+        items[i].share = items[i].cap;
+        weight += items[i].weight;
+    }
+    if (capacity == 0)
+        return;
+
+    int settled;
+    do
+    {
+        settled = 0;
+        for (int i = 0; i < n; i++)
+        {
+            FillItem *it = &items[i];
+            if (!it->settled && it->cap > 0
+                && (double) it->cap * weight <= (double) left * it->weight)
+            {
+                it->settled = 1;
+                left -= it->cap;
+                weight -= it->weight;
+                settled = 1;
+            }
+        }
+    } while (settled && weight > 0);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (items[i].settled)
+            continue;
+        items[i].share = (double) left * items[i].weight / weight;
+        // a share rounded to nothing must not read as unlimited
+        if (items[i].share == 0)
+            items[i].share = 1;
+    }
+}
+
+/**
+ * Give every sending transfer its rate, shape lock held: users split the
+ * server limit by the weight of their transfers, then each user's share,
+ * within its own limit, is split among its transfers the same way
+ */
+static void rebalance(void)
+{
+    int ngroups = 0, nflows = 0;
+    for (ShapeGroup *group = groups; group != NULL; group = group->next)
+    {
+        if (group->flows != NULL)
+            ngroups++;
+        for (ShapeFlow *flow = group->flows; flow != NULL; flow = flow->next)
+            nflows++;
+    }
+    if (nflows == 0)
+        return;
+
+    // out of memory, transfers keep the rates they have
+    FillItem *items = (FillItem *) malloc((ngroups + nflows) * sizeof(FillItem));
+    if (items == NULL)
+        return;
+    FillItem *by_group = items, *by_flow = items + ngroups;
+
+    int g = 0;
+    for (ShapeGroup *group = groups; group != NULL; group = group->next)
+    {
+        if (group->flows == NULL)
+            continue;
+        FillItem *it = &by_group[g++];
+        uint64_t demand = 0;
+        int capped = 1;
+        it->weight = 0;
+        for (ShapeFlow *flow = group->flows; flow != NULL; flow = flow->next)
+        {
+            it->weight += flow->weight;
+            demand += flow->limit;
+            capped = capped && flow->limit > 0;
+        }
+        // a user whose transfers are all limited cannot use more than their sum
+        it->cap = group->limit;
+        if (capped && (it->cap == 0 || demand < it->cap))
+            it->cap = demand;
+    }
+    fill(by_group, ngroups, server_limit);
+
+    g = 0;
+    for (ShapeGroup *group = groups; group != NULL; group = group->next)
+    {
+        if (group->flows == NULL)
+            continue;
+        int n = 0;
+        for (ShapeFlow *flow = group->flows; flow != NULL; flow = flow->next, n++)
+        {
+            by_flow[n].weight = flow->weight;
+            by_flow[n].cap = flow->limit;
+        }
+        fill(by_flow, n, by_group[g++].share);
+
+        n = 0;
+        for (ShapeFlow *flow = group->flows; flow != NULL; flow = flow->next, n++)
+            __atomic_store_n(&flow->rate, by_flow[n].share, __ATOMIC_RELAXED);
+    }
+    free(items);
+}
+
+int shape_parse_rate(const char *str, uint64_t *rate)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str || errno != 0 || *str == '-')
+        return -1;
+
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+        shift = 10;
+    else if (*end == 'm' || *end == 'M')
+        shift = 20;
+    else if (*end == 'g' || *end == 'G')
+        shift = 30;
+    if (shift > 0)
+        end++;
+    if (*end != '\0' || value > (UINT64_MAX >> shift))
+        return -1;
+    *rate = (uint64_t) value << shift;
+    return 0;
+}
+
+/**
+ * Note that a limit was set, so transfers start being shaped
+ */
+static void shape_configure(uint64_t rate)
+{
+    if (rate > 0)
+        __atomic_store_n(&configured, 1, __ATOMIC_RELAXED);
+}
+
+void shape_server_limit(uint64_t rate)
+{
+    pthread_mutex_lock(&shape_lock);
+    server_limit = rate;
+    shape_configure(rate);
+    rebalance();
+    pthread_mutex_unlock(&shape_lock);
+}
+
+void shape_default_user_limit(uint64_t rate)
+{
+    pthread_mutex_lock(&shape_lock);
+    default_user_limit = rate;
+    shape_configure(rate);
+    pthread_mutex_unlock(&shape_lock);
+}
+
+ShapeGroup *shape_group(const char *name)
+{
+    pthread_mutex_lock(&shape_lock);
+    ShapeGroup *group = groups;
+    while (group != NULL && strcmp(group->name, name) != 0)
+        group = group->next;
+    if (group == NULL && (group = (ShapeGroup *) calloc(1, sizeof(ShapeGroup))) != NULL)
+    {
+        snprintf(group->name, sizeof(group->name), "%s", name);
+        group->limit = default_user_limit;
+        group->next = groups;
+        groups = group;
+    }
+    pthread_mutex_unlock(&shape_lock);
+    return group;
+}
+
+void shape_group_limit(ShapeGroup *group, uint64_t rate)
+{
+    pthread_mutex_lock(&shape_lock);
+    group->limit = rate;
+    shape_configure(rate);
+    rebalance();
+    pthread_mutex_unlock(&shape_lock);
+}
+
+void shape_flow_init(ShapeFlow *flow, ShapeGroup *group)
+{
+    memset(flow, 0, sizeof(ShapeFlow));
+    flow->group = group;
+    flow->weight = SHAPE_WEIGHT_DEFAULT;
+}
+
+void shape_flow_set(ShapeFlow *flow, uint64_t rate, int weight)
+{
+    pthread_mutex_lock(&shape_lock);
+    flow->limit = rate;
+    flow->weight = weight;
+    shape_configure(rate);
+    if (flow->sending)
+        rebalance();
+    pthread_mutex_unlock(&shape_lock);
+}
+
+/**
+ * Put a transfer of the calling thread under the scheduler
+ * @param flow Pointer to flow of the session
+ */
+static void shape_join(ShapeFlow *flow)
+{
+    waiting = NULL;
+    pthread_mutex_lock(&shape_lock);
+    flow->next = flow->group->flows;
+    flow->group->flows = flow;
+    flow->sending = 1;
+    rebalance();
+    pthread_mutex_unlock(&shape_lock);
+
+    // a transfer starts with a full bucket
+    flow->tokens = burst_of(__atomic_load_n(&flow->rate, __ATOMIC_RELAXED));
+    flow->stamp = now_ns();
+    current = flow;
+}
+
+/**
+ * Join the scheduler if the transfer of the calling thread began
+ * unshaped and a limit was set since; one relaxed load otherwise
+ */
+static void shape_check(void)
+{
+    if (waiting != NULL && __atomic_load_n(&configured, __ATOMIC_RELAXED))
+        shape_join(waiting);
+}
+
+void shape_begin(ShapeFlow *flow)
+{
+    if (flow->group == NULL)
+        return;
+
+    // without limits transfers skip the lock and the clock, and look
+    // for a first limit again on each send
+    if (!__atomic_load_n(&configured, __ATOMIC_RELAXED))
+        waiting = flow;
+    else
+        shape_join(flow);
+}
+
+void shape_end(ShapeFlow *flow)
+{
+    waiting = NULL;
+    if (!flow->sending)
+        return;
+    current = NULL;
+
+    pthread_mutex_lock(&shape_lock);
+    ShapeFlow **link = &flow->group->flows;
+    while (*link != flow)
+        link = &(*link)->next;
+    *link = flow->next;
+    flow->sending = 0;
+    rebalance();
+    pthread_mutex_unlock(&shape_lock);
+}
+
+int shape_limited(void)
+{
+    shape_check();
+    return current != NULL && __atomic_load_n(&current->rate, __ATOMIC_RELAXED) > 0;
+}
+
+size_t shape_quantum(size_t want)
+{
+    shape_check();
+    if (waiting != NULL)
+        return want < SHAPE_RECHECK_BYTES ? want : SHAPE_RECHECK_BYTES;
+
+    uint64_t rate;
+    if (current == NULL || (rate = __atomic_load_n(&current->rate, __ATOMIC_RELAXED)) == 0)
+        return want;
+    size_t burst = burst_of(rate);
+    return want < burst ? want : burst;
+}
+
+void shape_sent(size_t bytes)
+{
+    ShapeFlow *flow = current;
+    uint64_t rate;
+    if (flow == NULL || (rate = __atomic_load_n(&flow->rate, __ATOMIC_RELAXED)) == 0)
+        return;
+
+    // a bucket left alone for a second is full at any rate
+    uint64_t now = now_ns(), elapsed = now - flow->stamp;
+    if (elapsed > 1000000000)
+        elapsed = 1000000000;
+    flow->stamp = now;
+
+    int64_t burst = burst_of(rate);
+    flow->tokens += (double) elapsed * rate / 1e9;
+    if (flow->tokens > burst)
+        flow->tokens = burst;
+    flow->tokens -= bytes;
+    if (flow->tokens >= 0)
+        return;
+
+    // the time slept refills the bucket on the next send
+    uint64_t ns = (double) -flow->tokens * 1e9 / rate;
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * Print a rate in bytes/s, or "none" for no limit
+ */
+static void print_rate(FILE *out, const char *label, uint64_t rate)
+{
+    if (rate == 0)
+        fprintf(out, "%s none", label);
+    else
+        fprintf(out, "%s %lu B/s", label, (unsigned long) rate);
+}
+
+void shape_print(FILE *out)
+{
+    pthread_mutex_lock(&shape_lock);
+    print_rate(out, "shaping: server limit", server_limit);
+    fprintf(out, "\n");
+    for (ShapeGroup *group = groups; group != NULL; group = group->next)
+    {
+        fprintf(out, "user %s:", group->name);
+        print_rate(out, " limit", group->limit);
+        fprintf(out, "\n");
+        for (ShapeFlow *flow = group->flows; flow != NULL; flow = flow->next)
+        {
+            fprintf(out, "  transfer: weight %d", flow->weight);
+            print_rate(out, " limit", flow->limit);
+            print_rate(out, " rate", __atomic_load_n(&flow->rate, __ATOMIC_RELAXED));
+            fprintf(out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&shape_lock);
+}
@@ -0,0 +1,127 @@
+#ifndef MFTPSHAPE_H
+#define MFTPSHAPE_H
+
+#include "mftputil.h"
+
+#define SHAPE_WEIGHT_DEFAULT 10
+#define SHAPE_WEIGHT_MAX 100
+#define SHAPE_BURST_MS 50         /* bucket depth of a limited transfer, in ms of its rate */
+#define SHAPE_MIN_BURST (4 * 1024) /* bucket depth of very slow transfers */
+#define SHAPE_RECHECK_BYTES (64 * 1024 * 1024) /* unshaped send, between looks for a first limit */
+
+/* transfers of one user, sharing its limit */
+typedef struct ShapeGroup
+{
+    struct ShapeGroup *next; /* every group ever made, never freed */
+    char name[MAX_BUF_SIZE];
+    uint64_t limit;          /* bytes/s of all its transfers together, 0 if none */
+    struct ShapeFlow *flows; /* its transfers sending now */
+} ShapeGroup;
+
+/* egress of one session, a token bucket filled at the rate it is given */
+typedef struct ShapeFlow
+{
+    struct ShapeFlow *next; /* in its group's transfers sending now */
+    ShapeGroup *group;      /* user of the session, NULL before login */
+    uint64_t limit;         /* bytes/s of the session, 0 if none */
+    int weight;             /* share against other transfers, 1 to SHAPE_WEIGHT_MAX */
+    int sending;
+    uint64_t rate;          /* bytes/s given by the scheduler, 0 if unlimited */
+    int64_t tokens;         /* bytes that may go out now, negative when owed */
+    uint64_t stamp;         /* ns when tokens were last topped up */
+} ShapeFlow;
+
+/**
+ * Parse a rate in bytes/s, with an optional k, m or g suffix (powers of 1024)
+ * @param str String rate, "0" for no limit
+ * @param rate Pointer to save the rate
+ * @return 0, -1 if malformed
+ */
+int shape_parse_rate(const char *str, uint64_t *rate);
+
+/**
+ * Limit egress of the whole server, shared by weight among the transfers
+ * @param rate Bytes/s, 0 for no limit
+ */
+void shape_server_limit(uint64_t rate);
+
+/**
+ * Limit every user that has no limit of its own yet
+ * @param rate Bytes/s, 0 for no limit
+ */
+void shape_default_user_limit(uint64_t rate);
+
+/**
+ * The group of a user, made the first time it logs in
+ * @param name String user name
+ * @return group, NULL if out of memory
+ */
+ShapeGroup *shape_group(const char *name);
+
+/**
+ * Limit the transfers of a user together, shared by weight among them
+ * @param group Pointer to group of user
+ * @param rate Bytes/s, 0 for no limit
+ */
+void shape_group_limit(ShapeGroup *group, uint64_t rate);
+
+/**
+ * Set up the egress of a session, unlimited at default weight
+ * @param flow Pointer to flow
+ * @param group Pointer to group of user, NULL before login
+ */
+void shape_flow_init(ShapeFlow *flow, ShapeGroup *group);
+
+/**
+ * Limit a session and weigh it against others; a transfer already
+ * limited by anything takes the new rate from its next send
+ * @param flow Pointer to flow
+ * @param rate Bytes/s, 0 for no limit
+ * @param weight Share against other transfers, 1 to SHAPE_WEIGHT_MAX
+ */
+void shape_flow_set(ShapeFlow *flow, uint64_t rate, int weight);
+
+/**
+ * Start shaping what the calling thread sends for a transfer; while no
+ * limit was ever set this takes no lock, and the transfer joins the
+ * scheduler from the first send after a limit is set
+ * @param flow Pointer to flow of the session
+ */
+void shape_begin(ShapeFlow *flow);
+
+/**
+ * Stop shaping a transfer, giving its share to the others
+ * @param flow Pointer to flow of the session
+ */
+void shape_end(ShapeFlow *flow);
+
+/**
+ * Whether what the calling thread sends now is held to a rate, so must
+ * go out in pieces instead of one batch
+ * @return non-zero if so
+ */
+int shape_limited(void);
+
+/**
+ * Cap a send of the calling thread to what its bucket may hold; an
+ * unshaped transfer sends at most SHAPE_RECHECK_BYTES, so that it
+ * notices a limit set meanwhile
+ * @param want Bytes to send
+ * @return bytes to send at most, want outside transfers
+ */
+size_t shape_quantum(size_t want);
+
+/**
+ * Take bytes sent by the calling thread from its bucket, sleeping off
+ * any debt, so the next send keeps to the rate
+ * @param bytes Bytes sent
+ */
+void shape_sent(size_t bytes);
+
+/**
+ * Print the limits and what each sending transfer is given
+ * @param out Stream to print to
+ */
+void shape_print(FILE *out);
+
+#endif
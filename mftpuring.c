@@ -0,0 +1,603 @@
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include "mftpuring.h"
+
+/* slot state */
+#define SLOT_IDLE 0
+#define SLOT_READING 1   /* file -> buffer in flight */
+#define SLOT_FILLED 2    /* buffer holds file data, not sent yet */
+#define SLOT_SENDING 3   /* buffer -> socket in flight */
+#define SLOT_RECEIVING 4 /* socket -> buffer in flight */
+#define SLOT_WRITING 5   /* buffer -> file in flight */
+
+typedef struct UringXfer UringXfer;
+
+typedef struct UringSlot
+{
+    UringXfer *xfer;
+    char *buf;   /* registered buffer */
+    int buf_idx; /* index of registered buffer */
+    int state;
+    off_t off;   /* file offset of buffer data */
+    size_t len;  /* bytes the buffer holds or should hold */
+    size_t done; /* bytes of len read, sent or written so far */
+    int res;     /* completion result */
+    int ready;   /* completed, not yet processed */
+} UringSlot;
+
+struct UringXfer
+{
+    pthread_cond_t cond;
+    UringSlot slots[URING_XFER_DEPTH];
+    int inflight;
+    int nready;
+};
+
+typedef struct UringEngine
+{
+    int fd;
+    pthread_mutex_t lock; /* guards rings, free buffers and all transfers */
+    pthread_cond_t room;
+    unsigned inflight;
+    unsigned cq_entries;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *bufs;
+    int free_bufs[URING_NBUFS];
+    int nfree;
+    int has_statx; /* kernel takes IORING_OP_STATX */
+} UringEngine;
+
+static UringEngine engine;
+static int engine_ready = 0;
+
+/**
+ * Queues one operation and tells the kernel; engine lock held
+ * @param slot Slot the operation works on, completion goes back to it
+ * @param opcode IORING_OP_*
+ * @param fd File descriptor to operate on
+ * @param len Number of bytes from slot buffer + done
+ * @param off File offset, ignored for sockets
+ * @return 0, -1 if failed
+ */
+static int uring_submit(UringSlot *slot, int opcode, int fd, size_t len, off_t off)
+{
+    // never let completions outrun the completion queue
+    while (engine.inflight >= engine.cq_entries)
+        pthread_cond_wait(&engine.room, &engine.lock);
+
+    unsigned tail = *engine.sq_tail;
+    unsigned idx = tail & *engine.sq_mask;
+    struct io_uring_sqe *sqe = &engine.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) (slot->buf + slot->done);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t) slot;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED)
+        sqe->buf_index = slot->buf_idx;
+    if (opcode == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+
+    engine.sq_array[idx] = idx;
+    __atomic_store_n(engine.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, engine.fd, 1, 0, 0, NULL, 0) < 0)
+    {
+        // take the entry back so the kernel never sees it
+        __atomic_store_n(engine.sq_tail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    engine.inflight++;
+    slot->xfer->inflight++;
+    return 0;
+}
+
+/**
+ * Reaper thread: routes every completion to the transfer waiting for it
+ * @param arg Unused
+ */
+static void *uring_reap(void *arg)
+{
+    (void) arg;
+    while (1)
+    {
+        if (syscall(__NR_io_uring_enter, engine.fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    NULL, 0) < 0 && errno != EINTR)
+        {
+            perror("fail to wait for io_uring completions");
+            break;
+        }
+
+        pthread_mutex_lock(&engine.lock);
+        unsigned head = *engine.cq_head;
+        unsigned tail = __atomic_load_n(engine.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &engine.cqes[head & *engine.cq_mask];
+            UringSlot *slot = (UringSlot *) (uintptr_t) cqe->user_data;
+            slot->res = cqe->res;
+            slot->ready = 1;
+            slot->xfer->nready++;
+            slot->xfer->inflight--;
+            engine.inflight--;
+            pthread_cond_signal(&slot->xfer->cond);
+            head++;
+        }
+        __atomic_store_n(engine.cq_head, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&engine.room);
+        pthread_mutex_unlock(&engine.lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Checks that the kernel knows every opcode given
+ * @param fd io_uring file descriptor
+ * @param ops Array of IORING_OP_*
+ * @param nops Number of opcodes
+ * @return non-zero if supported
+ */
+static int uring_probe(int fd, const int *ops, size_t nops)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, len);
+    if (probe == NULL)
+        return 0;
+
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < nops; i++)
+    {
+        ok = ops[i] <= probe->last_op
+             && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+int uring_engine_init(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0)
+        return -1; // ENOSYS on old kernels, EPERM if disabled
+
+    const int ops[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                        IORING_OP_SEND, IORING_OP_RECV };
+    if (!uring_probe(fd, ops, sizeof(ops) / sizeof(ops[0])))
+    {
+        close(fd);
+        return -1;
+    }
+    // listings stat entries one by one without it
+    const int statx_op = IORING_OP_STATX;
+    engine.has_statx = uring_probe(fd, &statx_op, 1);
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_len > sq_len)
+        sq_len = cq_len;
+
+    char *sq_ring = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq_ring = single_mmap ? sq_ring
+                                : mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        perror("fail to map io_uring");
+        close(fd);
+        return -1;
+    }
+
+    engine.fd = fd;
+    engine.cq_entries = params.cq_entries;
+    engine.sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    engine.sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+    engine.sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    engine.sqes = sqes;
+    engine.cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    engine.cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    engine.cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+    engine.cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    // register all buffers once, so the kernel need not pin them per I/O
+    struct iovec iovs[URING_NBUFS];
+    if (posix_memalign((void **) &engine.bufs, 4096, (size_t) URING_NBUFS * URING_BUF_SIZE) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < URING_NBUFS; i++)
+    {
+        iovs[i].iov_base = engine.bufs + (size_t) i * URING_BUF_SIZE;
+        iovs[i].iov_len = URING_BUF_SIZE;
+        engine.free_bufs[i] = i;
+    }
+    engine.nfree = URING_NBUFS;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovs, URING_NBUFS) < 0)
+    {
+        perror("fail to register io_uring buffers");
+        free(engine.bufs);
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&engine.lock, NULL);
+    pthread_cond_init(&engine.room, NULL);
+
+    // the reaper must not take signals meant for other threads
+    sigset_t set, oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, uring_reap, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (rc != 0)
+    {
+        free(engine.bufs);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    engine_ready = 1;
+    return 0;
+}
+
+int uring_engine_enabled(void)
+{
+    return engine_ready;
+}
+
+/**
+ * Reserves registered buffers for a transfer; engine lock held
+ * @param xfer Pointer to transfer
+ * @return 0, -1 if the engine is out of buffers
+ */
+static int uring_xfer_begin(UringXfer *xfer)
+{
+    if (engine.nfree < URING_XFER_DEPTH)
+        return -1;
+
+    memset(xfer, 0, sizeof(UringXfer));
+    pthread_cond_init(&xfer->cond, NULL);
+    for (int i = 0; i < URING_XFER_DEPTH; i++)
+    {
+        UringSlot *slot = &xfer->slots[i];
+        slot->xfer = xfer;
+        slot->buf_idx = engine.free_bufs[--engine.nfree];
+        slot->buf = engine.bufs + (size_t) slot->buf_idx * URING_BUF_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * Waits out in-flight operations and releases buffers; engine lock held
+ * @param xfer Pointer to transfer
+ */
+static void uring_xfer_end(UringXfer *xfer)
+{
+    while (xfer->inflight > 0)
+        pthread_cond_wait(&xfer->cond, &engine.lock);
+
+    for (int i = 0; i < URING_XFER_DEPTH; i++)
+        engine.free_bufs[engine.nfree++] = xfer->slots[i].buf_idx;
+    pthread_cond_destroy(&xfer->cond);
+}
+
+ssize_t uring_send_file(int datasock, int fd, off_t offset, size_t count)
+{
+    if (!engine_ready)
+        return -2;
+
+    UringXfer xfer;
+    pthread_mutex_lock(&engine.lock);
+    if (uring_xfer_begin(&xfer) < 0)
+    {
+        pthread_mutex_unlock(&engine.lock);
+        return -2;
+    }
+
+    // slots are used in file order: head is the next one to send
+    int head = 0, nqueued = 0, sending = 0, eof = 0, failed = 0;
+    size_t to_read = count, total = 0;
+    off_t next_off = offset;
+
+    while (1)
+    {
+        // keep reads in flight ahead of the socket
+        while (!failed && !eof && to_read > 0 && nqueued < URING_XFER_DEPTH)
+        {
+            UringSlot *slot = &xfer.slots[(head + nqueued) % URING_XFER_DEPTH];
+            slot->off = next_off;
+            slot->len = to_read < URING_BUF_SIZE ? to_read : URING_BUF_SIZE;
+            slot->done = 0;
+            slot->state = SLOT_READING;
+            if (uring_submit(slot, IORING_OP_READ_FIXED, fd, slot->len, slot->off) < 0)
+            {
+                failed = 1;
+                break;
+            }
+            next_off += slot->len;
+            to_read -= slot->len;
+            nqueued++;
+        }
+
+        // sends stay in file order, one at a time
+        while (!failed && !sending && nqueued > 0 && xfer.slots[head].state == SLOT_FILLED)
+        {
+            UringSlot *slot = &xfer.slots[head];
+            if (slot->len == 0)
+            {
+                // read past a file that shrank
+                slot->state = SLOT_IDLE;
+                head = (head + 1) % URING_XFER_DEPTH;
+                nqueued--;
+                continue;
+            }
+            slot->done = 0;
+            slot->state = SLOT_SENDING;
+            if (uring_submit(slot, IORING_OP_SEND, datasock, slot->len, 0) < 0)
+                failed = 1;
+            else
+                sending = 1;
+        }
+
+        if (xfer.inflight == 0 && xfer.nready == 0)
+            break; // nothing left in flight, either done or failed
+
+        while (xfer.nready == 0)
+            pthread_cond_wait(&xfer.cond, &engine.lock);
+
+        for (int i = 0; i < URING_XFER_DEPTH; i++)
+        {
+            UringSlot *slot = &xfer.slots[i];
+            if (!slot->ready)
+                continue;
+            slot->ready = 0;
+            xfer.nready--;
+
+            if (slot->res < 0)
+            {
+                errno = -slot->res;
+                perror("fail to send data");
+                failed = 1;
+                continue;
+            }
+
+            if (slot->state == SLOT_READING)
+            {
+                slot->done += slot->res;
+                if (slot->res == 0)
+                {
+                    eof = 1;
+                    slot->len = slot->done;
+                }
+                if (slot->done < slot->len && !failed)
+                {
+                    if (uring_submit(slot, IORING_OP_READ_FIXED, fd,
+                                     slot->len - slot->done, slot->off + slot->done) < 0)
+                        failed = 1;
+                    continue;
+                }
+                slot->state = SLOT_FILLED;
+            }
+            else if (slot->state == SLOT_SENDING)
+            {
+                if (slot->res == 0)
+                {
+                    failed = 1;
+                    continue;
+                }
+                slot->done += slot->res;
+                if (slot->done < slot->len && !failed)
+                {
+                    if (uring_submit(slot, IORING_OP_SEND, datasock,
+                                     slot->len - slot->done, 0) < 0)
+                        failed = 1;
+                    continue;
+                }
+                total += slot->done;
+                slot->state = SLOT_IDLE;
+                head = (head + 1) % URING_XFER_DEPTH;
+                nqueued--;
+                sending = 0;
+            }
+        }
+    }
+
+    uring_xfer_end(&xfer);
+    pthread_mutex_unlock(&engine.lock);
+    return failed ? -1 : (ssize_t) total;
+}
+
+ssize_t uring_recv_file(int datasock, int fd, off_t offset)
+{
+    if (!engine_ready)
+        return -2;
+
+    UringXfer xfer;
+    pthread_mutex_lock(&engine.lock);
+    if (uring_xfer_begin(&xfer) < 0)
+    {
+        pthread_mutex_unlock(&engine.lock);
+        return -2;
+    }
+
+    int receiving = 0, eof = 0, failed = 0;
+    off_t write_off = offset;
+
+    while (1)
+    {
+        // one receive at a time keeps the stream in order,
+        // while writes of earlier buffers proceed in parallel
+        for (int i = 0; !failed && !eof && !receiving && i < URING_XFER_DEPTH; i++)
+        {
+            UringSlot *slot = &xfer.slots[i];
+            if (slot->state != SLOT_IDLE)
+                continue;
+            slot->done = 0;
+            slot->state = SLOT_RECEIVING;
+            if (uring_submit(slot, IORING_OP_RECV, datasock, URING_BUF_SIZE, 0) < 0)
+                failed = 1;
+            else
+                receiving = 1;
+        }
+
+        if (xfer.inflight == 0 && xfer.nready == 0)
+            break;
+
+        while (xfer.nready == 0)
+            pthread_cond_wait(&xfer.cond, &engine.lock);
+
+        for (int i = 0; i < URING_XFER_DEPTH; i++)
+        {
+            UringSlot *slot = &xfer.slots[i];
+            if (!slot->ready)
+                continue;
+            slot->ready = 0;
+            xfer.nready--;
+
+            if (slot->state == SLOT_RECEIVING)
+                receiving = 0;
+
+            if (slot->res < 0)
+            {
+                errno = -slot->res;
+                perror("fail to receive file");
+                failed = 1;
+                slot->state = SLOT_IDLE;
+                continue;
+            }
+
+            if (slot->state == SLOT_RECEIVING)
+            {
+                if (slot->res == 0)
+                {
+                    eof = 1;
+                    slot->state = SLOT_IDLE;
+                    continue;
+                }
+                slot->off = write_off;
+                slot->len = slot->res;
+                write_off += slot->res;
+                slot->state = SLOT_WRITING;
+                if (uring_submit(slot, IORING_OP_WRITE_FIXED, fd, slot->len, slot->off) < 0)
+                    failed = 1;
+            }
+            else if (slot->state == SLOT_WRITING)
+            {
+                slot->done += slot->res;
+                if (slot->done < slot->len && !failed)
+                {
+                    if (uring_submit(slot, IORING_OP_WRITE_FIXED, fd,
+                                     slot->len - slot->done, slot->off + slot->done) < 0)
+                        failed = 1;
+                    continue;
+                }
+                slot->state = SLOT_IDLE;
+            }
+        }
+    }
+
+    uring_xfer_end(&xfer);
+    pthread_mutex_unlock(&engine.lock);
+
+    // leave the file offset where a write() loop would have
+    lseek(fd, write_off, SEEK_SET);
+    return failed ? -1 : write_off - offset;
+}
+
+void uring_statx(int dirfd, const char **names, int n, int flags, unsigned mask,
+                 struct statx *stx, int *res)
+{
+    int done = 0;
+    if (engine_ready && engine.has_statx)
+    {
+        UringXfer wait;
+        UringSlot slots[URING_STATX_BATCH];
+        memset(&wait, 0, sizeof(wait));
+        pthread_cond_init(&wait.cond, NULL);
+
+        pthread_mutex_lock(&engine.lock);
+        while (done < n)
+        {
+            int batch = n - done < URING_STATX_BATCH ? n - done : URING_STATX_BATCH;
+            while (engine.inflight + batch > engine.cq_entries)
+                pthread_cond_wait(&engine.room, &engine.lock);
+
+            unsigned tail = *engine.sq_tail;
+            for (int i = 0; i < batch; i++)
+            {
+                unsigned idx = (tail + i) & *engine.sq_mask;
+                struct io_uring_sqe *sqe = &engine.sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = dirfd;
+                sqe->addr = (uintptr_t) names[done + i];
+                sqe->len = mask;
+                sqe->off = (uintptr_t) &stx[done + i];
+                sqe->statx_flags = flags;
+                sqe->user_data = (uintptr_t) &slots[i];
+                slots[i].xfer = &wait;
+                slots[i].ready = 0;
+                engine.sq_array[idx] = idx;
+            }
+            __atomic_store_n(engine.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+            // one system call for the whole batch; entries the kernel
+            // did not take are taken back and statted below
+            int submitted = syscall(__NR_io_uring_enter, engine.fd, batch, 0, 0, NULL, 0);
+            if (submitted < 0)
+                submitted = 0;
+            __atomic_store_n(engine.sq_tail, tail + submitted, __ATOMIC_RELEASE);
+            engine.inflight += submitted;
+            wait.inflight += submitted;
+
+            while (wait.inflight > 0)
+                pthread_cond_wait(&wait.cond, &engine.lock);
+            for (int i = 0; i < submitted; i++)
+                res[done + i] = slots[i].res;
+            done += submitted;
+            if (submitted < batch)
+                break;
+        }
+        pthread_mutex_unlock(&engine.lock);
+        pthread_cond_destroy(&wait.cond);
+    }
+
+    for (; done < n; done++)
+        res[done] = statx(dirfd, names[done], flags, mask, &stx[done]) < 0 ? -errno : 0;
+}
@@ -0,0 +1,58 @@
+#ifndef MFTPURING_H
+#define MFTPURING_H
+
+#include "mftputil.h"
+
+#define URING_ENTRIES 256           /* submission queue entries */
+#define URING_NBUFS 64              /* registered buffers shared by all transfers */
+#define URING_BUF_SIZE (128 * 1024) /* size of one registered buffer */
+#define URING_XFER_DEPTH 4          /* buffers in flight per transfer */
+#define URING_STATX_BATCH 64        /* statx calls submitted at once */
+
+/**
+ * Set up the shared io_uring transfer engine;
+ * on kernels without io_uring transfers keep the default path
+ * @return 0, -1 if io_uring is unavailable
+ */
+int uring_engine_init(void);
+
+/**
+ * Whether the io_uring engine is set up
+ * @return non-zero if enabled
+ */
+int uring_engine_enabled(void);
+
+/**
+ * Send a file range, keeping several reads in flight ahead of the send
+ * @param datasock Socket for data
+ * @param fd File descriptor to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed, -2 if engine cannot take the transfer
+ */
+ssize_t uring_send_file(int datasock, int fd, off_t offset, size_t count);
+
+/**
+ * Receive into a file until peer closes, keeping several writes in flight
+ * @param datasock Socket for data
+ * @param fd File descriptor to write
+ * @param offset Offset to start writing at
+ * @return bytes received, -1 if failed, -2 if engine cannot take the transfer
+ */
+ssize_t uring_recv_file(int datasock, int fd, off_t offset);
+
+/**
+ * Stat names in a directory, URING_STATX_BATCH of them per submission
+ * through the engine if enabled, else with statx() one by one
+ * @param dirfd Directory the names are in
+ * @param names Array of names
+ * @param n Number of names
+ * @param flags AT_* flags of statx()
+ * @param mask STATX_* fields wanted
+ * @param stx Array of n statuses to fill
+ * @param res Array of n results, 0 or -errno
+ */
+void uring_statx(int dirfd, const char **names, int n, int flags, unsigned mask,
+                 struct statx *stx, int *res);
+
+#endif
@@ -1,4 +1,9 @@
+#include <errno.h>
+
 #include "mftputil.h"
+#include "mftpuring.h"
+#include "mftphash.h"
+#include "mftpshape.h"
 
 void error_exit(char *message)
 {
@@ -6,7 +11,24 @@ void error_exit(char *message)
     exit(1);
 }
 
-int create_socket(int port)
+int create_socket(int port, int backlog)
+{
+    int lstnsocket = listen_socket(port, backlog);
+    if (lstnsocket < 0)
+    {
+        error_exit("fail to listen");
+    }
+    return lstnsocket;
+}
+
+/**
+ * Create a socket listening on port on every address
+ * @param port Port, 0 for any free port
+ * @param backlog Maximum length of pending connections
+ * @param reuseport Share the port with SO_REUSEPORT
+ * @return socket, -1 if failed
+ */
+static int make_listener(int port, int backlog, int reuseport)
 {
     int lstnsocket;
     struct sockaddr_in address;
@@ -16,73 +38,546 @@ int create_socket(int port)
 
     if ((lstnsocket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
-        error_exit("socket() fails");
+        perror("socket() fails");
+        return -1;
     }
 
     // for address reuse
     if (setsockopt(lstnsocket, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int)) < 0)
     {
+        perror("setsockopt() fails");
         close(lstnsocket);
-        error_exit("setsockopt() fails");
+        return -1;
+    }
+
+    if (reuseport && setsockopt(lstnsocket, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int)) < 0)
+    {
+        perror("setsockopt() fails");
+        close(lstnsocket);
+        return -1;
     }
 
     if (bind(lstnsocket, (struct sockaddr *) &address, sizeof(address)) < 0)
     {
+        perror("bind() fails");
         close(lstnsocket);
-        error_exit("bind() fails");
+        return -1;
     }
 
-    if (listen(lstnsocket, MAX_PENDING) < 0)
+    if (listen(lstnsocket, backlog) < 0)
     {
+        perror("listen() fails");
         close(lstnsocket);
-        error_exit("listen() fails");
+        return -1;
     }
 
     return lstnsocket;
 }
 
-void strtocmd(char *str, Command *cmd)
+int listen_socket(int port, int backlog)
+{
+    return make_listener(port, backlog, 0);
+}
+
+int reuseport_socket(int port, int backlog)
+{
+    return make_listener(port, backlog, 1);
+}
+
+void strtocmd(const char *str, Command *cmd)
 {
     memset(cmd->command, 0, sizeof(cmd->command));
     memset(cmd->arg, 0, sizeof(cmd->arg));
+    memcpy(&cmd->tag, str + MAX_BUF_SIZE - CMD_TAG_SIZE, CMD_TAG_SIZE);
+    cmd->tag = ntohl(cmd->tag);
+
+    // text stops at the tag; the argument is the rest
+    // of the line after the first space, it may hold spaces
+    size_t len = strnlen(str, MAX_BUF_SIZE - CMD_TAG_SIZE);
+    const char *space = memchr(str, ' ', len);
+    size_t name_len = space ? (size_t) (space - str) : len;
+
+    // names too long are left empty, to be refused
+    if (name_len < sizeof(cmd->command))
+        memcpy(cmd->command, str, name_len);
+    if (space != NULL)
+        memcpy(cmd->arg, space + 1, len - name_len - 1);
+}
+
+int send_all(int sock, const char *buf, size_t len)
+{
+    ssize_t bytes_sent;
+    while (len > 0)
+    {
+        if ((bytes_sent = send(sock, buf, shape_quantum(len), 0)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        shape_sent(bytes_sent);
+        buf += bytes_sent;
+        len -= bytes_sent;
+    }
+    return 0;
+}
+
+/**
+ * Send a file range from the page cache with sendfile()
+ * @param datasock Socket for data
+ * @param fd File descriptor to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed, -2 if sendfile() is unsupported
+ */
+static ssize_t sendfile_range(int datasock, int fd, off_t offset, size_t count)
+{
+    size_t total = 0;
+    ssize_t bytes_sent;
+    while (total < count)
+    {
+        // sendfile() may send less than asked, keep going from offset
+        if ((bytes_sent = sendfile(datasock, fd, &offset, shape_quantum(count - total))) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+                return -2;
+            perror("fail to send data");
+            return -1;
+        }
+        if (bytes_sent == 0)
+            break; // file shrank meanwhile
+        shape_sent(bytes_sent);
+        total += bytes_sent;
+    }
+    return total;
+}
+
+/**
+ * Send a file range with pread/send, for when sendfile() is unsupported
+ * @param datasock Socket for data
+ * @param fd File descriptor to read
+ * @param data Buffer
+ * @param size Buffer size
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed
+ */
+static ssize_t pread_send(int datasock, int fd, char *data, int size, off_t offset, size_t count)
+{
+    size_t total = 0;
+    ssize_t bytes_read;
+    while (total < count)
+    {
+        size_t chunk = count - total < (size_t) size ? count - total : (size_t) size;
+        if ((bytes_read = pread(fd, data, chunk, offset + total)) <= 0)
+            break;
+        if (send_all(datasock, data, bytes_read) < 0)
+        {
+            perror("fail to send data");
+            return -1;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
 
-    char *p = strtok(str, " ");
-    p = strtok(NULL, " ");
+ssize_t read_send_range(char *data, int size, int datasock, FILE *fp, off_t offset, size_t count)
+{
+    int fd = fileno(fp);
+    size_t total = 0;
+    ssize_t sent = -2;
 
-    strcpy(cmd->command, str);
-    if (p != NULL)
+    // a batch in flight cannot be paced, shaped transfers go piece by
+    // piece; unshaped ones stop between batches to look for a new limit
+    while (total < count && !shape_limited())
     {
-        strncpy(cmd->arg, p, strlen(p));
+        size_t piece = shape_quantum(count - total);
+        if ((sent = uring_send_file(datasock, fd, offset + total, piece)) < 0)
+            break;
+        total += sent;
+        if ((size_t) sent < piece)
+            return total; // file shrank meanwhile
     }
+    if (sent == -1)
+        return -1;
+    if (total == count)
+        return total;
+
+    sent = sendfile_range(datasock, fd, offset + total, count - total);
+    if (sent == -2)
+        sent = pread_send(datasock, fd, data, size, offset + total, count - total);
+    return sent < 0 ? -1 : (ssize_t) (total + sent);
 }
 
-void read_send_file(char *data, int size, int datasock, FILE *fp)
+ssize_t read_send_file(char *data, int size, int datasock, FILE *fp)
 {
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        off_t offset = ftello(fp);
+        return read_send_range(data, size, datasock, fp, offset, st.st_size - offset);
+    }
+
+    // fallback for pipes and devices
     size_t bytes_read;
-    memset(data, 0, size);
+    ssize_t total = 0;
     while ((bytes_read = fread(data, 1, size, fp)) > 0)
     {
-        if (send(datasock, data, bytes_read, 0) < 0)
+        if (send_all(datasock, data, bytes_read) < 0)
         {
             perror("fail to send data");
+            return -1;
+        }
+        total += bytes_read;
+    }
+    return total;
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t bytes_written;
+    while (len > 0)
+    {
+        if ((bytes_written = write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+/**
+ * Move up to limit bytes from a socket into a file through a pipe with splice()
+ * @param datasock Socket for data
+ * @param fd File descriptor to write
+ * @param limit Bytes to move at most, stops earlier if peer closes
+ * @param size Bytes to move per splice() call
+ * @return bytes received, -1 if failed, -2 if splice() is unsupported
+ */
+static ssize_t splice_to_file(int datasock, int fd, size_t limit, size_t size)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -2;
+
+    // best effort: a larger pipe means fewer round trips through it
+    fcntl(pipefd[1], F_SETPIPE_SZ, size);
+
+    ssize_t total = 0, bytes_in, bytes_out;
+    while ((size_t) total < limit)
+    {
+        size_t chunk = limit - total < size ? limit - total : size;
+        bytes_in = splice(datasock, NULL, pipefd[1], NULL, chunk,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (bytes_in == 0)
             break;
+        if (bytes_in < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+                total = -2;
+            else
+            {
+                perror("fail to receive file");
+                total = -1;
+            }
+            break;
+        }
+
+        // drain the pipe completely before reading the socket again
+        while (bytes_in > 0)
+        {
+            bytes_out = splice(pipefd[0], NULL, fd, NULL, bytes_in, SPLICE_F_MOVE);
+            if (bytes_out < 0 && errno == EINTR)
+                continue;
+            if (bytes_out <= 0)
+            {
+                perror("fail to save file");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            bytes_in -= bytes_out;
+            total += bytes_out;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+/**
+ * Move up to limit bytes from a socket into a file with recv/write,
+ * writing only full buffers but the last, so the file gets large
+ * writes at offsets aligned to the buffer size
+ * @param datasock Socket for data
+ * @param fd File descriptor to write
+ * @param data Buffer
+ * @param size Buffer size
+ * @param limit Bytes to move at most, stops earlier if peer closes
+ * @param crc Pointer to CRC32C to continue over the data, NULL if none
+ * @return bytes received, -1 if failed
+ */
+static ssize_t copy_to_file(int datasock, int fd, char *data, int size, size_t limit, uint32_t *crc)
+{
+    ssize_t bytes_rcvd, total = 0;
+    int eof = 0;
+    while (!eof && (size_t) total < limit)
+    {
+        size_t chunk = limit - total < (size_t) size ? limit - total : (size_t) size;
+        size_t filled = 0;
+        while (filled < chunk)
+        {
+            if ((bytes_rcvd = recv(datasock, data + filled, chunk - filled, 0)) == 0)
+            {
+                eof = 1;
+                break;
+            }
+            if (bytes_rcvd < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("fail to receive file");
+                return -1;
+            }
+            filled += bytes_rcvd;
+        }
+
+        if (write_all(fd, data, filled) < 0)
+        {
+            perror("fail to save file");
+            return -1;
+        }
+        if (crc != NULL)
+            *crc = crc32c(*crc, data, filled);
+        total += filled;
+    }
+    return total;
+}
+
+ssize_t recv_save_file(char *data, int size, int datasock, FILE *fp)
+{
+    int fd = fileno(fp);
+    fflush(fp);
+
+    ssize_t total = uring_recv_file(datasock, fd, lseek(fd, 0, SEEK_CUR));
+    if (total == -2)
+        total = splice_to_file(datasock, fd, SIZE_MAX, size);
+    if (total == -2)
+        total = copy_to_file(datasock, fd, data, size, SIZE_MAX, NULL);
+    return total;
+}
+
+/**
+ * Send the header of a block
+ * @param datasock Socket for data
+ * @param desc Block descriptor flags
+ * @param len Payload length that follows
+ * @return 0, -1 if failed
+ */
+static int send_block_header(int datasock, int desc, size_t len)
+{
+    unsigned char header[BLOCK_HEADER_SIZE];
+    uint32_t _len = htonl(len);
+    header[0] = desc;
+    memcpy(header + 1, &_len, sizeof(_len));
+
+    // hold the header back until the payload joins it
+    return send(datasock, header, sizeof(header), len > 0 ? MSG_MORE : 0)
+           == sizeof(header) ? 0 : -1;
+}
+
+int send_block(int datasock, int desc, const char *buf, size_t len)
+{
+    if (send_block_header(datasock, desc, len) < 0)
+        return -1;
+    return len > 0 ? send_all(datasock, buf, len) : 0;
+}
+
+ssize_t recv_block_header(int datasock, int *desc)
+{
+    unsigned char header[BLOCK_HEADER_SIZE];
+    uint32_t len;
+    if (recv(datasock, header, sizeof(header), MSG_WAITALL) != sizeof(header))
+        return -1;
+
+    *desc = header[0];
+    memcpy(&len, header + 1, sizeof(len));
+    return ntohl(len);
+}
+
+ssize_t send_range_blocks(char *data, int size, int datasock, FILE *fp,
+                          off_t offset, size_t count)
+{
+    int fd = fileno(fp);
+    ssize_t total = 0, bytes_sent;
+    off_t end = offset + count;
+    size_t max = size < BLOCK_PAYLOAD_MAX ? size : BLOCK_PAYLOAD_MAX;
+    while (offset < end)
+    {
+        size_t chunk = (size_t) (end - offset) < max ? (size_t) (end - offset) : max;
+        if (send_block_header(datasock, 0, chunk) < 0)
+            return -1;
+
+        bytes_sent = sendfile_range(datasock, fd, offset, chunk);
+        if (bytes_sent == -2)
+            bytes_sent = pread_send(datasock, fd, data, size, offset, chunk);
+
+        // the header promised chunk bytes: a file shrinking under us
+        // leaves the channel out of step, so give it up
+        if (bytes_sent != (ssize_t) chunk)
+            return -1;
+        offset += chunk;
+        total += chunk;
+    }
+    return total;
+}
+
+ssize_t read_send_range_blocks(char *data, int size, int datasock, FILE *fp,
+                               off_t offset, size_t count)
+{
+    ssize_t total = send_range_blocks(data, size, datasock, fp, offset, count);
+    if (total < 0 || send_block(datasock, BLOCK_EOF, NULL, 0) < 0)
+        return -1;
+    return total;
+}
+
+ssize_t read_send_blocks(char *data, int size, int datasock, FILE *fp)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        off_t offset = ftello(fp);
+        return read_send_range_blocks(data, size, datasock, fp, offset, st.st_size - offset);
+    }
+
+    ssize_t total = 0;
+    size_t bytes_read;
+    while ((bytes_read = fread(data, 1, size, fp)) > 0)
+    {
+        if (send_block(datasock, 0, data, bytes_read) < 0)
+            return -1;
+        total += bytes_read;
+    }
+
+    if (send_block(datasock, BLOCK_EOF, NULL, 0) < 0)
+        return -1;
+    return total;
+}
+
+ssize_t recv_save_blocks(char *data, int size, int datasock, FILE *fp)
+{
+    int fd = fileno(fp);
+    fflush(fp);
+
+    ssize_t total = 0, len, bytes_rcvd;
+    int desc = 0;
+    while (!(desc & BLOCK_EOF))
+    {
+        if ((len = recv_block_header(datasock, &desc)) < 0)
+        {
+            perror("fail to receive block");
+            return -1;
         }
-        memset(data, 0, size);
+        if (len == 0)
+            continue;
+
+        bytes_rcvd = splice_to_file(datasock, fd, len, size);
+        if (bytes_rcvd == -2)
+            bytes_rcvd = copy_to_file(datasock, fd, data, size, len, NULL);
+        if (bytes_rcvd != len)
+            return -1;
+        total += len;
     }
+    return total;
 }
 
-void recv_save_file(char *data, int size, int datasock, FILE *fp)
+ssize_t read_send_crc(char *data, int size, int datasock, FILE *fp, int block_mode, uint32_t *crc)
 {
-    memset(data, 0, MAX_BUF_SIZE);
-    ssize_t bytes_rcvd;
-    while ((bytes_rcvd = recv(datasock, data, size, 0)) > 0)
+    size_t max = size < BLOCK_PAYLOAD_MAX ? size : BLOCK_PAYLOAD_MAX;
+    size_t bytes_read;
+    ssize_t total = 0;
+    while ((bytes_read = fread(data, 1, max, fp)) > 0)
     {
-        fwrite(data, 1, bytes_rcvd, fp);
-        memset(data, 0, MAX_BUF_SIZE);
+        *crc = crc32c(*crc, data, bytes_read);
+        if ((block_mode ? send_block(datasock, 0, data, bytes_read)
+                        : send_all(datasock, data, bytes_read)) < 0)
+        {
+            perror("fail to send data");
+            return -1;
+        }
+        total += bytes_read;
     }
+    if (block_mode && send_block(datasock, BLOCK_EOF, NULL, 0) < 0)
+        return -1;
+    return total;
+}
+
+ssize_t recv_save_crc(char *data, int size, int datasock, FILE *fp, int block_mode, uint32_t *crc)
+{
+    int fd = fileno(fp);
+    fflush(fp);
+    if (!block_mode)
+        return copy_to_file(datasock, fd, data, size, SIZE_MAX, crc);
 
-    if (bytes_rcvd < 0)
+    ssize_t total = 0, len;
+    int desc = 0;
+    while (!(desc & BLOCK_EOF))
     {
-        perror("fail to receive file");
+        if ((len = recv_block_header(datasock, &desc)) < 0)
+        {
+            perror("fail to receive block");
+            return -1;
+        }
+        if (len > 0 && copy_to_file(datasock, fd, data, size, len, crc) != len)
+            return -1;
+        total += len;
     }
-}
\ No newline at end of file
+    return total;
+}
+
+void xfer_clock_start(XferClock *clock)
+{
+    struct rusage usage;
+    clock_gettime(CLOCK_MONOTONIC, &clock->wall);
+    getrusage(RUSAGE_THREAD, &usage);
+    timeradd(&usage.ru_utime, &usage.ru_stime, &clock->cpu);
+}
+
+void xfer_clock_report(FILE *out, ssize_t bytes, XferClock *clock)
+{
+    struct timespec now;
+    struct rusage usage;
+    struct timeval cpu;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_THREAD, &usage);
+    timeradd(&usage.ru_utime, &usage.ru_stime, &cpu);
+    timersub(&cpu, &clock->cpu, &cpu);
+
+    double wall_s = (now.tv_sec - clock->wall.tv_sec)
+                    + (now.tv_nsec - clock->wall.tv_nsec) / 1e9;
+    double cpu_s = cpu.tv_sec + cpu.tv_usec / 1e6;
+    double mb = bytes / 1e6;
+
+    fprintf(out, "%zd bytes in %.3f s (%.1f MB/s, %.1f MB per CPU-second)\n",
+            bytes, wall_s, wall_s > 0 ? mb / wall_s : 0,
+            cpu_s > 0 ? mb / cpu_s : 0);
+}
+
+int set_nonblocking(int sock, int on)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sock, F_SETFL, flags);
+}
@@ -13,18 +13,40 @@
 #define CODE_FILE_UNAVAIL 550
 #define CODE_CLOSE_DATA_CONN 226
 #define CODE_CMD_BAD_SEQ 503
+#define CODE_SERVICE_NOT_AVAIL 421
+#define CODE_ENTER_PASV 227
+#define CODE_FILE_STATUS 213
+#define CODE_NO_SPACE 452
 
 #define MAX_BUF_SIZE 512
+#define XFER_BUF_SIZE (256 * 1024) /* default chunk for splice and read/write loops */
 #define MAX_PENDING 5
 #define CLIENT_DATA_PORT 10240
+#define BLOCK_HEADER_SIZE 5             /* descriptor byte + 32-bit length */
+#define BLOCK_PAYLOAD_MAX (1024 * 1024) /* largest payload sent per block */
+#define BLOCK_EOF 0x40                  /* descriptor: last block of a transfer */
+#define BLOCK_DEFLATE 0x01              /* descriptor: payload is deflate compressed */
+#define BLOCK_DELTA_COPY 0x02           /* descriptor: payload names blocks of the old file */
+#define DATA_CONN_TIMEOUT 30000 /* ms to wait for a passive data connection */
+#define CMD_TAG_SIZE 4          /* tag closing each command message */
+#define RES_TAG_SHIFT 16        /* tag sits above the code in a response */
+#define RES_CODE_MASK 0xffff
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <endian.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -33,6 +55,7 @@ typedef struct Command
 {
     char command[5];
     char arg[MAX_BUF_SIZE];
+    uint32_t tag; /* echoed in responses if non-zero, for pipelining */
 } Command;
 
 /**
@@ -42,35 +65,214 @@ typedef struct Command
 void error_exit(char *message);
 
 /**
- * Create a listening socket
+ * Create a listening socket, die if failed
  * @param port Port
+ * @param backlog Maximum length of pending connections
  * @return socket
  */
-int create_socket(int port);
+int create_socket(int port, int backlog);
+
+/**
+ * Create a listening socket
+ * @param port Port, 0 for any free port
+ * @param backlog Maximum length of pending connections
+ * @return socket, -1 if failed
+ */
+int listen_socket(int port, int backlog);
 
 /**
- * Convert string to struct command
- * @param str String
+ * Create a listening socket that shares its port (SO_REUSEPORT) with the
+ * other sockets of the same user made this way, the kernel spreading
+ * connections over them
+ * @param port Port
+ * @param backlog Maximum length of pending connections
+ * @return socket, -1 if failed
+ */
+int reuseport_socket(int port, int backlog);
+
+/**
+ * Convert command message to struct command, the message being text
+ * padded with zeros to MAX_BUF_SIZE and closed by a 32-bit tag;
+ * the message is left as is, so it is safe from any thread
+ * @param str Command message
  * @param cmd Pointer to struct command
  */ 
-void strtocmd(char *str, Command *cmd);
+void strtocmd(const char *str, Command *cmd);
 
 /**
- * Read from file and send via data socket
- * @param data Buffer
+ * Send a whole buffer, retrying on partial sends, at the rate
+ * the calling thread is shaped to if any (see mftpshape.h)
+ * @param sock Socket
+ * @param buf Buffer
+ * @param len Number of bytes to send
+ * @return 0, -1 if failed
+ */
+int send_all(int sock, const char *buf, size_t len);
+
+/**
+ * Read from file and send via data socket,
+ * regular files go through the io_uring engine if enabled,
+ * else sendfile() without user space copies
+ * @param data Buffer, used only for non-regular files
  * @param size Buffer size
  * @param datasock Socket for data
  * @param fp Pointer to file to read
+ * @return bytes sent, -1 if failed
  */ 
-void read_send_file(char *data, int size, int datasock, FILE *fp);
+ssize_t read_send_file(char *data, int size, int datasock, FILE *fp);
 
 /**
- * Receive to buffer and save to file via data socket
- * @param data Buffer
+ * Send count bytes of a regular file from offset, through the io_uring
+ * engine if enabled, else sendfile(), else pread/send
+ * @param data Buffer, used only if sendfile() is unsupported
  * @param size Buffer size
  * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed
+ */
+ssize_t read_send_range(char *data, int size, int datasock, FILE *fp, off_t offset, size_t count);
+
+/**
+ * Receive via data socket and save to file, through the io_uring
+ * engine if enabled, else socket->pipe->file with splice() where supported
+ * @param data Buffer, used only if splice() is unsupported
+ * @param size Buffer size, also the chunk spliced per call
+ * @param datasock Socket for data
  * @param fp Pointer to file to save
+ * @return bytes received, -1 if failed
  */ 
-void recv_save_file(char *data, int size, int datasock, FILE *fp);
+ssize_t recv_save_file(char *data, int size, int datasock, FILE *fp);
+
+/**
+ * Write a whole buffer, retrying on partial writes
+ * @param fd File descriptor
+ * @param buf Buffer
+ * @param len Number of bytes to write
+ * @return 0, -1 if failed
+ */
+int write_all(int fd, const char *buf, size_t len);
+
+/**
+ * Send one block of a block-mode transfer
+ * @param datasock Socket for data
+ * @param desc Block descriptor flags, BLOCK_EOF on the last block
+ * @param buf Payload
+ * @param len Payload length
+ * @return 0, -1 if failed
+ */
+int send_block(int datasock, int desc, const char *buf, size_t len);
+
+/**
+ * Receive the header of the next block
+ * @param datasock Socket for data
+ * @param desc Pointer to save descriptor flags
+ * @return payload length that follows, -1 if failed
+ */
+ssize_t recv_block_header(int datasock, int *desc);
+
+/**
+ * Read from file and send as blocks ending with BLOCK_EOF,
+ * leaving the data socket open for the next transfer
+ * @param data Buffer, used only for non-regular files
+ * @param size Buffer size, also the largest block payload
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @return bytes sent, -1 if failed and channel is unusable
+ */
+ssize_t read_send_blocks(char *data, int size, int datasock, FILE *fp);
+
+/**
+ * Send count bytes of a regular file from offset as blocks, without BLOCK_EOF
+ * @param data Buffer, used only if sendfile() is unsupported
+ * @param size Buffer size, also the largest block payload
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed and channel is unusable
+ */
+ssize_t send_range_blocks(char *data, int size, int datasock, FILE *fp,
+                          off_t offset, size_t count);
+
+/**
+ * Send count bytes of a regular file from offset as blocks ending with BLOCK_EOF
+ * @param data Buffer, used only if sendfile() is unsupported
+ * @param size Buffer size, also the largest block payload
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param offset Offset to start from
+ * @param count Number of bytes to send
+ * @return bytes sent, -1 if failed and channel is unusable
+ */
+ssize_t read_send_range_blocks(char *data, int size, int datasock, FILE *fp,
+                               off_t offset, size_t count);
+
+/**
+ * Receive blocks up to BLOCK_EOF and save to file
+ * @param data Buffer, used only if splice() is unsupported
+ * @param size Buffer size, also the chunk spliced per call
+ * @param datasock Socket for data
+ * @param fp Pointer to file to save
+ * @return bytes received, -1 if failed and channel is unusable
+ */
+ssize_t recv_save_blocks(char *data, int size, int datasock, FILE *fp);
+
+/**
+ * Read from file and send like read_send_file(), or as blocks ending
+ * with BLOCK_EOF like read_send_blocks(), through user space so the
+ * data is checksummed on the way instead of in a pass of its own
+ * @param data Buffer
+ * @param size Buffer size, also the largest block payload
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param block_mode Whether to send blocks
+ * @param crc Pointer to CRC32C to continue over the data
+ * @return bytes sent, -1 if failed
+ */
+ssize_t read_send_crc(char *data, int size, int datasock, FILE *fp, int block_mode, uint32_t *crc);
+
+/**
+ * Receive and save to file like recv_save_file(), or blocks up to
+ * BLOCK_EOF like recv_save_blocks(), with recv/write so the data is
+ * checksummed on the way instead of in a pass of its own
+ * @param data Buffer
+ * @param size Buffer size
+ * @param datasock Socket for data
+ * @param fp Pointer to file to save
+ * @param block_mode Whether to receive blocks
+ * @param crc Pointer to CRC32C to continue over the data
+ * @return bytes received, -1 if failed
+ */
+ssize_t recv_save_crc(char *data, int size, int datasock, FILE *fp, int block_mode, uint32_t *crc);
+
+typedef struct XferClock
+{
+    struct timespec wall;
+    struct timeval cpu;
+} XferClock;
+
+/**
+ * Start timing a transfer in wall clock and thread CPU time
+ * @param clock Pointer to struct xfer clock
+ */
+void xfer_clock_start(XferClock *clock);
+
+/**
+ * Print throughput and bytes per CPU-second since xfer_clock_start()
+ * @param out Stream to print to
+ * @param bytes Bytes transferred
+ * @param clock Pointer to started struct xfer clock
+ */
+void xfer_clock_report(FILE *out, ssize_t bytes, XferClock *clock);
+
+/**
+ * Switch a socket between blocking and non-blocking mode
+ * @param sock Socket
+ * @param on Non-zero for non-blocking
+ * @return 0, -1 if failed
+ */
+int set_nonblocking(int sock, int on);
 
 #endif
\ No newline at end of file
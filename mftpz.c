@@ -0,0 +1,229 @@
+#include <zlib.h>
+
+#include "mftpz.h"
+
+int zmode_level(const char *mode)
+{
+    if (mode[0] != 'z' || (mode[1] != '\0' && mode[1] != ' '))
+        return 0;
+    if (mode[1] == '\0')
+        return ZMODE_DEFAULT_LEVEL;
+
+    char *end;
+    long level = strtol(mode + 2, &end, 10);
+    return end != mode + 2 && *end == '\0' && level >= 1 && level <= 9 ? level : -1;
+}
+
+/**
+ * Run deflate over the input it holds and send all it puts out as blocks
+ * @param zs Pointer to deflate stream
+ * @param flush Flush mode of deflate()
+ * @param out Buffer for output
+ * @param size Buffer size
+ * @param datasock Socket for data
+ * @param stats Pointer to stats
+ * @return 0, -1 if failed
+ */
+static int deflate_send(z_stream *zs, int flush, unsigned char *out, int size,
+                        int datasock, ZmodeStats *stats)
+{
+    do
+    {
+        zs->next_out = out;
+        zs->avail_out = size;
+        if (deflate(zs, flush) == Z_STREAM_ERROR)
+            return -1;
+
+        size_t have = size - zs->avail_out;
+        if (have > 0 && send_block(datasock, BLOCK_DEFLATE, (char *) out, have) < 0)
+            return -1;
+        stats->wire_bytes += have;
+    } while (zs->avail_out == 0);
+    return 0;
+}
+
+/**
+ * Compress a file into blocks, see zmode_send_file()
+ * @return 0, -1 if failed
+ */
+static int deflate_file(z_stream *zs, unsigned char *in, unsigned char *out, int size,
+                        int datasock, FILE *fp, ZmodeStats *stats)
+{
+    size_t bytes_read, want;
+    struct stat st;
+    while (1)
+    {
+        // the probe ends on a read of its own, to judge exactly it
+        want = size;
+        if (stats->file_bytes < ZMODE_PROBE_BYTES && want > ZMODE_PROBE_BYTES - stats->file_bytes)
+            want = ZMODE_PROBE_BYTES - stats->file_bytes;
+        if ((bytes_read = fread(in, 1, want, fp)) == 0)
+            break;
+        stats->file_bytes += bytes_read;
+
+        zs->next_in = in;
+        zs->avail_in = bytes_read;
+        if (deflate_send(zs, Z_NO_FLUSH, out, size, datasock, stats) < 0)
+            return -1;
+        if (stats->file_bytes != ZMODE_PROBE_BYTES)
+            continue;
+
+        // deflate holds output back, flush it to measure the ratio
+        if (deflate_send(zs, Z_SYNC_FLUSH, out, size, datasock, stats) < 0)
+            return -1;
+        if (stats->file_bytes >= stats->wire_bytes * ZMODE_MIN_RATIO)
+            continue;
+
+        // already compressed, like images: not worth the CPU
+        if (deflate_send(zs, Z_FINISH, out, size, datasock, stats) < 0)
+            return -1;
+        stats->gave_up = 1;
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            off_t offset = ftello(fp);
+            ssize_t rest = send_range_blocks((char *) in, size, datasock, fp,
+                                             offset, st.st_size - offset);
+            if (rest < 0)
+                return -1;
+            stats->file_bytes += rest;
+            stats->wire_bytes += rest;
+            return 0;
+        }
+        while ((bytes_read = fread(in, 1, size, fp)) > 0)
+        {
+            if (send_block(datasock, 0, (char *) in, bytes_read) < 0)
+                return -1;
+            stats->file_bytes += bytes_read;
+            stats->wire_bytes += bytes_read;
+        }
+        return 0;
+    }
+    return deflate_send(zs, Z_FINISH, out, size, datasock, stats);
+}
+
+ssize_t zmode_send_file(int level, int size, int datasock, FILE *fp, ZmodeStats *stats)
+{
+    ZmodeStats _stats;
+    if (stats == NULL)
+        stats = &_stats;
+    memset(stats, 0, sizeof(ZmodeStats));
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "fail to start deflate\n");
+        return -1;
+    }
+
+    ssize_t total = -1;
+    unsigned char *in = (unsigned char *) malloc(size);
+    unsigned char *out = (unsigned char *) malloc(size);
+    if (in == NULL || out == NULL)
+        perror("fail to allocate transfer buffer");
+    else if (deflate_file(&zs, in, out, size, datasock, fp, stats) == 0
+             && send_block(datasock, BLOCK_EOF, NULL, 0) == 0)
+        total = stats->file_bytes;
+
+    deflateEnd(&zs);
+    free(in);
+    free(out);
+    return total;
+}
+
+/**
+ * Receive blocks into a file, see zmode_recv_file()
+ * @return 0, -1 if failed
+ */
+static int inflate_blocks(z_stream *zs, unsigned char *in, unsigned char *out, int size,
+                          int datasock, int fd, ZmodeStats *stats)
+{
+    int desc = 0;
+    ssize_t len;
+    while (!(desc & BLOCK_EOF))
+    {
+        if ((len = recv_block_header(datasock, &desc)) < 0)
+        {
+            perror("fail to receive block");
+            return -1;
+        }
+
+        while (len > 0)
+        {
+            size_t chunk = len < size ? (size_t) len : (size_t) size;
+            if (recv(datasock, in, chunk, MSG_WAITALL) != (ssize_t) chunk)
+            {
+                perror("fail to receive block");
+                return -1;
+            }
+            len -= chunk;
+            stats->wire_bytes += chunk;
+
+            // plain blocks follow the deflate stream once the sender gave up
+            if (!(desc & BLOCK_DEFLATE))
+            {
+                stats->gave_up = 1;
+                if (write_all(fd, (char *) in, chunk) < 0)
+                {
+                    perror("fail to save file");
+                    return -1;
+                }
+                stats->file_bytes += chunk;
+                continue;
+            }
+
+            zs->next_in = in;
+            zs->avail_in = chunk;
+            do
+            {
+                zs->next_out = out;
+                zs->avail_out = size;
+                int rc = inflate(zs, Z_NO_FLUSH);
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+                {
+                    fprintf(stderr, "fail to inflate: %s\n", zs->msg ? zs->msg : "bad data");
+                    return -1;
+                }
+
+                size_t have = size - zs->avail_out;
+                if (write_all(fd, (char *) out, have) < 0)
+                {
+                    perror("fail to save file");
+                    return -1;
+                }
+                stats->file_bytes += have;
+            } while (zs->avail_out == 0);
+        }
+    }
+    return 0;
+}
+
+ssize_t zmode_recv_file(int size, int datasock, FILE *fp, ZmodeStats *stats)
+{
+    ZmodeStats _stats;
+    if (stats == NULL)
+        stats = &_stats;
+    memset(stats, 0, sizeof(ZmodeStats));
+    fflush(fp);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    {
+        fprintf(stderr, "fail to start inflate\n");
+        return -1;
+    }
+
+    ssize_t total = -1;
+    unsigned char *in = (unsigned char *) malloc(size);
+    unsigned char *out = (unsigned char *) malloc(size);
+    if (in == NULL || out == NULL)
+        perror("fail to allocate transfer buffer");
+    else if (inflate_blocks(&zs, in, out, size, datasock, fileno(fp), stats) == 0)
+        total = stats->file_bytes;
+
+    inflateEnd(&zs);
+    free(in);
+    free(out);
+    return total;
+}
@@ -0,0 +1,49 @@
+#ifndef MFTPZ_H
+#define MFTPZ_H
+
+#include "mftputil.h"
+
+#define ZMODE_DEFAULT_LEVEL 6
+#define ZMODE_PROBE_BYTES (128 * 1024) /* file bytes compressed before judging the ratio */
+#define ZMODE_MIN_RATIO 1.1            /* worse than this, the rest goes uncompressed */
+
+typedef struct ZmodeStats
+{
+    size_t file_bytes;  /* bytes of the file */
+    size_t wire_bytes;  /* payload bytes on the data connection */
+    int gave_up;        /* compression was switched off after the probe */
+} ZmodeStats;
+
+/**
+ * Parse the argument of "mode"
+ * @param mode String mode, "z" or "z <level>" for compression
+ * @return deflate level, 0 if not compressed, -1 if level is invalid
+ */
+int zmode_level(const char *mode);
+
+/**
+ * Send a file as blocks ending with BLOCK_EOF, compressing on the fly:
+ * payloads flagged BLOCK_DEFLATE are one raw deflate stream; after
+ * ZMODE_PROBE_BYTES, a ratio under ZMODE_MIN_RATIO ends the stream
+ * and the rest goes in plain blocks, with sendfile() if regular
+ * @param level Deflate level, 1 to 9
+ * @param size Chunk size, bytes read and sent at a time
+ * @param datasock Socket for data
+ * @param fp Pointer to file to read
+ * @param stats Pointer to save what was sent, may be NULL
+ * @return bytes of file sent, -1 if failed and channel is unusable
+ */
+ssize_t zmode_send_file(int level, int size, int datasock, FILE *fp, ZmodeStats *stats);
+
+/**
+ * Receive blocks up to BLOCK_EOF and save to file, inflating
+ * those flagged BLOCK_DEFLATE and writing the others as they are
+ * @param size Chunk size, bytes received at a time
+ * @param datasock Socket for data
+ * @param fp Pointer to file to save
+ * @param stats Pointer to save what was received, may be NULL
+ * @return bytes of file saved, -1 if failed and channel is unusable
+ */
+ssize_t zmode_recv_file(int size, int datasock, FILE *fp, ZmodeStats *stats);
+
+#endif
@@ -1,72 +1,333 @@
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
 
-#include "mftputil.h"
+#include "server.h"
+#include "mftpevent.h"
+#include "mftpfork.h"
+#include "mftppool.h"
+#include "mftpuring.h"
+#include "mftplist.h"
+#include "mftpcache.h"
 
-int ftp_server_response(int ctrlsock, int res_code);
-int authenticate_ftp_client(int ctrlsock);
-int ftp_server_data_conn(int ctrlsock);
+#define MODE_THREAD 0 /* one thread per connection */
+#define MODE_POOL 1   /* fixed worker pool fed by a bounded queue */
+#define MODE_EVENT 2  /* epoll event loops, transfers run on the pool */
 
-void ftp_server_dir(int ctrlsock, char *cmd);
-void ftp_server_chdir(int ctrlsock, char *dir);
-void ftp_server_get_file(int ctrlsock, char *fname);
-void ftp_server_put_file(int ctrlsock, char *fname);
+#define DEFAULT_QUEUE_DEPTH 64
+#define ACCEPT_BACKOFF_MS 100 /* pause after accept() ran out of descriptors */
 
-void *handle_ftp_client(void *ctrlsock); /* server runs in multi-thread */
-// void handle_ftp_client(int ctrlsock); /* server runs in multi-proc */
+
+void *handle_ftp_client(void *ctrlsock);
 
 // define access control
 const char USER[MAX_BUF_SIZE] = "user";
 const char PASS[MAX_BUF_SIZE] = "pass";
 
-int main(int argc, char const *argv[])
+// ports handed out for passive data connections
+PortPool pasv_ports;
+
+// log every command and disconnect to stdout
+int verbose;
+
+// fsync uploads before answering them
+int put_sync = SYNC_NONE;
+
+/**
+ * Runs a queued session on a pool worker
+ * @param ctrlsock Pointer to socket for commands
+ */
+static void serve_pooled(void *ctrlsock)
+{
+    handle_ftp_client(ctrlsock);
+}
+
+// seconds between rewrites of the metrics file
+static int metrics_interval = METRICS_DUMP_INTERVAL;
+
+/* every session, so a draining worker can close the idle ones */
+static Session *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -r and -u limits of this process, which "rate" may tighten but not lift, 0 if none */
+static uint64_t server_rate_cap, user_rate_cap;
+
+/**
+ * Dumps pool, cache and server metrics to stderr on every SIGUSR1
+ * @param _pool Pointer to pool, NULL in thread mode
+ */
+static void *dump_stats_on_signal(void *_pool)
+{
+    sigset_t set;
+    int sig;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while (sigwait(&set, &sig) == 0)
+    {
+        if (_pool != NULL)
+            ftp_pool_print_stats((WorkPool *) _pool, stderr);
+        file_cache_print_stats(stderr);
+        metrics_print(stderr);
+    }
+
+    return NULL;
+}
+
+/**
+ * Rewrites the metrics file every interval
+ * @param _path String file path
+ */
+static void *dump_metrics_periodically(void *_path)
+{
+    const char *path = (const char *) _path;
+    while (1)
+    {
+        sleep(metrics_interval);
+        if (metrics_dump(path) < 0)
+            perror("fail to write metrics");
+    }
+    return NULL;
+}
+
+int main(int argc, char *const argv[])
 {   
-    if (argc != 2)
+    int mode = MODE_THREAD;
+    int nloops = 1;
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int depth = DEFAULT_QUEUE_DEPTH;
+    int backlog = MAX_PENDING;
+    int use_uring = 0;
+    int nprocs = 0;
+    int pin = 0;
+    long cache_mb = FILE_CACHE_DEFAULT_MB;
+    int pasv_low, pasv_high;
+    char *metrics_path = NULL;
+    uint64_t server_rate = 0, user_rate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:t:w:q:b:e:p:c:M:I:r:u:d:P:av")) != -1)
     {
-        fprintf(stderr, "Usage: %s <port>", argv[0]);
+        switch (opt)
+        {
+            case 'm':
+                if (strcmp(optarg, "thread") == 0)
+                    mode = MODE_THREAD;
+                else if (strcmp(optarg, "pool") == 0)
+                    mode = MODE_POOL;
+                else if (strcmp(optarg, "event") == 0)
+                    mode = MODE_EVENT;
+                else
+                    mode = -1;
+                break;
+            case 't':
+                nloops = atoi(optarg);
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'p':
+                // passive port range low-high
+                if (sscanf(optarg, "%d-%d", &pasv_low, &pasv_high) != 2
+                    || port_pool_init(&pasv_ports, pasv_low, pasv_high) < 0)
+                    mode = -1;
+                break;
+            case 'c':
+                cache_mb = atol(optarg);
+                break;
+            case 'M':
+                metrics_path = optarg;
+                break;
+            case 'I':
+                metrics_interval = atoi(optarg);
+                break;
+            case 'r':
+                if (shape_parse_rate(optarg, &server_rate) < 0)
+                    mode = -1;
+                break;
+            case 'u':
+                if (shape_parse_rate(optarg, &user_rate) < 0)
+                    mode = -1;
+                break;
+            case 'd':
+                if (strcmp(optarg, "none") == 0)
+                    put_sync = SYNC_NONE;
+                else if (strcmp(optarg, "file") == 0)
+                    put_sync = SYNC_FILE;
+                else if (strcmp(optarg, "dir") == 0)
+                    put_sync = SYNC_DIR;
+                else
+                    mode = -1;
+                break;
+            case 'P':
+                nprocs = atoi(optarg);
+                break;
+            case 'a':
+                pin = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'e':
+                if (strcmp(optarg, "uring") == 0)
+                    use_uring = 1;
+                else if (strcmp(optarg, "default") != 0)
+                    mode = -1;
+                break;
+            default:
+                mode = -1;
+        }
+    }
+
+    if (mode < 0 || nloops < 1 || nworkers < 1 || depth < 1 || backlog < 1 || cache_mb < 0
+        || metrics_interval < 1 || nprocs < 0 || nprocs > FORK_MAX_WORKERS
+        || (nprocs > 0 && pasv_ports.nports > 0 && pasv_ports.nports < nprocs) || optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-m thread|pool|event] [-t loops] [-w workers]"
+                " [-q queue depth] [-b backlog] [-e default|uring] [-p pasv low-high]"
+                " [-c cache MiB] [-M metrics file] [-I dump seconds] [-r server bytes/s]"
+                " [-u user bytes/s] [-d none|file|dir] [-P processes [-a]] [-v] <port>\n", argv[0]);
         exit(1);
     }
 
-    int port = atoi(argv[1]);
-    // int pid, ctrlsock; /* decomment for multi-proc mode */
-    int lstnsock = create_socket(port);
-    if (lstnsock < 0)
+    // a client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int port = atoi(argv[optind]);
+    int slot = 0;
+    // with -P only worker processes come back, the supervisor stays inside
+    int lstnsock = nprocs > 0 ? fork_workers(nprocs, port, backlog, pin, &slot)
+                              : create_socket(port, backlog);
+
+    // workers split the passive range rather than race for the same ports
+    if (nprocs > 0 && pasv_ports.nports > 0)
+    {
+        int low = pasv_ports.low, span = pasv_ports.nports;
+        free(pasv_ports.bits);
+        if (port_pool_init(&pasv_ports, low + span * slot / nprocs, low + span * (slot + 1) / nprocs - 1) < 0)
+            error_exit("fail to split passive port range");
+    }
+
+    // each worker shapes on its own, so it gets its share of the limits
+    int share = nprocs > 0 ? nprocs : 1;
+    if (server_rate > 0)
+    {
+        server_rate_cap = server_rate / share > 0 ? server_rate / share : 1;
+        shape_server_limit(server_rate_cap);
+    }
+    if (user_rate > 0)
+    {
+        user_rate_cap = user_rate / share > 0 ? user_rate / share : 1;
+        shape_default_user_limit(user_rate_cap);
+    }
+
+    // only the stats thread may take SIGUSR1, and the draining thread
+    // SIGTERM, block them before any other starts
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (nprocs > 0)
+        sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // transfers keep the default path if the kernel lacks io_uring
+    if (use_uring && uring_engine_init() < 0)
+        fprintf(stderr, "io_uring unavailable, using default transfer engine\n");
+
+    // listings are still native without inotify, just never cached
+    if (list_cache_init() < 0)
+        fprintf(stderr, "inotify unavailable, listing cache disabled\n");
+
+    file_cache_init((size_t) cache_mb * 1024 * 1024);
+
+    WorkPool *pool = NULL;
+    if (mode != MODE_THREAD && (pool = ftp_pool_create(nworkers, depth)) == NULL)
+        error_exit("fail to create worker pool");
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dump_stats_on_signal, pool) == 0)
+        pthread_detach(tid);
+    // each worker process keeps metrics of its own, in <file>.<worker>
+    char worker_path[PATH_MAX];
+    if (metrics_path != NULL && nprocs > 0)
+    {
+        snprintf(worker_path, sizeof(worker_path), "%s.%d", metrics_path, slot);
+        metrics_path = worker_path;
+    }
+    if (metrics_path != NULL && pthread_create(&tid, NULL, dump_metrics_periodically, metrics_path) == 0)
+        pthread_detach(tid);
+    if (nprocs > 0)
+        fork_drain_on_signal(lstnsock, pool, ftp_server_close_idle);
+
+    if (mode == MODE_EVENT)
     {
+        if (ftp_event_serve(lstnsock, nloops, pool) < 0)
+            error_exit("fail to run event loops");
         close(lstnsock);
-        error_exit("fail to create listening socket");
+        return 0;
     }
 
     // run server
+    int starved = 0;
     while (1)
     {
         /*** multi-thread mode ***/
         int *ctrlsock = (int *) malloc(sizeof(int));
         if ((*ctrlsock = accept(lstnsock, NULL, NULL)) < 0)
-            break;
-        pthread_t pid;
-        pthread_create(&pid, NULL, handle_ftp_client, (void *) ctrlsock);
-
-        /*** ALTERNATIVE: multi-process mode ***/
-        /*
-        if ((ctrlsock = accept(lstnsock, NULL, NULL)) < 0)
         {
-            break;
+            int err = errno;
+            free(ctrlsock);
+            if (fork_draining())
+                break;
+
+            // out of descriptors: sessions ending free some, so wait for them
+            if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+            {
+                if (!starved)
+                    fprintf(stderr, "fail to accept: %s\n", strerror(err));
+                starved = 1;
+                struct timespec ts = { 0, ACCEPT_BACKOFF_MS * 1000000L };
+                nanosleep(&ts, NULL);
+            }
+            continue;
         }
-        if ((pid = fork()) < 0)
+        starved = 0;
+
+        /*** worker pool mode ***/
+        if (mode == MODE_POOL)
         {
-            close(ctrlsock);
-            error_exit("fail to fork child process");
+            // shed load rather than queue without bound
+            if (ftp_pool_submit(pool, serve_pooled, ctrlsock) < 0)
+            {
+                ftp_server_response(*ctrlsock, CODE_SERVICE_NOT_AVAIL);
+                close(*ctrlsock);
+                free(ctrlsock);
+            }
+            continue;
         }
-        else if (pid == 0)
+
+        pthread_t pid;
+        if (pthread_create(&pid, NULL, handle_ftp_client, (void *) ctrlsock) != 0)
         {
-            close(lstnsock); //TODO: check
-            handle_ftp_client(ctrlsock);
-            close(ctrlsock);
-            exit(0);
+            close(*ctrlsock);
+            free(ctrlsock);
+            continue;
         }
-        close(ctrlsock);
-        */
+        pthread_detach(pid);
     }
 
+    // the listener of a draining worker fails accept(), its sessions go on
+    fork_drain_wait();
     close(lstnsock);
     return 0;
 }
@@ -78,67 +339,269 @@ int main(int argc, char const *argv[])
 void *handle_ftp_client(void *_ctrlsock)
 {
     int ctrlsock = *(int *)_ctrlsock;
+    free(_ctrlsock);
+    xfer_ctrl_socket(ctrlsock);
     
+    Command cmd;
+    Session sess;
+    ftp_server_session_init(&sess, ctrlsock);
+
     // inform client that service is ready
     ftp_server_response(ctrlsock, CODE_SERVICE_READY);
 
-    // recv usr & pwd and authenticate
-    if (authenticate_ftp_client(ctrlsock))
-        ftp_server_response(ctrlsock, CODE_USR_LOGGED_IN);
+    int rc = 0;
+    while (rc >= 0)
+    {
+        // reads may split a command or hold several
+        // from a pipelining client, the parser keeps the rest
+        if ((rc = cmd_parser_next(&sess.parser, &cmd)) == 0)
+        {
+            ssize_t bytes_rcvd = cmd_parser_recv(&sess.parser, ctrlsock);
+            if (bytes_rcvd < 0 && errno == EINTR)
+                continue;
+            if (bytes_rcvd < 0)
+                perror("fail to receive command");
+            if (bytes_rcvd <= 0)
+                break;
+            continue;
+        }
+
+        if (rc > 0 && sess.state != SESS_CMD)
+            rc = ftp_server_login(&sess, &cmd);
+        else if (rc > 0)
+            rc = ftp_server_command(&sess, &cmd);
+    }
+
+    ftp_server_session_end(&sess);
+    if (verbose)
+        printf("Client disconnected\n");
+    return NULL;
+}
+
+/**
+ * Sets up a logged in session
+ * @param sess Pointer to session
+ * @param ctrlsock Socket for commands
+ */
+void ftp_server_session_init(Session *sess, int ctrlsock)
+{
+    memset(sess, 0, sizeof(Session));
+    sess->ctrlsock = ctrlsock;
+    sess->state = SESS_USER;
+    cmd_parser_init(&sess->parser);
+    sess->pasv_sock = -1;
+    sess->pasv_port = -1;
+    sess->datasock = -1;
+    sess->allo = -1;
+    xfer_profile_get("default", &sess->prof);
+    shape_flow_init(&sess->shape, NULL);
+    metrics_session(1);
+
+    pthread_mutex_lock(&sessions_lock);
+    sess->next = sessions;
+    if (sessions != NULL)
+        sessions->prev = sess;
+    sessions = sess;
+    pthread_mutex_unlock(&sessions_lock);
+
+    // sessions start in the directory the server was started in
+    if ((sess->dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        perror("fail to open working directory");
+}
+
+/**
+ * Closes every socket of a session and returns its passive port
+ * @param sess Pointer to session
+ */
+void ftp_server_session_end(Session *sess)
+{
+    pthread_mutex_lock(&sessions_lock);
+    if (sess->prev != NULL)
+        sess->prev->next = sess->next;
     else
+        sessions = sess->next;
+    if (sess->next != NULL)
+        sess->next->prev = sess->prev;
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (sess->datasock >= 0)
+        close(sess->datasock);
+    if (sess->pasv_sock >= 0)
+        close(sess->pasv_sock);
+    if (sess->pasv_port >= 0)
+        port_pool_release(&pasv_ports, sess->pasv_port);
+    if (sess->dirfd >= 0)
+        close(sess->dirfd);
+    close(sess->ctrlsock);
+    metrics_session(0);
+}
+
+/**
+ * Ends every session waiting for a command: its control connection is
+ * shut for reading, so the session sees the client hang up; sessions
+ * running a command finish it first
+ */
+void ftp_server_close_idle(void)
+{
+    pthread_mutex_lock(&sessions_lock);
+    for (Session *sess = sessions; sess != NULL; sess = sess->next)
     {
-        ftp_server_response(ctrlsock, CODE_INVALID_USR);
-        close(ctrlsock);
-        return NULL;
+        if (!__atomic_load_n(&sess->busy, __ATOMIC_ACQUIRE))
+            shutdown(sess->ctrlsock, SHUT_RD);
     }
+    pthread_mutex_unlock(&sessions_lock);
+}
 
-    char cmd_buffer[MAX_BUF_SIZE];
-    Command cmd;
-    
-    while (1)
+/**
+ * Logs a session in with "user" then "pass"; before that a client
+ * may send CMD_HELLO to switch the connection to framed commands
+ * @param sess Pointer to session
+ * @param cmd Pointer to struct command
+ * @return 0, -1 if session should end
+ */
+int ftp_server_login(Session *sess, Command *cmd)
+{
+    if (sess->state == SESS_USER && !sess->parser.framed
+        && strcmp(cmd->command, CMD_HELLO) == 0)
     {
-        memset(cmd_buffer, 0, MAX_BUF_SIZE);    
-        if (recv(ctrlsock, cmd_buffer, sizeof(cmd_buffer), 0) < 0)
-        {
-            perror("fail to receive command");
-            continue;
-        }
+        // the client waits for this before sending frames
+        sess->parser.framed = 1;
+        return ftp_server_response(sess->ctrlsock, CODE_VALID_CMD);
+    }
 
-        strtocmd(cmd_buffer, &cmd); // note: cmd_buffer tokenized
-        printf("Command received: %s %s\n", cmd.command, cmd.arg);
+    if (sess->state == SESS_USER)
+    {
+        sess->usr_ok = ftp_server_valid_user(cmd->arg);
+        sess->state = SESS_PASS;
+        return ftp_server_response(sess->ctrlsock, CODE_NEED_PASS);
+    }
 
-        // server operates & responds as per command
-        if (strcmp(cmd.command, "put") == 0)
-            ftp_server_put_file(ctrlsock, cmd.arg);
+    if (!sess->usr_ok || !ftp_server_valid_pass(cmd->arg))
+    {
+        ftp_server_response(sess->ctrlsock, CODE_INVALID_USR);
+        return -1;
+    }
+    sess->state = SESS_CMD;
+    sess->shape.group = shape_group(USER);
+    return ftp_server_response(sess->ctrlsock, CODE_USR_LOGGED_IN);
+}
 
-        else if (strcmp(cmd.command, "get") == 0)
-            ftp_server_get_file(ctrlsock, cmd.arg);
+/**
+ * Whether a command opens a data connection or reads whole files,
+ * and so may block
+ * @param cmd Pointer to struct command
+ * @return non-zero if so
+ */
+int ftp_server_is_transfer(Command *cmd)
+{
+    return strcmp(cmd->command, "put") == 0 || strcmp(cmd->command, "get") == 0
+           || strcmp(cmd->command, "rget") == 0 || strcmp(cmd->command, "nlst") == 0
+           || strcmp(cmd->command, "ls") == 0 || strcmp(cmd->command, "pwd") == 0
+           || strcmp(cmd->command, "mlsd") == 0 || strcmp(cmd->command, "dput") == 0
+           || strcmp(cmd->command, "hash") == 0 || strcmp(cmd->command, "stat") == 0
+           || strcmp(cmd->command, "mani") == 0;
+}
 
-        else if (strcmp(cmd.command, "ls") == 0 || strcmp(cmd.command, "pwd") == 0)
-            ftp_server_dir(ctrlsock, cmd.command);
+/**
+ * Operates & responds as per command
+ * @param sess Pointer to session
+ * @param cmd Pointer to struct command
+ * @return 0, -1 if session should end
+ */
+static int ftp_server_run(Session *sess, Command *cmd)
+{
+    // an announced size holds for the put right after it only
+    if (strcmp(cmd->command, "put") != 0 && strcmp(cmd->command, "allo") != 0)
+        sess->allo = -1;
 
-        else if (strcmp(cmd.command, "cd") == 0)
-            ftp_server_chdir(ctrlsock, cmd.arg);          
+    if (strcmp(cmd->command, "put") == 0)
+        ftp_server_put_file(sess, cmd->arg);
 
-        else if (strcmp(cmd.command, "quit") == 0)
-        {
-            if (ftp_server_response(ctrlsock, CODE_SERVICE_CLOSE_CTRL) < 0)
-            {
-                close(ctrlsock);
-                return NULL;
-            }
+    else if (strcmp(cmd->command, "dput") == 0)
+        ftp_server_delta_put(sess, cmd->arg);
 
-            break;
-        }
-        // invalid commands were intercepted at client side
-        // except for SIGINT (ctrl + C)
-        else
-            break;
+    else if (strcmp(cmd->command, "get") == 0)
+        ftp_server_get_file(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "rget") == 0)
+        ftp_server_get_range(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "size") == 0)
+        ftp_server_size(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "nlst") == 0)
+        ftp_server_name_list(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "mani") == 0)
+        ftp_server_manifest(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "ls") == 0 || strcmp(cmd->command, "pwd") == 0
+             || strcmp(cmd->command, "mlsd") == 0)
+        ftp_server_dir(sess, cmd->command);
+
+    else if (strcmp(cmd->command, "cd") == 0)
+        ftp_server_chdir(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "pasv") == 0)
+        ftp_server_passive(sess);
+
+    else if (strcmp(cmd->command, "port") == 0)
+        ftp_server_active(sess);
+
+    else if (strcmp(cmd->command, "mode") == 0)
+        ftp_server_mode(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "prof") == 0)
+        ftp_server_profile(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "hash") == 0)
+        ftp_server_hash(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "vrfy") == 0)
+        ftp_server_verify(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "stat") == 0)
+        ftp_server_stat(sess);
+
+    else if (strcmp(cmd->command, "rate") == 0)
+        ftp_server_rate(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "allo") == 0)
+        ftp_server_allocate(sess, cmd->arg);
+
+    else if (strcmp(cmd->command, "quit") == 0)
+    {
+        ftp_server_reply(sess, CODE_SERVICE_CLOSE_CTRL);
+        return -1;
     }
+    // invalid commands were intercepted at client side
+    // except for SIGINT (ctrl + C)
+    else
+        return -1;
 
-    close(ctrlsock);
-    printf("Client disconnected\n");
-    return NULL;
+    return 0;
+}
+
+/**
+ * Runs a command and records its latency and outcome
+ * @param sess Pointer to session
+ * @param cmd Pointer to struct command
+ * @return 0, -1 if session should end
+ */
+int ftp_server_command(Session *sess, Command *cmd)
+{
+    // stdout is shared by every session, so logging is opt-in
+    if (verbose)
+        printf("Command received: %s %s\n", cmd->command, cmd->arg);
+    sess->tag = cmd->tag;
+    sess->failed = 0;
+
+    __atomic_store_n(&sess->busy, 1, __ATOMIC_RELEASE);
+    uint64_t start = metrics_now_us();
+    int rc = ftp_server_run(sess, cmd);
+    metrics_command(cmd_opcode(cmd->command), metrics_now_us() - start, sess->failed);
+    __atomic_store_n(&sess->busy, 0, __ATOMIC_RELEASE);
+    return rc;
 }
 
 /**
@@ -159,47 +622,97 @@ int ftp_server_response(int ctrlsock, int res_code)
 }
 
 /**
- * Runs authentication process
- * @param ctrlsock Socket for commands
- * @return whether user is authenticated
- */ 
-int authenticate_ftp_client(int ctrlsock)
+ * Sends response code for the command being run; a command sent
+ * with a tag gets it back in the upper half of every response,
+ * so a client pipelining commands can match responses to them
+ * @param sess Pointer to session
+ * @param res_code Response code
+ * @return success or not
+ */
+int ftp_server_reply(Session *sess, int res_code)
 {
-    char buffer[MAX_BUF_SIZE];
-    Command login_cmd;
-    memset(buffer, 0, MAX_BUF_SIZE);
-    int vald_usrname, vald_password;
+    if (res_code >= 400)
+        sess->failed = 1;
+    int tag = sess->tag & RES_CODE_MASK;
+    return ftp_server_response(sess->ctrlsock, tag << RES_TAG_SHIFT | res_code);
+}
 
-    // recv username command to buffer
-    if (recv(ctrlsock, buffer, sizeof(buffer), 0) < 0)
-        error_exit("fail to receive username");
+/**
+ * Checks username against access control
+ * @param usrname String username
+ * @return whether username is valid
+ */
+int ftp_server_valid_user(char *usrname)
+{
+    return strcmp(usrname, USER) == 0;
+}
 
-    // get username into struct cmd and validate
-    strtocmd(buffer, &login_cmd);
-    vald_usrname = strcmp(login_cmd.arg, USER);
+/**
+ * Checks password against access control
+ * @param password String password
+ * @return whether password is valid
+ */
+int ftp_server_valid_pass(char *password)
+{
+    return strcmp(password, PASS) == 0;
+}
 
-    // ask client for password
-    if (ftp_server_response(ctrlsock, CODE_NEED_PASS) < 0)
-        error_exit("fail to ask for password");
-    
-    // repeat same procedure
-    memset(buffer, 0, MAX_BUF_SIZE);
-    if (recv(ctrlsock, buffer, sizeof(buffer), 0) < 0)
-        error_exit("fail to receive username");
-   
-    strtocmd(buffer, &login_cmd);
-    vald_password = strcmp(login_cmd.arg, PASS);
+/**
+ * Accepts the client's connection on the passive data port
+ * @param sess Pointer to session
+ * @return socket for data, -1 if failed
+ */
+static int ftp_server_accept_data(Session *sess)
+{
+    struct sockaddr_in ctrladdr, dataaddr;
+    socklen_t addrlen = sizeof(ctrladdr);
+    getpeername(sess->ctrlsock, (struct sockaddr *) &ctrladdr, &addrlen);
+
+    // one deadline for the whole wait, so neither signals nor other
+    // hosts connecting can stretch it
+    uint64_t deadline = metrics_now_us() + (uint64_t) DATA_CONN_TIMEOUT * 1000;
+    struct pollfd pfd = { .fd = sess->pasv_sock, .events = POLLIN };
+    while (1)
+    {
+        uint64_t now = metrics_now_us();
+        int left = now < deadline ? (int) ((deadline - now + 999) / 1000) : 0;
+        int ready = poll(&pfd, 1, left);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready == 0)
+            errno = ETIMEDOUT;
+        if (ready <= 0)
+            break;
+
+        addrlen = sizeof(dataaddr);
+        int datasock = accept(sess->pasv_sock, (struct sockaddr *) &dataaddr, &addrlen);
+        if (datasock < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (datasock < 0)
+            break;
+
+        // only the host on the control connection may take the data
+        if (dataaddr.sin_addr.s_addr == ctrladdr.sin_addr.s_addr)
+            return datasock;
+        close(datasock);
+    }
 
-    return (vald_usrname == 0) && (vald_password == 0);
+    perror("fail to accept data connection");
+    return -1;
 }
 
 /**
- * Connects to client's data port using address in command socket
- * @param ctrlsock Socket for commands
+ * Connects to client's data port using address in command socket,
+ * or accepts from client in passive mode
+ * @param sess Pointer to session
  * @return sockets for data, -1 if failed
  */ 
-int ftp_server_data_conn(int ctrlsock)
+int ftp_server_data_conn(Session *sess)
 {
+    if (sess->passive)
+        return ftp_server_accept_data(sess);
+
+    int ctrlsock = sess->ctrlsock;
     char buffer[1024];
     int datasock;
 
@@ -221,6 +734,7 @@ int ftp_server_data_conn(int ctrlsock)
         perror("fail to create data socket");
         return -1;
     }
+    xfer_data_socket(&sess->prof, datasock);
 
     // wait for ack from client who is opening data port
     if (recv(ctrlsock, &(int) {1}, sizeof(int), 0) < 0)
@@ -240,140 +754,1010 @@ int ftp_server_data_conn(int ctrlsock)
 }
 
 /**
- * Runs commands: ls, pwd
- * @param ctrlsock Socket for commands
- * @param cmd String command
- */ 
-void ftp_server_dir(int ctrlsock, char *cmd)
+ * Gets a data connection: the session's open one in block mode,
+ * else a new one
+ * @param sess Pointer to session
+ * @return socket for data, -1 if failed
+ */
+int ftp_server_open_data(Session *sess)
 {
-    int datasock;
-    FILE *output_stream;
-    char output_buffer[MAX_BUF_SIZE];
-    memset(output_buffer, 0, MAX_BUF_SIZE);
+    if (sess->block_mode && sess->datasock >= 0)
+        return sess->datasock;
 
-    // check if command can be executed
-    if ((output_stream = popen(cmd, "r")) == NULL)
-    {
-        perror("fail to execute command");
-        ftp_server_response(ctrlsock, CODE_CMD_NOT_IMPL);
-        return;
-    }
+    uint64_t start = metrics_now_us();
+    int datasock = ftp_server_data_conn(sess);
+    metrics_data_conn(metrics_now_us() - start, datasock < 0);
+    if (datasock < 0)
+        sess->failed = 1;
+    if (sess->block_mode && datasock >= 0)
+        sess->datasock = datasock;
+    return datasock;
+}
 
-    // tells client to open data port
-    ftp_server_response(ctrlsock, CODE_OPEN_DATA_CONN);
+/**
+ * Ends use of a data connection: stream mode closes it to mark end
+ * of file, block mode keeps it unless the transfer broke framing
+ * @param sess Pointer to session
+ * @param datasock Socket for data
+ * @param failed Whether the transfer failed
+ */
+void ftp_server_close_data(Session *sess, int datasock, int failed)
+{
+    if (failed)
+        sess->failed = 1;
+    if (sess->block_mode && !failed)
+        return;
+    if (datasock == sess->datasock)
+        sess->datasock = -1;
+    close(datasock);
+}
 
-    // connects to data port
-    if ((datasock = ftp_server_data_conn(ctrlsock)) < 0)
+/**
+ * Runs command "mode <b|s|z [level]>": block mode keeps one data
+ * connection for all transfers of the session, stream mode opens one
+ * per transfer, compressed mode is block mode with files deflated
+ * @param sess Pointer to session
+ * @param mode String mode
+ */
+void ftp_server_mode(Session *sess, char *mode)
+{
+    int zlevel = zmode_level(mode);
+    if (zlevel > 0 || strcmp(mode, "b") == 0)
     {
-        close(datasock);
-        pclose(output_stream);
-        return;
+        sess->block_mode = 1;
+        sess->zlevel = zlevel;
     }
-
-    // load stdout to buffer and send
-    while (fgets(output_buffer, MAX_BUF_SIZE, output_stream) != NULL)
+    else if (strcmp(mode, "s") == 0)
     {
-        if (send(datasock, output_buffer, strlen(output_buffer), 0) < 0)
+        sess->block_mode = 0;
+        sess->zlevel = 0;
+        if (sess->datasock >= 0)
         {
-            perror("fail to send data");
-            break;
+            close(sess->datasock);
+            sess->datasock = -1;
         }
-        memset(output_buffer, 0, MAX_BUF_SIZE);
     }
-
-    pclose(output_stream);
-    close(datasock);
+    else
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+    ftp_server_reply(sess, CODE_VALID_CMD);
 }
 
 /**
- * Runs command "cd <directory>"
- * @param ctrlsock Socket for commands
- * @param dir String directory
- */ 
-void ftp_server_chdir(int ctrlsock, char *dir)
+ * Runs command "prof <name>": picks the transfer profile of the session,
+ * which sizes chunks and socket buffers and corks data connections
+ * @param sess Pointer to session
+ * @param name String profile name
+ */
+void ftp_server_profile(Session *sess, char *name)
 {
-    if (chdir(dir) < 0)
+    if (xfer_profile_get(name, &sess->prof) < 0)
     {
-        perror("fail to execute command");
-        ftp_server_response(ctrlsock, CODE_CMD_NOT_IMPL);
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
     }
-    else
-        ftp_server_response(ctrlsock, CODE_VALID_CMD);
 
+    // data sockets open already follow from now on
+    if (sess->pasv_sock >= 0)
+        xfer_data_socket(&sess->prof, sess->pasv_sock);
+    if (sess->datasock >= 0)
+        xfer_data_socket(&sess->prof, sess->datasock);
+    ftp_server_reply(sess, CODE_VALID_CMD);
 }
 
+typedef struct DataOut
+{
+    Session *sess;
+    int datasock;
+    size_t sent;
+} DataOut;
+
 /**
- * Sends file to client
- * @param ctrlsock Socket for commands
- * @param fname String file name
- */ 
-void ftp_server_get_file(int ctrlsock, char *fname)
+ * Sends text over a data connection, as blocks in block mode
+ * @param _out Pointer to struct data out
+ * @param buf Text
+ * @param len Length of text
+ * @return 0, -1 if failed
+ */
+static int send_data(void *_out, const char *buf, size_t len)
 {
-    FILE *fp;
-    char data[MAX_BUF_SIZE];
-    memset(data, 0, MAX_BUF_SIZE);
+    DataOut *out = (DataOut *) _out;
+    out->sent += len;
+    if (!out->sess->block_mode)
+        return send_all(out->datasock, buf, len);
 
-    // check whether file exists
-    fp = fopen(fname, "r");
-    if (!fp)
+    size_t max = out->sess->prof.chunk_size;
+    while (len > 0)
     {
-        ftp_server_response(ctrlsock, CODE_FILE_UNAVAIL);
-        return;
+        size_t chunk = len < max ? len : max;
+        if (send_block(out->datasock, 0, buf, chunk) < 0)
+            return -1;
+        buf += chunk;
+        len -= chunk;
     }
+    return 0;
+}
 
-    // open data connection
-    ftp_server_response(ctrlsock, CODE_OPEN_DATA_CONN);
+/**
+ * Runs commands: ls, mlsd, pwd, in-process
+ * @param sess Pointer to session
+ * @param cmd String command
+ */ 
+void ftp_server_dir(Session *sess, char *cmd)
+{
     int datasock;
-    if ((datasock = ftp_server_data_conn(ctrlsock)) < 0)
+    int is_pwd = strcmp(cmd, "pwd") == 0;
+    char cwd[PATH_MAX + 1];
+    ssize_t cwd_len = 0;
+
+    // check if command can be executed
+    if (is_pwd)
     {
-        close(datasock);
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", sess->dirfd);
+        cwd_len = readlink(path, cwd, PATH_MAX);
+    }
+    if (sess->dirfd < 0 || cwd_len < 0)
+    {
+        perror("fail to execute command");
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
         return;
     }
 
-    // read file and send
-    read_send_file(data, MAX_BUF_SIZE, datasock, fp);
+    // tells client to open data port
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
 
-    // close
-    close(datasock);
-    fclose(fp);
-    ftp_server_response(ctrlsock, CODE_CLOSE_DATA_CONN);
+    // connects to data port
+    if ((datasock = ftp_server_open_data(sess)) < 0)
+        return;
+
+    DataOut out = { sess, datasock, 0 };
+    int failed;
+    xfer_cork(&sess->prof, datasock, 1);
+    if (is_pwd)
+    {
+        cwd[cwd_len++] = '\n';
+        failed = send_data(&out, cwd, cwd_len) < 0;
+    }
+    else
+    {
+        int format = strcmp(cmd, "mlsd") == 0 ? LIST_MLSD : LIST_NAMES;
+        failed = list_dir(sess->dirfd, format, send_data, &out) < 0;
+    }
+    if (failed)
+        perror("fail to send data");
+    else if (sess->block_mode)
+        failed = send_block(datasock, BLOCK_EOF, NULL, 0) < 0;
+    xfer_cork(&sess->prof, datasock, 0);
+    metrics_bytes(0, out.sent);
+
+    ftp_server_close_data(sess, datasock, failed);
 }
 
 /**
- * Saves file from client
- * @param ctrlsock Socket for commands
+ * Order names, for qsort()
+ */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/**
+ * Runs command "nlst": sends the names of regular files matching
+ * a pattern, one per line, like ls; wildcards apply to the last
+ * path component, which is matched in the session's directory
+ * @param sess Pointer to session
+ * @param pattern String pattern
+ */
+void ftp_server_name_list(Session *sess, char *pattern)
+{
+    // split "dir/pattern" into the directory and the pattern in it
+    char *slash = strrchr(pattern, '/');
+    char *base = slash ? slash + 1 : pattern;
+    char dir[MAX_BUF_SIZE];
+    if (slash == pattern)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int) (slash - pattern) : 1, slash ? pattern : ".");
+
+    int fd = openat(sess->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dp = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dp == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    // matching regular files, sorted like glob(3)
+    char **names = NULL;
+    size_t nnames = 0, cap = 0;
+    struct dirent *d;
+    struct stat st;
+    while ((d = readdir(dp)) != NULL)
+    {
+        if (fnmatch(base, d->d_name, FNM_PERIOD) != 0
+            || fstatat(dirfd(dp), d->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (nnames == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            char **grown = (char **) realloc(names, cap * sizeof(char *));
+            if (grown == NULL)
+                break;
+            names = grown;
+        }
+        if ((names[nnames] = strdup(d->d_name)) != NULL)
+            nnames++;
+    }
+    closedir(dp);
+
+    if (nnames == 0)
+    {
+        free(names);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+    qsort(names, nnames, sizeof(char *), compare_names);
+
+    // tells client to open data port
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock = ftp_server_open_data(sess);
+
+    char line[MAX_BUF_SIZE];
+    DataOut out = { sess, datasock, 0 };
+    int failed = datasock < 0;
+    if (!failed)
+        xfer_cork(&sess->prof, datasock, 1);
+    for (size_t i = 0; i < nnames; i++)
+    {
+        int len = slash ? snprintf(line, sizeof(line), "%.*s%s\n", (int) (base - pattern), pattern, names[i])
+                        : snprintf(line, sizeof(line), "%s\n", names[i]);
+        free(names[i]);
+        // too long for a command argument anyway
+        if (failed || len >= (int) sizeof(line))
+            continue;
+        failed = send_data(&out, line, len) < 0;
+    }
+    free(names);
+    if (datasock < 0)
+        return;
+
+    if (failed)
+        perror("fail to send data");
+    else if (sess->block_mode)
+        failed = send_block(datasock, BLOCK_EOF, NULL, 0) < 0;
+    xfer_cork(&sess->prof, datasock, 0);
+    metrics_bytes(0, out.sent);
+
+    ftp_server_close_data(sess, datasock, failed);
+}
+
+/**
+ * Runs command "mani [-c] <directory>": sends the manifest of every
+ * regular file under the directory, see list_tree(), with paths as
+ * seen from the session's directory; -c adds their CRC32C
+ * @param sess Pointer to session
+ * @param arg String argument
+ */
+void ftp_server_manifest(Session *sess, char *arg)
+{
+    int crc = strncmp(arg, "-c ", 3) == 0;
+    char *dir = crc ? arg + 3 : arg;
+
+    int fd = openat(sess->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    // paths go out under the directory as given, "." stays implicit
+    char prefix[MAX_BUF_SIZE];
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/')
+        len--;
+    if (strcmp(dir, ".") == 0 || strcmp(dir, "./") == 0)
+        prefix[0] = '\0';
+    else
+        snprintf(prefix, sizeof(prefix), "%.*s%s", (int) len, dir, dir[len - 1] == '/' ? "" : "/");
+
+    // tells client to open data port
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock = ftp_server_open_data(sess);
+    if (datasock < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    DataOut out = { sess, datasock, 0 };
+    xfer_cork(&sess->prof, datasock, 1);
+    int failed = list_tree(fd, prefix, crc, send_data, &out) < 0;
+    close(fd);
+    if (failed)
+        perror("fail to send data");
+    else if (sess->block_mode)
+        failed = send_block(datasock, BLOCK_EOF, NULL, 0) < 0;
+    xfer_cork(&sess->prof, datasock, 0);
+    metrics_bytes(0, out.sent);
+
+    ftp_server_close_data(sess, datasock, failed);
+}
+
+/**
+ * Runs command "cd <directory>"
+ * @param sess Pointer to session
+ * @param dir String directory
+ */ 
+void ftp_server_chdir(Session *sess, char *dir)
+{
+    // only this session moves, others keep their own directory
+    int dirfd = openat(sess->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+    {
+        perror("fail to execute command");
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+    }
+    else
+    {
+        close(sess->dirfd);
+        sess->dirfd = dirfd;
+        ftp_server_reply(sess, CODE_VALID_CMD);
+    }
+
+}
+
+/**
+ * Opens a file relative to the session's directory
+ * @param sess Pointer to session
+ * @param fname String file name
+ * @param flags Flags of open(2)
+ * @return pointer to file, NULL if failed
+ */
+FILE *ftp_server_fopen(Session *sess, const char *fname, int flags)
+{
+    int fd = openat(sess->dirfd, fname, flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+
+    FILE *fp = fdopen(fd, (flags & O_ACCMODE) == O_RDONLY ? "r" : "w");
+    if (fp == NULL)
+        close(fd);
+    return fp;
+}
+
+/**
+ * Keeps the CRC32C of a whole file taken during a transfer, so "hash"
+ * answers it without reading the file again
+ * @param fd File
+ * @param before Pointer to status of file before the transfer, NULL
+ *               if the transfer wrote it
+ * @param bytes Bytes transferred
+ * @param crc CRC32C of the bytes
+ */
+static void ftp_server_keep_crc(int fd, const struct stat *before, ssize_t bytes, uint32_t crc)
+{
+    // a file changed meanwhile has a CRC of no version at all
+    struct stat st;
+    if (bytes < 0 || fstat(fd, &st) < 0 || st.st_size != bytes)
+        return;
+    if (before && (before->st_size != st.st_size
+                   || before->st_mtim.tv_sec != st.st_mtim.tv_sec
+                   || before->st_mtim.tv_nsec != st.st_mtim.tv_nsec
+                   || before->st_ctim.tv_sec != st.st_ctim.tv_sec
+                   || before->st_ctim.tv_nsec != st.st_ctim.tv_nsec))
+        return;
+    hash_cache_store(&st, HASH_CRC32C, crc);
+}
+
+/**
+ * Sends file to client
+ * @param sess Pointer to session
  * @param fname String file name
  */ 
-void ftp_server_put_file(int ctrlsock, char *fname)
+void ftp_server_get_file(Session *sess, char *fname)
 {
-    // check whether fname exists
-    FILE *fp = fopen(fname, "r");
-    if (fp != NULL)
+    FILE *fp = NULL;
+
+    // hot files are sent from memory, without opening them
+    CachedFile *cached = sess->zlevel ? NULL : file_cache_get(sess->dirfd, fname);
+
+    // check whether file exists
+    if (!cached && !(fp = ftp_server_fopen(sess, fname, O_RDONLY)))
+    {
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    // open data connection
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock;
+    if ((datasock = ftp_server_open_data(sess)) < 0)
     {
-        // does not allow put existing file
-        // TODO: update policy
-        ftp_server_response(ctrlsock, CODE_CMD_BAD_SEQ);
+        file_cache_put(cached);
+        if (fp)
+            fclose(fp);
+        return;
+    }
+
+    // under vrfy, checksum on the way unless the digest is known already
+    struct stat st;
+    uint64_t digest;
+    uint32_t crc = 0;
+    int checksum = sess->verify && fp && !sess->zlevel && fstat(fileno(fp), &st) == 0
+                   && S_ISREG(st.st_mode) && hash_cache_lookup(&st, HASH_CRC32C, &digest) < 0;
+
+    // read file and send
+    ssize_t bytes;
+    shape_begin(&sess->shape);
+    if (cached)
+        bytes = xfer_send_buffer(&sess->prof, datasock, cached->data, cached->size, sess->block_mode);
+    else if (sess->zlevel)
+        bytes = zmode_send_file(sess->zlevel, sess->prof.chunk_size, datasock, fp, NULL);
+    else
+        bytes = xfer_send_file(&sess->prof, datasock, fp, sess->block_mode, checksum ? &crc : NULL);
+    shape_end(&sess->shape);
+    if (checksum)
+        ftp_server_keep_crc(fileno(fp), &st, bytes, crc);
+    if (bytes > 0)
+        metrics_bytes(0, bytes);
+
+    // close
+    ftp_server_close_data(sess, datasock, bytes < 0);
+    file_cache_put(cached);
+    if (fp)
         fclose(fp);
+    ftp_server_reply(sess, CODE_CLOSE_DATA_CONN);
+}
+
+/**
+ * Sends a byte range of a file to client, argument is
+ * "<offset> <length> <filename>"; lets a client fetch
+ * segments of one file over several sessions at once
+ * @param sess Pointer to session
+ * @param arg String offset, length and file name
+ */
+void ftp_server_get_range(Session *sess, char *arg)
+{
+    long long offset, length;
+    int fname_pos = 0;
+    if (sscanf(arg, "%lld %lld %n", &offset, &length, &fname_pos) != 2
+        || fname_pos == 0 || offset < 0 || length < 0)
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+
+    // only regular files have ranges
+    struct stat st;
+    FILE *fp = ftp_server_fopen(sess, arg + fname_pos, O_RDONLY);
+    if (!fp || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) || offset > st.st_size)
+    {
+        if (fp)
+            fclose(fp);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
         return;
     }
+    if (length > st.st_size - offset)
+        length = st.st_size - offset;
 
     // open data connection
-    ftp_server_response(ctrlsock, CODE_OPEN_DATA_CONN);
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
     int datasock;
-    if ((datasock = ftp_server_data_conn(ctrlsock)) < 0)
+    if ((datasock = ftp_server_open_data(sess)) < 0)
     {
-        close(datasock);
+        fclose(fp);
         return;
     }
 
-    // receive and write to file
-    fclose(fp);
-    fp = fopen(fname, "w");
-    char data[MAX_BUF_SIZE];
-    recv_save_file(data, MAX_BUF_SIZE, datasock, fp);
+    shape_begin(&sess->shape);
+    ssize_t bytes = xfer_send_range(&sess->prof, datasock, fp, offset, length, sess->block_mode);
+    shape_end(&sess->shape);
+    if (bytes > 0)
+        metrics_bytes(0, bytes);
 
     // close
-    close(datasock);
+    ftp_server_close_data(sess, datasock, bytes < 0);
     fclose(fp);
-    ftp_server_response(ctrlsock, CODE_CLOSE_DATA_CONN);
-}
\ No newline at end of file
+    ftp_server_reply(sess, CODE_CLOSE_DATA_CONN);
+}
+
+/**
+ * Runs command "size": replies 213 followed by the size of
+ * a regular file as a 64-bit integer in network byte order
+ * @param sess Pointer to session
+ * @param fname String file name
+ */
+void ftp_server_size(Session *sess, char *fname)
+{
+    struct stat st;
+    if (fstatat(sess->dirfd, fname, &st, 0) < 0 || !S_ISREG(st.st_mode))
+    {
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    uint64_t size = htobe64(st.st_size);
+    ftp_server_reply(sess, CODE_FILE_STATUS);
+    if (send_all(sess->ctrlsock, (char *) &size, sizeof(size)) < 0)
+        perror("fail to send file size");
+}
+
+/**
+ * Creates a hidden file next to another, to build its new content in;
+ * its name starts with LIST_TEMP_PREFIX so manifests leave it out
+ * @param sess Pointer to session
+ * @param fname String file name
+ * @param tmpname Buffer to save the name of the new file
+ * @param size Buffer size
+ * @param mode Permissions to create it with, less the umask
+ * @return file descriptor, -1 if failed
+ */
+static int ftp_server_mktemp(Session *sess, const char *fname, char *tmpname, size_t size,
+                             mode_t mode)
+{
+    static unsigned int counter;
+    const char *slash = strrchr(fname, '/');
+    int dirlen = slash ? slash - fname + 1 : 0;
+
+    for (int tries = 0; tries < 100; tries++)
+    {
+        unsigned int n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+        if (snprintf(tmpname, size, "%.*s" LIST_TEMP_PREFIX "%d.%u.%s", dirlen, fname,
+                     (int) getpid(), n, fname + dirlen) >= (int) size)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        int fd = openat(sess->dirfd, tmpname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
+
+/**
+ * Syncs the directory a file name is in, so a rename in it is on disk
+ * @param sess Pointer to session
+ * @param fname String file name
+ * @return 0, -1 if failed
+ */
+static int ftp_server_sync_dir(Session *sess, const char *fname)
+{
+    const char *slash = strrchr(fname, '/');
+    if (slash == NULL)
+        return fsync(sess->dirfd);
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - fname + 1), fname);
+    int fd = openat(sess->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/**
+ * Puts a file built aside in place of another, synced as -d asks
+ * @param sess Pointer to session
+ * @param fd File descriptor of the new file, -1 if it was synced and closed
+ * @param tmpname String name of the new file
+ * @param fname String name to give it
+ * @param replace Whether an existing file may be replaced, else
+ *                fails with EEXIST, also against a put racing this one
+ * @return 0, -1 if failed and the new file is still at tmpname
+ */
+static int ftp_server_commit(Session *sess, int fd, const char *tmpname, const char *fname,
+                             int replace)
+{
+    if (fd >= 0 && put_sync >= SYNC_FILE && fdatasync(fd) < 0)
+        return -1;
+
+    int rc;
+    if (replace)
+        rc = renameat(sess->dirfd, tmpname, sess->dirfd, fname);
+    else if ((rc = renameat2(sess->dirfd, tmpname, sess->dirfd, fname, RENAME_NOREPLACE)) < 0
+             && (errno == EINVAL || errno == ENOSYS))
+    {
+        // filesystems without RENAME_NOREPLACE: a link fails on an existing name too
+        if ((rc = linkat(sess->dirfd, tmpname, sess->dirfd, fname, 0)) == 0)
+            unlinkat(sess->dirfd, tmpname, 0);
+    }
+    if (rc < 0)
+        return -1;
+
+    // the file is in place whatever happens now
+    if (put_sync >= SYNC_DIR && ftp_server_sync_dir(sess, fname) < 0)
+        perror("fail to sync directory");
+    return 0;
+}
+
+/**
+ * Runs command "allo <bytes>": announces the size of the next put,
+ * which then gets its disk space in one piece before any data comes
+ * @param sess Pointer to session
+ * @param arg String size in bytes
+ */
+void ftp_server_allocate(Session *sess, char *arg)
+{
+    long long size;
+    char end;
+    if (sscanf(arg, "%lld%c", &size, &end) != 1 || size < 0)
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+    sess->allo = size;
+    ftp_server_reply(sess, CODE_VALID_CMD);
+}
+
+/**
+ * Saves file from client: it is built in a hidden file, preallocated
+ * to the size "allo" announced, and renamed into place once whole, so
+ * readers never see part of it; existing files are never replaced,
+ * "dput" updates them
+ * @param sess Pointer to session
+ * @param fname String file name
+ */ 
+void ftp_server_put_file(Session *sess, char *fname)
+{
+    off_t announced = sess->allo;
+    sess->allo = -1;
+
+    // refuse early, the rename refuses again if one appears meanwhile
+    struct stat st;
+    if (fstatat(sess->dirfd, fname, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        ftp_server_reply(sess, CODE_CMD_BAD_SEQ);
+        return;
+    }
+
+    char tmpname[PATH_MAX];
+    int fd = ftp_server_mktemp(sess, fname, tmpname, sizeof(tmpname), 0644);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (fp == NULL)
+    {
+        perror("fail to create file");
+        if (fd >= 0)
+        {
+            close(fd);
+            unlinkat(sess->dirfd, tmpname, 0);
+        }
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    // the whole file in as few extents as the filesystem can give,
+    // so it is not fragmented by the writes and reads back sequentially
+    if (announced > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, announced) < 0
+        && (errno == ENOSPC || errno == EFBIG))
+    {
+        fclose(fp);
+        unlinkat(sess->dirfd, tmpname, 0);
+        ftp_server_reply(sess, CODE_NO_SPACE);
+        return;
+    }
+
+    // open data connection
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock;
+    if ((datasock = ftp_server_open_data(sess)) < 0)
+    {
+        fclose(fp);
+        unlinkat(sess->dirfd, tmpname, 0);
+        return;
+    }
+
+    ssize_t bytes;
+    uint32_t crc = 0;
+    int checksum = sess->verify && !sess->zlevel;
+    if (sess->zlevel)
+        bytes = zmode_recv_file(sess->prof.chunk_size, datasock, fp, NULL);
+    else
+        bytes = xfer_recv_file(&sess->prof, datasock, fp, sess->block_mode, checksum ? &crc : NULL);
+    if (bytes > 0)
+        metrics_bytes(bytes, 0);
+    ftp_server_close_data(sess, datasock, bytes < 0);
+
+    // in stream mode a client dying looks like the end of the file,
+    // so a file of another size than announced is not whole
+    if (announced >= 0 && bytes >= 0 && bytes != announced)
+        bytes = -1;
+
+    // a write failing only at close keeps the name free
+    struct stat written;
+    if (bytes >= 0 && (fflush(fp) != 0 || fstat(fd, &written) < 0
+                       || (put_sync >= SYNC_FILE && fdatasync(fd) < 0)))
+        bytes = -1;
+    if (fclose(fp) != 0)
+    {
+        perror("fail to close file");
+        bytes = -1;
+    }
+    if (bytes < 0 || ftp_server_commit(sess, -1, tmpname, fname, 0) < 0)
+    {
+        int code = bytes >= 0 && errno == EEXIST ? CODE_CMD_BAD_SEQ : CODE_FILE_UNAVAIL;
+        unlinkat(sess->dirfd, tmpname, 0);
+        ftp_server_reply(sess, code);
+        return;
+    }
+
+    // the rename changed the ctime, so the digest is kept for the file
+    // under its new name, as long as it is still the one written
+    if (checksum && fstatat(sess->dirfd, fname, &st, AT_SYMLINK_NOFOLLOW) == 0
+        && st.st_dev == written.st_dev && st.st_ino == written.st_ino && st.st_size == bytes)
+        hash_cache_store(&st, HASH_CRC32C, crc);
+    ftp_server_reply(sess, CODE_CLOSE_DATA_CONN);
+}
+
+/**
+ * Runs command "hash": replies 213 followed by a 64-bit digest in network
+ * byte order, CRCs in the low 32 bits; argument is
+ * "<crc32c|xxh64> [<offset> <length>] <filename>"
+ * @param sess Pointer to session
+ * @param arg String algorithm, optional range and file name
+ */
+void ftp_server_hash(Session *sess, char *arg)
+{
+    char name[16];
+    int alg, pos = 0, range_pos = 0;
+    long long offset = 0, length = -1;
+    if (sscanf(arg, "%15s %n", name, &pos) != 1 || (alg = hash_alg(name)) < 0)
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+
+    char *fname = arg + pos;
+    if (sscanf(fname, "%lld %lld %n", &offset, &length, &range_pos) == 2 && range_pos > 0)
+    {
+        if (offset < 0 || length < 0)
+        {
+            ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+            return;
+        }
+        fname += range_pos;
+    }
+    else
+        offset = 0, length = -1;
+
+    uint64_t digest;
+    int fd = openat(sess->dirfd, fname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || hash_file(fd, alg, offset, length < 0 ? HASH_WHOLE : (size_t) length, &digest) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+    close(fd);
+
+    uint64_t _digest = htobe64(digest);
+    ftp_server_reply(sess, CODE_FILE_STATUS);
+    if (send_all(sess->ctrlsock, (char *) &_digest, sizeof(_digest)) < 0)
+        perror("fail to send digest");
+}
+
+/**
+ * Runs command "vrfy": "on" makes get and put checksum whole files
+ * on the way, through user space instead of the zero-copy paths,
+ * so the "hash crc32c" that follows costs no pass over the file
+ * @param sess Pointer to session
+ * @param arg String "on" or "off"
+ */
+void ftp_server_verify(Session *sess, char *arg)
+{
+    if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+    sess->verify = strcmp(arg, "on") == 0;
+    ftp_server_reply(sess, CODE_VALID_CMD);
+}
+
+/**
+ * Runs command "stat": sends the server metrics over the data
+ * connection as text, like a listing
+ * @param sess Pointer to session
+ */
+void ftp_server_stat(Session *sess)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL)
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+    metrics_print(out);
+    shape_print(out);
+    fclose(out);
+
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock;
+    if ((datasock = ftp_server_open_data(sess)) < 0)
+    {
+        free(text);
+        return;
+    }
+
+    DataOut data = { sess, datasock, 0 };
+    int failed = send_data(&data, text, len) < 0;
+    if (!failed && sess->block_mode)
+        failed = send_block(datasock, BLOCK_EOF, NULL, 0) < 0;
+    ftp_server_close_data(sess, datasock, failed);
+    free(text);
+}
+
+/**
+ * Runs command "rate": "rate <bytes/s> [weight]" limits the session's
+ * gets and weighs them against other transfers, "rate user <bytes/s>"
+ * limits every session of the user together and "rate server <bytes/s>"
+ * the whole server; rates take k, m or g, 0 lifts a limit, and
+ * transfers take the new rate at once; user and server limits stay
+ * within those given by -u and -r
+ * @param sess Pointer to session
+ * @param arg String scope, rate and weight
+ */
+void ftp_server_rate(Session *sess, char *arg)
+{
+    char scope[MAX_BUF_SIZE], value[MAX_BUF_SIZE];
+    uint64_t rate;
+    int weight = SHAPE_WEIGHT_DEFAULT;
+    int n = sscanf(arg, "%511s %511s", scope, value);
+
+    if (n == 2 && strcmp(scope, "user") == 0 && shape_parse_rate(value, &rate) == 0
+        && (user_rate_cap == 0 || (rate > 0 && rate <= user_rate_cap)))
+        shape_group_limit(sess->shape.group, rate);
+    else if (n == 2 && strcmp(scope, "server") == 0 && shape_parse_rate(value, &rate) == 0
+             && (server_rate_cap == 0 || (rate > 0 && rate <= server_rate_cap)))
+        shape_server_limit(rate);
+    else if (n >= 1 && shape_parse_rate(scope, &rate) == 0
+             && (n == 1 || sscanf(value, "%d", &weight) == 1)
+             && weight >= 1 && weight <= SHAPE_WEIGHT_MAX)
+        shape_flow_set(&sess->shape, rate, weight);
+    else
+    {
+        ftp_server_reply(sess, CODE_CMD_NOT_IMPL);
+        return;
+    }
+    ftp_server_reply(sess, CODE_VALID_CMD);
+}
+
+/**
+ * Runs command "dput": updates an existing file from a delta against it,
+ * see mftpdelta.h; the new file is built aside and renamed over the old
+ * one, which is left as it was if anything fails
+ * @param sess Pointer to session
+ * @param fname String file name
+ */
+void ftp_server_delta_put(Session *sess, char *fname)
+{
+    // the client puts files the server lacks whole
+    struct stat st;
+    int basis = openat(sess->dirfd, fname, O_RDONLY | O_CLOEXEC);
+    if (basis < 0 || fstat(basis, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (basis >= 0)
+            close(basis);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+
+    char tmpname[PATH_MAX];
+    int fd = ftp_server_mktemp(sess, fname, tmpname, sizeof(tmpname), 0600);
+    if (fd < 0)
+    {
+        perror("fail to create file");
+        close(basis);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+    fchmod(fd, st.st_mode & 07777);
+
+    // open data connection
+    ftp_server_reply(sess, CODE_OPEN_DATA_CONN);
+    int datasock;
+    if ((datasock = ftp_server_open_data(sess)) < 0)
+    {
+        close(basis);
+        close(fd);
+        unlinkat(sess->dirfd, tmpname, 0);
+        return;
+    }
+
+    ssize_t bytes = delta_recv_file(sess->prof.chunk_size, datasock, basis, fd, NULL);
+    if (bytes > 0)
+        metrics_bytes(bytes, 0);
+
+    // close, keeping the new file only if it is whole
+    ftp_server_close_data(sess, datasock, bytes == -1);
+    close(basis);
+
+    // a write failing only at close keeps the old file in place
+    if (bytes >= 0 && put_sync >= SYNC_FILE && fdatasync(fd) < 0)
+        bytes = -1;
+    if (close(fd) < 0)
+    {
+        perror("fail to close file");
+        bytes = -1;
+    }
+    if (bytes < 0 || ftp_server_commit(sess, -1, tmpname, fname, 1) < 0)
+    {
+        unlinkat(sess->dirfd, tmpname, 0);
+        ftp_server_reply(sess, CODE_FILE_UNAVAIL);
+        return;
+    }
+    ftp_server_reply(sess, CODE_CLOSE_DATA_CONN);
+}
+
+/**
+ * Runs command "pasv": opens a data port for the client to connect to
+ * and tells the client which one; the port is kept for the session
+ * @param sess Pointer to session
+ */
+void ftp_server_passive(Session *sess)
+{
+    int lstnsock = sess->pasv_sock;
+    int port = -1;
+    int taken[16], ntaken = 0;
+
+    while (lstnsock < 0 && pasv_ports.nports > 0 && ntaken < 16)
+    {
+        if ((port = port_pool_acquire(&pasv_ports)) < 0)
+            break;
+        if ((lstnsock = listen_socket(port, 1)) < 0)
+        {
+            // held by another process, skip it for this round
+            taken[ntaken++] = port;
+            port = -1;
+        }
+    }
+    for (int i = 0; i < ntaken; i++)
+        port_pool_release(&pasv_ports, taken[i]);
+
+    // without a configured range any free port will do
+    if (lstnsock < 0 && pasv_ports.nports == 0)
+        lstnsock = listen_socket(0, 1);
+
+    if (lstnsock < 0)
+    {
+        ftp_server_reply(sess, CODE_SERVICE_NOT_AVAIL);
+        return;
+    }
+
+    if (sess->pasv_sock < 0)
+    {
+        // accepted data connections inherit the buffer sizes
+        xfer_data_socket(&sess->prof, lstnsock);
+        sess->pasv_sock = lstnsock;
+        sess->pasv_port = port;
+    }
+    sess->passive = 1;
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(lstnsock, (struct sockaddr *) &addr, &addrlen);
+    int _port = htonl(ntohs(addr.sin_port));
+
+    ftp_server_reply(sess, CODE_ENTER_PASV);
+    if (send(sess->ctrlsock, &_port, sizeof(_port), 0) < 0)
+        perror("fail to send passive port");
+}
+
+/**
+ * Runs command "port": data connections go back to the client's data port
+ * @param sess Pointer to session
+ */
+void ftp_server_active(Session *sess)
+{
+    sess->passive = 0;
+    ftp_server_reply(sess, CODE_VALID_CMD);
+}
@@ -0,0 +1,87 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "mftputil.h"
+#include "mftpcmd.h"
+#include "mftpdelta.h"
+#include "mftphash.h"
+#include "mftpmetric.h"
+#include "mftpport.h"
+#include "mftpprof.h"
+#include "mftpshape.h"
+#include "mftpz.h"
+
+/* durability of uploads before they are answered, see -d */
+#define SYNC_NONE 0 /* renamed into place, written back whenever the kernel likes */
+#define SYNC_FILE 1 /* data on disk before the rename, a crash leaves no partial file */
+#define SYNC_DIR 2  /* the rename on disk as well */
+
+/* session state */
+#define SESS_USER 0 /* waiting for username */
+#define SESS_PASS 1 /* waiting for password */
+#define SESS_CMD 2  /* logged in, waiting for command */
+#define SESS_XFER 3 /* running a data transfer */
+
+typedef struct Session
+{
+    int ctrlsock;
+    int state;
+    int usr_ok;
+    CmdParser parser; /* commands read so far */
+    int passive;    /* client connects to pasv_sock for data */
+    int pasv_sock;  /* listening socket for data, -1 if none */
+    int pasv_port;  /* port taken from pool, -1 if none */
+    int block_mode; /* transfers are framed in blocks on one data connection */
+    int zlevel;     /* deflate level of files in mode z, 0 if uncompressed */
+    int verify;     /* get/put keep the CRC32C of whole files, see "vrfy" */
+    off_t allo;     /* size announced by "allo" for the next put, -1 if none */
+    int datasock;   /* data connection kept open in block mode, -1 if none */
+    uint32_t tag;   /* tag of the command being run, 0 if untagged */
+    int failed;     /* command being run got an error reply or broke its transfer */
+    int dirfd;      /* working directory, file names resolve against it */
+    XferProfile prof; /* chunk and socket tuning of data connections */
+    ShapeFlow shape;  /* rate and weight of what get and rget send */
+    int busy;         /* running a command, or a transfer is queued for it */
+    struct Session *prev, *next; /* in every session of the process */
+} Session;
+
+extern PortPool pasv_ports;
+extern int verbose;
+extern int put_sync;
+
+void ftp_server_session_init(Session *sess, int ctrlsock);
+void ftp_server_session_end(Session *sess);
+void ftp_server_close_idle(void);
+int ftp_server_login(Session *sess, Command *cmd);
+int ftp_server_command(Session *sess, Command *cmd);
+int ftp_server_is_transfer(Command *cmd);
+
+int ftp_server_response(int ctrlsock, int res_code);
+int ftp_server_reply(Session *sess, int res_code);
+int ftp_server_valid_user(char *usrname);
+int ftp_server_valid_pass(char *password);
+int ftp_server_data_conn(Session *sess);
+int ftp_server_open_data(Session *sess);
+void ftp_server_close_data(Session *sess, int datasock, int failed);
+FILE *ftp_server_fopen(Session *sess, const char *fname, int flags);
+
+void ftp_server_dir(Session *sess, char *cmd);
+void ftp_server_name_list(Session *sess, char *pattern);
+void ftp_server_manifest(Session *sess, char *arg);
+void ftp_server_chdir(Session *sess, char *dir);
+void ftp_server_get_file(Session *sess, char *fname);
+void ftp_server_get_range(Session *sess, char *arg);
+void ftp_server_size(Session *sess, char *fname);
+void ftp_server_put_file(Session *sess, char *fname);
+void ftp_server_allocate(Session *sess, char *arg);
+void ftp_server_delta_put(Session *sess, char *fname);
+void ftp_server_passive(Session *sess);
+void ftp_server_active(Session *sess);
+void ftp_server_mode(Session *sess, char *mode);
+void ftp_server_profile(Session *sess, char *name);
+void ftp_server_hash(Session *sess, char *arg);
+void ftp_server_verify(Session *sess, char *arg);
+void ftp_server_stat(Session *sess);
+void ftp_server_rate(Session *sess, char *arg);
+
+#endif